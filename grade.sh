@@ -6,15 +6,27 @@ TESTSPEC=mempager-tests/tests.spec
 
 make
 
-while read -r num frames blocks nodiff ; do
+while read -r num frames blocks nodiff opts ; do
     num=$((num))
     frames=$((frames))
     blocks=$((blocks))
     nodiff=$((nodiff))
     echo "running test$num"
     rm -rf mmu.sock mmu.pmem.img.*
-    ./bin/mmu $frames $blocks &> test$num.mmu.out &
-    sleep 1s
+    ./bin/mmu $frames $blocks $opts &> test$num.mmu.out &
+    mmu=$!
+    waited=0
+    while [ ! -S mmu.sock ] ; do
+        if ! kill -0 $mmu 2> /dev/null || [ $waited -ge 500 ] ; then
+            echo "test$num: mmu did not start, see test$num.mmu.out"
+            kill -SIGKILL $mmu 2> /dev/null
+            wait
+            rm -rf mmu.sock mmu.pmem.img.*
+            exit 1
+        fi
+        waited=$((waited + 1))
+        sleep 0.01
+    done
     ./bin/test$num &> test$num.out
     kill -SIGINT %1
     wait
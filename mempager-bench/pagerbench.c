@@ -0,0 +1,1022 @@
+/* Pager microbenchmarks.
+ *
+ * This program links `src/pager.c` directly against a stub MMU that
+ * only records calls, so the numbers below measure the pager's own
+ * bookkeeping (lookups, frame allocation, clock sweeps) without the
+ * socket round trips the real MMU adds to every fault.  Benchmarks that
+ * need them set `stub_delay_ns` to model the round trip with a sleep.
+ *
+ * usage: bin/pagerbench [BENCHMARK]
+ *
+ * With no arguments every benchmark runs.  Each benchmark prints one
+ * line per configuration with the average cost per operation. */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmu.h"
+#include "pager.h"
+
+/* Fake pids start high so they never collide with real ones. */
+#define BENCH_PID(i) ((pid_t)(100000 + (i)))
+
+/****************************************************************************
+ * stub MMU
+ ***************************************************************************/
+static char *stub_pmem = NULL;
+static char *stub_disk = NULL;
+static int stub_data = 0;
+const char *pmem = NULL;
+static unsigned long mmu_calls = 0;
+static unsigned long mmu_roundtrips = 0;
+static unsigned long stub_faults = 0;
+static unsigned long stub_pageins = 0;
+static unsigned long stub_read_faults = 0;
+static unsigned long stub_writes = 0;
+static unsigned long stub_sync_writes = 0;
+static unsigned long stub_evictions = 0;
+static unsigned long stub_sync_evictions = 0;
+static unsigned long stub_disk_ops = 0;
+static long stub_delay_ns = 0;
+static long stub_disk_delay_ns = 0;
+static pthread_t stub_main_thread;
+
+/* Protection the stub last installed on each page of the first
+ * STUB_CLIENTS clients, so benchmarks can replay memory accesses. */
+#define STUB_CLIENTS 64
+#define STUB_PAGES 256
+static unsigned char stub_prot[STUB_CLIENTS][STUB_PAGES];
+
+/* Frame the stub last mapped each page to.  With stub_data set, the stub
+ * also moves page contents between frames and a disk of its own, so
+ * benchmarks can check what a page holds. */
+static int stub_frame[STUB_CLIENTS][STUB_PAGES];
+
+static void stub_call(int roundtrip)
+{
+	__atomic_fetch_add(&mmu_calls, 1, __ATOMIC_RELAXED);
+	if(roundtrip) __atomic_fetch_add(&mmu_roundtrips, 1, __ATOMIC_RELAXED);
+	if(!roundtrip || !stub_delay_ns) return;
+	struct timespec ts = {0, stub_delay_ns};
+	nanosleep(&ts, NULL);
+}
+
+static void stub_setprot(pid_t pid, void *vaddr, int prot)
+{
+	long c = pid - 100000;
+	long i = ((intptr_t)vaddr - UVM_BASEADDR) / sysconf(_SC_PAGESIZE);
+	if(c < 0 || c >= STUB_CLIENTS || i < 0 || i >= STUB_PAGES) return;
+	stub_prot[c][i] = prot;
+}
+
+static void stub_pagein(void)
+{
+	__atomic_fetch_add(&stub_pageins, 1, __ATOMIC_RELAXED);
+	stub_call(0);
+}
+
+void mmu_zero_fill(int frame)
+{
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	if(stub_data) memset(stub_pmem + frame * pagesz, 0, pagesz);
+	stub_pagein();
+}
+static void stub_resident(pid_t pid, void *vaddr, int frame, int prot)
+{
+	long c = pid - 100000;
+	long i = ((intptr_t)vaddr - UVM_BASEADDR) / sysconf(_SC_PAGESIZE);
+	if(c >= 0 && c < STUB_CLIENTS && i >= 0 && i < STUB_PAGES)
+		__atomic_store_n(&stub_frame[c][i], frame, __ATOMIC_RELEASE);
+	stub_setprot(pid, vaddr, prot);
+}
+static void stub_nonresident(pid_t pid, void *vaddr)
+{
+	stub_setprot(pid, vaddr, PROT_NONE);
+	__atomic_fetch_add(&stub_evictions, 1, __ATOMIC_RELAXED);
+	if(pthread_equal(pthread_self(), stub_main_thread))
+		__atomic_fetch_add(&stub_sync_evictions, 1, __ATOMIC_RELAXED);
+}
+void mmu_resident(pid_t pid, void *vaddr, int frame, int prot)
+{
+	stub_resident(pid, vaddr, frame, prot);
+	stub_call(1);
+}
+void mmu_nonresident(pid_t pid, void *vaddr)
+{
+	stub_nonresident(pid, vaddr);
+	stub_call(1);
+}
+void mmu_chprot(pid_t pid, void *vaddr, int prot)
+{
+	stub_setprot(pid, vaddr, prot);
+	stub_call(1);
+}
+/* Posted changes take effect at once; the round trip is paid by the
+ * flush that waits for them. */
+static __thread int stub_posted = 0;
+
+void mmu_resident_async(pid_t pid, void *vaddr, int frame, int prot)
+{
+	stub_resident(pid, vaddr, frame, prot);
+	stub_posted = 1;
+	stub_call(0);
+}
+void mmu_nonresident_async(pid_t pid, void *vaddr)
+{
+	stub_nonresident(pid, vaddr);
+	stub_posted = 1;
+	stub_call(0);
+}
+void mmu_chprot_async(pid_t pid, void *vaddr, int prot)
+{
+	stub_setprot(pid, vaddr, prot);
+	stub_posted = 1;
+	stub_call(0);
+}
+void mmu_flush(void)
+{
+	if(!stub_posted) return;
+	stub_posted = 0;
+	stub_call(1);
+}
+/* A disk operation costs stub_disk_delay_ns however many pages it
+ * moves; reads only pay it when stub_disk_read_delay is set. */
+static int stub_disk_read_delay = 0;
+
+static void stub_disk_op(int read)
+{
+	__atomic_fetch_add(&stub_disk_ops, 1, __ATOMIC_RELAXED);
+	if(!stub_disk_delay_ns || (read && !stub_disk_read_delay)) return;
+	struct timespec ts = {0, stub_disk_delay_ns};
+	nanosleep(&ts, NULL);
+}
+
+static void stub_read_block(int block_from, int frame_to)
+{
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	if(stub_data)
+		memcpy(stub_pmem + frame_to * pagesz, stub_disk + block_from * pagesz, pagesz);
+	stub_pagein();
+}
+
+static void stub_write_block(int frame_from, int block_to)
+{
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	if(stub_data)
+		memcpy(stub_disk + block_to * pagesz, stub_pmem + frame_from * pagesz, pagesz);
+	__atomic_fetch_add(&stub_writes, 1, __ATOMIC_RELAXED);
+	if(pthread_equal(pthread_self(), stub_main_thread))
+		__atomic_fetch_add(&stub_sync_writes, 1, __ATOMIC_RELAXED);
+	stub_call(0);
+}
+
+void mmu_disk_read(int block_from, int frame_to)
+{
+	stub_read_block(block_from, frame_to);
+	stub_disk_op(1);
+}
+void mmu_disk_write(int frame_from, int block_to)
+{
+	stub_write_block(frame_from, block_to);
+	stub_disk_op(0);
+}
+void mmu_frame_copy(int frame_from, int frame_to)
+{
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	if(stub_data)
+		memcpy(stub_pmem + frame_to * pagesz, stub_pmem + frame_from * pagesz, pagesz);
+	stub_pagein();
+}
+void mmu_disk_discard(int block)
+{
+	(void)block;
+}
+void mmu_disk_readv(int block_from, const int *frames, int count)
+{
+	for(int i = 0; i < count; ++i) stub_read_block(block_from + i, frames[i]);
+	stub_disk_op(1);
+}
+void mmu_disk_writev(const int *frames, int count, int block_to)
+{
+	for(int i = 0; i < count; ++i) stub_write_block(frames[i], block_to + i);
+	stub_disk_op(0);
+}
+
+static void stub_init(int nframes, int nblocks)
+{
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	free(stub_pmem);
+	stub_pmem = calloc(nframes, pagesz);
+	if(!stub_pmem) exit(EXIT_FAILURE);
+	free(stub_disk);
+	stub_disk = NULL;
+	if(stub_data) {
+		stub_disk = calloc(nblocks, pagesz);
+		if(!stub_disk) exit(EXIT_FAILURE);
+	}
+	pmem = stub_pmem;
+	memset(stub_prot, 0, sizeof(stub_prot));
+	stub_pageins = 0;
+	stub_writes = 0;
+	stub_sync_writes = 0;
+	stub_evictions = 0;
+	stub_sync_evictions = 0;
+	pager_init(nframes, nblocks);
+}
+
+/* Accesses page `i` of client `c` the way a client process would:
+ * faulting until the stub MMU maps the page with enough protection. */
+static void stub_access(int c, int i, int write)
+{
+	int need = write ? PROT_WRITE : PROT_READ;
+	char *addr = (char *)UVM_BASEADDR + i * sysconf(_SC_PAGESIZE);
+	while(!(stub_prot[c][i] & need)) {
+		unsigned long pageins = stub_pageins;
+		__atomic_fetch_add(&stub_faults, 1, __ATOMIC_RELAXED);
+		pager_fault(BENCH_PID(c), addr);
+		if(stub_pageins != pageins)
+			__atomic_fetch_add(&stub_read_faults, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* With stub_data set, writes `value` all over page `i` of client `c` or
+ * reads its first byte.  The write is redone if the page lost its write
+ * access meanwhile, as a client's write would fault again. */
+static void stub_write_page(int c, int i, char value)
+{
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	do {
+		stub_access(c, i, 1);
+		int frame = __atomic_load_n(&stub_frame[c][i], __ATOMIC_ACQUIRE);
+		memset(stub_pmem + frame * pagesz, value, pagesz);
+	} while(!(__atomic_load_n(&stub_prot[c][i], __ATOMIC_ACQUIRE) & PROT_WRITE));
+}
+
+static char stub_read_page(int c, int i)
+{
+	stub_access(c, i, 0);
+	int frame = __atomic_load_n(&stub_frame[c][i], __ATOMIC_ACQUIRE);
+	return stub_pmem[frame * sysconf(_SC_PAGESIZE)];
+}
+
+/****************************************************************************
+ * helpers
+ ***************************************************************************/
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/****************************************************************************
+ * benchmarks
+ ***************************************************************************/
+
+/* Fault cost as the number of registered clients grows.  Every client
+ * owns one resident page; the timed loop faults on those pages round
+ * robin, so the cost is dominated by finding the faulting process. */
+static void bench_registry(void)
+{
+	static const int nclients[] = {1, 4, 16, 64, 256, 1024};
+	const long nfaults = 1 << 20;
+	printf("registry: fault cost vs. number of clients\n");
+	for(size_t k = 0; k < sizeof(nclients)/sizeof(nclients[0]); ++k) {
+		int n = nclients[k];
+		stub_init(2 * n, 2 * n);
+		void **pages = malloc(n * sizeof(pages[0]));
+		for(int i = 0; i < n; ++i) {
+			pager_create(BENCH_PID(i));
+			pages[i] = pager_extend(BENCH_PID(i));
+			pager_fault(BENCH_PID(i), pages[i]);
+		}
+		double start = now_ns();
+		for(long f = 0; f < nfaults; ++f) {
+			int i = f % n;
+			pager_fault(BENCH_PID(i), pages[i]);
+		}
+		double elapsed = now_ns() - start;
+		printf("  clients %5d  %8.1f ns/fault\n", n, elapsed / nfaults);
+		for(int i = 0; i < n; ++i) pager_destroy(BENCH_PID(i));
+		free(pages);
+	}
+}
+
+/* Fault cost as a function of the faulting page's position in a full
+ * 256-page address space.  The timed loop keeps faulting on one page, so
+ * the cost is dominated by finding the page table cell. */
+static void bench_pagetable(void)
+{
+	static const int targets[] = {0, 63, 127, 255};
+	const int npages = 256;
+	const long nfaults = 1 << 20;
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	printf("pagetable: fault cost vs. page index (%d pages)\n", npages);
+	stub_init(npages, npages);
+	pager_create(BENCH_PID(0));
+	for(int i = 0; i < npages; ++i) pager_extend(BENCH_PID(0));
+	for(size_t k = 0; k < sizeof(targets)/sizeof(targets[0]); ++k) {
+		char *page = (char *)UVM_BASEADDR + targets[k] * pagesz;
+		pager_fault(BENCH_PID(0), page);
+		double start = now_ns();
+		for(long f = 0; f < nfaults; ++f) {
+			pager_fault(BENCH_PID(0), page + (f & 0xff));
+		}
+		double elapsed = now_ns() - start;
+		printf("  page %5d  %8.1f ns/fault\n", targets[k], elapsed / nfaults);
+	}
+	pager_destroy(BENCH_PID(0));
+}
+
+/* First-touch fault cost when only the highest-numbered frame is free.
+ * The other frames are held by clients with 256 resident pages each; the
+ * loop creates a client, faults one page in and destroys it; only the
+ * fault is timed, so the cost is dominated by finding the free frame. */
+static void bench_frames(void)
+{
+	static const int nframes[] = {256, 4096, 65536};
+	const long nloops = 1 << 16;
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	printf("frames: first-touch fault cost vs. number of frames\n");
+	for(size_t k = 0; k < sizeof(nframes)/sizeof(nframes[0]); ++k) {
+		int n = nframes[k];
+		int nclients = n / 256;
+		stub_init(n, 2 * n);
+		for(int c = 0; c < nclients; ++c) {
+			pager_create(BENCH_PID(c));
+			int npages = (c == nclients - 1) ? 255 : 256;
+			for(int i = 0; i < npages; ++i) {
+				char *page = pager_extend(BENCH_PID(c));
+				pager_fault(BENCH_PID(c), page);
+			}
+		}
+		double elapsed = 0;
+		for(long l = 0; l < nloops; ++l) {
+			pager_create(BENCH_PID(nclients));
+			char *page = pager_extend(BENCH_PID(nclients));
+			double start = now_ns();
+			pager_fault(BENCH_PID(nclients), page + (l % pagesz));
+			elapsed += now_ns() - start;
+			pager_destroy(BENCH_PID(nclients));
+		}
+		printf("  frames %6d  %8.1f ns/fault\n", n, elapsed / nloops);
+		for(int c = 0; c < nclients; ++c) pager_destroy(BENCH_PID(c));
+	}
+}
+
+/* Fault cost under memory pressure as the number of clients grows.  Two
+ * active clients touch 256 pages each, round robin, with only 256 frames,
+ * so every fault runs the clock and evicts a page.  The other clients are
+ * registered but hold no frames. */
+static void bench_clock(void)
+{
+	static const int nidle[] = {0, 16, 64, 256, 1024};
+	const int nframes = 256, npages = 256;
+	const long nfaults = 1 << 18;
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	printf("clock: eviction fault cost vs. number of idle clients\n");
+	for(size_t k = 0; k < sizeof(nidle)/sizeof(nidle[0]); ++k) {
+		int n = nidle[k];
+		stub_init(nframes, 2 * npages + n);
+		for(int c = 0; c < n + 2; ++c) {
+			pager_create(BENCH_PID(c));
+			pager_extend(BENCH_PID(c));
+		}
+		for(int c = n; c < n + 2; ++c) {
+			for(int i = 1; i < npages; ++i) pager_extend(BENCH_PID(c));
+		}
+		double start = now_ns();
+		for(long f = 0; f < nfaults; ++f) {
+			int c = n + (f & 1), i = (f / 2) % npages;
+			pager_fault(BENCH_PID(c), (char *)UVM_BASEADDR + i * pagesz);
+		}
+		double elapsed = now_ns() - start;
+		printf("  idle %5d  %8.1f ns/fault\n", n, elapsed / nfaults);
+		for(int c = 0; c < n + 2; ++c) pager_destroy(BENCH_PID(c));
+	}
+}
+
+/* Lifecycle cost of many small clients.  Each client is created, touches
+ * two pages and stays registered; then every client is destroyed.  The
+ * cost is dominated by allocating, initializing and scanning per-process
+ * page tables. */
+static void bench_small(void)
+{
+	static const int nclients[] = {64, 1024, 8192};
+	printf("small: create, touch 2 pages and destroy cost vs. number of clients\n");
+	for(size_t k = 0; k < sizeof(nclients)/sizeof(nclients[0]); ++k) {
+		int n = nclients[k];
+		stub_init(2 * n, 2 * n);
+		double start = now_ns();
+		for(int c = 0; c < n; ++c) {
+			pager_create(BENCH_PID(c));
+			for(int i = 0; i < 2; ++i) {
+				char *page = pager_extend(BENCH_PID(c));
+				pager_fault(BENCH_PID(c), page);
+			}
+		}
+		for(int c = 0; c < n; ++c) pager_destroy(BENCH_PID(c));
+		double elapsed = now_ns() - start;
+		printf("  clients %5d  %8.1f ns/client\n", n, elapsed / n);
+	}
+}
+
+/* Page-in rate of each replacement policy on access patterns that
+ * defeat plain clock.  One client with 256 pages runs on 64 frames:
+ *
+ *   loop:  cycles over 80 pages, a little more than memory holds;
+ *   scan:  rereads 32 hot pages between one-time reads of 64 cold ones;
+ *   skew:  pseudo random accesses, 80% of them to 20% of the pages.
+ *
+ * A quarter of the accesses are writes. */
+#define POLICY_FRAMES 64
+#define POLICY_PAGES 256
+#define POLICY_ACCESSES (1 << 18)
+
+static int workload_loop(long n, unsigned *seed) { return n % 80; }
+
+static int workload_scan(long n, unsigned *seed)
+{
+	long round = n / 320, step = n % 320;
+	if(step < 256) return step % 32;
+	return 32 + (round * 64 + step - 256) % (POLICY_PAGES - 32);
+}
+
+static int workload_skew(long n, unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	unsigned r = *seed >> 8;
+	if(r % 10 < 8) return (r / 10) % (POLICY_PAGES / 5);
+	return (r / 10) % POLICY_PAGES;
+}
+
+static void bench_policy(void)
+{
+	static const char *policies[] = {"clock", "wsclock", "clockpro", "arc"};
+	static const struct {
+		const char *name;
+		int (*next)(long n, unsigned *seed);
+	} workloads[] = {
+		{"loop", workload_loop},
+		{"scan", workload_scan},
+		{"skew", workload_skew},
+	};
+	printf("policy: page-ins per 100 accesses (%d frames, %d pages)\n",
+			POLICY_FRAMES, POLICY_PAGES);
+	for(size_t w = 0; w < sizeof(workloads)/sizeof(workloads[0]); ++w) {
+		for(size_t k = 0; k < sizeof(policies)/sizeof(policies[0]); ++k) {
+			pager_setopt("policy", policies[k]);
+			stub_init(POLICY_FRAMES, POLICY_PAGES);
+			pager_create(BENCH_PID(0));
+			for(int i = 0; i < POLICY_PAGES; ++i) pager_extend(BENCH_PID(0));
+			unsigned seed = 1;
+			double start = now_ns();
+			for(long n = 0; n < POLICY_ACCESSES; ++n) {
+				stub_access(0, workloads[w].next(n, &seed), (n & 3) == 0);
+			}
+			double elapsed = now_ns() - start;
+			printf("  %-5s %-9s %6.2f page-ins  %6.1f ns/access\n",
+					workloads[w].name, policies[k],
+					100.0 * stub_pageins / POLICY_ACCESSES,
+					elapsed / POLICY_ACCESSES);
+			pager_destroy(BENCH_PID(0));
+		}
+	}
+	pager_setopt("policy", "clock");
+}
+
+/* Disk writes caused by evictions on a read-mostly workload.  One client
+ * writes all of its 256 pages once, then cycles over them on 64 frames
+ * with the given fraction of writes, so every access evicts a page. */
+static void bench_writeback(void)
+{
+	static const int write_pct[] = {0, 5, 25, 100};
+	const int nframes = 64, npages = 256;
+	const long naccesses = 1 << 16;
+	printf("writeback: disk writes per 100 evictions vs. write ratio "
+			"(%d frames, %d pages)\n", nframes, npages);
+	for(size_t k = 0; k < sizeof(write_pct)/sizeof(write_pct[0]); ++k) {
+		stub_init(nframes, npages);
+		pager_create(BENCH_PID(0));
+		for(int i = 0; i < npages; ++i) pager_extend(BENCH_PID(0));
+		for(int i = 0; i < npages; ++i) stub_access(0, i, 1);
+		unsigned long writes = stub_writes, pageins = stub_pageins;
+		unsigned seed = 1;
+		for(long n = 0; n < naccesses; ++n) {
+			seed = seed * 1103515245 + 12345;
+			int write = (seed >> 8) % 100 < (unsigned)write_pct[k];
+			stub_access(0, n % npages, write);
+		}
+		printf("  writes %3d%%  %6.1f disk writes\n", write_pct[k],
+				100.0 * (stub_writes - writes) / (stub_pageins - pageins));
+		pager_destroy(BENCH_PID(0));
+	}
+}
+
+/* Synchronous disk writes with and without the background cleaner.  One
+ * client cycles over 128 pages on 64 frames, writing half the time, with
+ * 20us of think time between accesses; disk writes take 50us. */
+static void bench_cleaner(void)
+{
+	const int nframes = 64, npages = 128;
+	const long naccesses = 1 << 13;
+	struct timespec think = {0, 20000};
+	printf("cleaner: synchronous writes per 100 evictions "
+			"(%d frames, %d pages, 50%% writes)\n", nframes, npages);
+	stub_disk_delay_ns = 50000;
+	for(int enabled = 0; enabled <= 1; ++enabled) {
+		pager_setopt("cleaner", enabled ? "1" : "0");
+		pager_setopt("cleaner_interval", "100");
+		stub_init(nframes, npages);
+		pager_create(BENCH_PID(0));
+		for(int i = 0; i < npages; ++i) pager_extend(BENCH_PID(0));
+		unsigned seed = 1;
+		double faulting = 0;
+		for(long n = 0; n < naccesses; ++n) {
+			seed = seed * 1103515245 + 12345;
+			double start = now_ns();
+			stub_access(0, n % npages, (seed >> 8) & 1);
+			faulting += now_ns() - start;
+			nanosleep(&think, NULL);
+		}
+		printf("  cleaner %-3s %6.1f sync writes %6.1f background  %8.0f ns/access\n",
+				enabled ? "on" : "off",
+				100.0 * stub_sync_writes / (stub_pageins - nframes),
+				100.0 * (stub_writes - stub_sync_writes) / (stub_pageins - nframes),
+				faulting / naccesses);
+		pager_destroy(BENCH_PID(0));
+	}
+	pager_setopt("cleaner", "0");
+	stub_init(nframes, npages);
+	stub_disk_delay_ns = 0;
+}
+
+/* Direct reclaim with and without free frame watermarks.  One client
+ * reads 128 pages round robin on 64 frames, with 20us round trips and
+ * 200us of think time between accesses. */
+static void bench_reclaim(void)
+{
+	static const char *watermarks[][2] = {{"0", "0"}, {"4", "8"}, {"8", "16"}};
+	const int nframes = 64, npages = 128;
+	const long naccesses = 1 << 12;
+	struct timespec think = {0, 200000};
+	printf("reclaim: direct reclaims per 100 evictions "
+			"(%d frames, %d pages, 20us round trips)\n", nframes, npages);
+	stub_delay_ns = 20000;
+	for(size_t k = 0; k < sizeof(watermarks)/sizeof(watermarks[0]); ++k) {
+		pager_setopt("reclaim_low", watermarks[k][0]);
+		pager_setopt("reclaim_high", watermarks[k][1]);
+		stub_init(nframes, npages);
+		pager_create(BENCH_PID(0));
+		for(int i = 0; i < npages; ++i) pager_extend(BENCH_PID(0));
+		double faulting = 0;
+		for(long n = 0; n < naccesses; ++n) {
+			double start = now_ns();
+			stub_access(0, n % npages, 0);
+			faulting += now_ns() - start;
+			nanosleep(&think, NULL);
+		}
+		printf("  low %-2s high %-2s %6.1f direct  %8.0f ns/access\n",
+				watermarks[k][0], watermarks[k][1],
+				100.0 * stub_sync_evictions / stub_evictions,
+				faulting / naccesses);
+		pager_destroy(BENCH_PID(0));
+	}
+	pager_setopt("reclaim_low", "0");
+	pager_setopt("reclaim_high", "0");
+	stub_init(nframes, npages);
+	stub_delay_ns = 0;
+}
+
+/* Faults, faults that wait for a disk read, and round trips, counting the fault's own,
+ * with readahead.  One client writes its 256 pages once, then reads them
+ * sequentially or at random on 64 frames, with 20us of think time between
+ * accesses so the reclaim thread keeps 16 to 32 frames free. */
+static void bench_readahead(void)
+{
+	static const char *configs[][2] = {{"0", "0"}, {"8", "0"}, {"8", "1"}, {"32", "1"}};
+	const int nframes = 64, npages = 256;
+	const long naccesses = 1 << 12;
+	struct timespec think = {0, 20000};
+	printf("readahead: faults, disk waits and round trips per 100 reads "
+			"(%d frames, %d pages)\n", nframes, npages);
+	pager_setopt("reclaim_low", "16");
+	pager_setopt("reclaim_high", "32");
+	for(int random = 0; random <= 1; ++random) {
+		for(size_t k = 0; k < sizeof(configs)/sizeof(configs[0]); ++k) {
+			pager_setopt("readahead", configs[k][0]);
+			pager_setopt("readahead_map", configs[k][1]);
+			stub_init(nframes, npages);
+			pager_create(BENCH_PID(0));
+			for(int i = 0; i < npages; ++i) pager_extend(BENCH_PID(0));
+			for(int i = 0; i < npages; ++i) stub_access(0, i, 1);
+			unsigned long faults = stub_faults, roundtrips = mmu_roundtrips;
+			unsigned long waits = stub_read_faults;
+			unsigned seed = 1;
+			for(long n = 0; n < naccesses; ++n) {
+				seed = seed * 1103515245 + 12345;
+				stub_access(0, random ? (seed >> 8) % npages : n % npages, 0);
+				nanosleep(&think, NULL);
+			}
+			printf("  %-10s readahead %-2s map %s %6.1f faults %6.1f disk waits %6.1f round trips\n",
+					random ? "random" : "sequential",
+					configs[k][0], configs[k][1],
+					100.0 * (stub_faults - faults) / naccesses,
+					100.0 * (stub_read_faults - waits) / naccesses,
+					100.0 * (stub_faults - faults + mmu_roundtrips - roundtrips) / naccesses);
+			pager_destroy(BENCH_PID(0));
+		}
+	}
+	pager_setopt("readahead", "0");
+	pager_setopt("readahead_map", "0");
+	pager_setopt("reclaim_low", "0");
+	pager_setopt("reclaim_high", "0");
+	stub_init(nframes, npages);
+}
+
+/* Frame fills, evictions and round trips with and without the zero frame.
+ * One client reads its 256 pages over and over on 64 frames, writing
+ * one page in eight, or all of them, after its first read. */
+static void bench_zero(void)
+{
+	static const int write_every[] = {8, 1};
+	const int nframes = 64, npages = 256, passes = 16;
+	printf("zero: frame fills, evictions and round trips per 100 accesses "
+			"(%d frames, %d pages)\n", nframes, npages);
+	for(size_t w = 0; w < sizeof(write_every)/sizeof(write_every[0]); ++w) {
+		for(int zero = 0; zero <= 1; ++zero) {
+			pager_setopt("zero_frame", zero ? "1" : "0");
+			stub_init(nframes, npages);
+			pager_create(BENCH_PID(0));
+			for(int i = 0; i < npages; ++i) pager_extend(BENCH_PID(0));
+			unsigned long pageins = stub_pageins, evictions = stub_evictions;
+			unsigned long faults = stub_faults, roundtrips = mmu_roundtrips;
+			long naccesses = 0;
+			for(int pass = 0; pass < passes; ++pass) {
+				for(int i = 0; i < npages; ++i, ++naccesses) {
+					stub_access(0, i, 0);
+					if(pass == 0 && i % write_every[w] == 0) {
+						stub_access(0, i, 1);
+						++naccesses;
+					}
+				}
+			}
+			printf("  writes 1/%d  zero frame %d  %6.1f fills %6.1f evictions %6.1f round trips\n",
+					write_every[w], zero,
+					100.0 * (stub_pageins - pageins) / naccesses,
+					100.0 * (stub_evictions - evictions) / naccesses,
+					100.0 * (stub_faults - faults + mmu_roundtrips - roundtrips) / naccesses);
+			pager_destroy(BENCH_PID(0));
+		}
+	}
+	pager_setopt("zero_frame", "0");
+	stub_init(nframes, npages);
+}
+
+/* Evictions, disk traffic and faults with and without deduplication.
+ * Eight clients write the same eight contents into their 32 pages each,
+ * like forked copies of one program, then read them round robin on 128
+ * frames, rewriting one page in 64 with what it already held.  Every read
+ * checks that the page still holds what was written. */
+static void bench_dedup(void)
+{
+	const int nclients = 8, npages = 32, nframes = 128;
+	const int passes = 32;
+	struct timespec think = {0, 10000};
+	printf("dedup: evictions, disk traffic and faults per 100 accesses "
+			"(%d clients, %d pages each, %d frames)\n", nclients, npages, nframes);
+	pager_setopt("dedup_batch", "32");
+	pager_setopt("dedup_interval", "200");
+	stub_data = 1;
+	for(int dedup = 0; dedup <= 1; ++dedup) {
+		pager_setopt("dedup", dedup ? "1" : "0");
+		stub_init(nframes, nclients * npages);
+		for(int c = 0; c < nclients; ++c) {
+			pager_create(BENCH_PID(c));
+			for(int i = 0; i < npages; ++i) pager_extend(BENCH_PID(c));
+		}
+		for(int c = 0; c < nclients; ++c)
+			for(int i = 0; i < npages; ++i) stub_write_page(c, i, 1 + i % 8);
+		unsigned long evictions = stub_evictions, writes = stub_writes;
+		unsigned long pageins = stub_pageins, faults = stub_faults;
+		long naccesses = 0, errors = 0;
+		for(int pass = 0; pass < passes; ++pass) {
+			for(int i = 0; i < npages; ++i) {
+				for(int c = 0; c < nclients; ++c, ++naccesses) {
+					if(naccesses % 64 == 63) stub_write_page(c, i, 1 + i % 8);
+					else if(stub_read_page(c, i) != 1 + i % 8) errors++;
+					nanosleep(&think, NULL);
+				}
+			}
+		}
+		printf("  dedup %d  %6.1f evictions %6.1f disk writes %6.1f disk reads %6.1f faults  %ld errors\n",
+				dedup,
+				100.0 * (stub_evictions - evictions) / naccesses,
+				100.0 * (stub_writes - writes) / naccesses,
+				100.0 * (stub_pageins - pageins) / naccesses,
+				100.0 * (stub_faults - faults) / naccesses, errors);
+		for(int c = 0; c < nclients; ++c) pager_destroy(BENCH_PID(c));
+	}
+	stub_data = 0;
+	pager_setopt("dedup", "0");
+	pager_setopt("dedup_batch", "64");
+	pager_setopt("dedup_interval", "1000");
+	stub_init(nframes, nclients * npages);
+}
+
+/* Clients admitted and faults that fail for lack of swap with overcommit.
+ * Clients extend 32 pages each until 256 blocks are committed, or 64
+ * clients run, and write the first 8 of them on 64 frames; a write is
+ * given up after 4 failed faults. */
+static void bench_overcommit(void)
+{
+	static const char *percent[] = {"0", "100", "400", "800"};
+	const int nframes = 64, nblocks = 256, npages = 32, nwritten = 8;
+	printf("overcommit: clients admitted and ended for lack of memory "
+			"(%d frames, %d blocks, %d pages per client)\n",
+			nframes, nblocks, npages);
+	for(size_t k = 0; k < sizeof(percent)/sizeof(percent[0]); ++k) {
+		pager_setopt("overcommit", percent[k]);
+		stub_init(nframes, nblocks);
+		int nclients = 0;
+		while(nclients < STUB_CLIENTS) {
+			pager_create(BENCH_PID(nclients));
+			int i = 0;
+			while(i < npages && pager_extend(BENCH_PID(nclients))) i++;
+			if(i < npages) {
+				pager_destroy(BENCH_PID(nclients));
+				break;
+			}
+			nclients++;
+		}
+		/* A client whose fault fails is ended, as the MMU would end
+		 * it, which frees memory for the others. */
+		int ended = 0;
+		unsigned long evictions = stub_evictions;
+		for(int c = 0; c < nclients; ++c) {
+			for(int i = 0; i < nwritten; ++i) {
+				char *addr = (char *)UVM_BASEADDR + i * sysconf(_SC_PAGESIZE);
+				while(!(stub_prot[c][i] & PROT_WRITE))
+					if(pager_fault(BENCH_PID(c), addr)) break;
+				if(!(stub_prot[c][i] & PROT_WRITE)) {
+					pager_destroy(BENCH_PID(c));
+					ended++;
+					break;
+				}
+			}
+		}
+		printf("  overcommit %3s%%  %2d clients  %4lu evictions  %3d ended\n",
+				percent[k], nclients, stub_evictions - evictions, ended);
+		for(int c = 0; c < nclients; ++c) pager_destroy(BENCH_PID(c));
+	}
+	pager_setopt("overcommit", "0");
+	stub_init(nframes, nblocks);
+}
+
+/* Fault throughput under pressure with swap clustering.  One client
+ * writes its 256 pages in order, over and over, on 64 frames, with
+ * readahead; every disk operation costs 50us however many pages it
+ * moves.  Reported per page written. */
+static void bench_cluster(void)
+{
+	static const char *cluster[] = {"0", "4", "8", "16"};
+	const int nframes = 64, npages = 256, passes = 8;
+	printf("cluster: sequential writes on %d frames, %d pages, "
+			"readahead 8, 50us disk operations\n", nframes, npages);
+	pager_setopt("readahead", "8");
+	stub_disk_delay_ns = 50000;
+	stub_disk_read_delay = 1;
+	for(size_t k = 0; k < sizeof(cluster)/sizeof(cluster[0]); ++k) {
+		pager_setopt("swap_cluster", cluster[k]);
+		stub_init(nframes, npages);
+		pager_create(BENCH_PID(0));
+		pager_extend_n(BENCH_PID(0), npages);
+		for(int i = 0; i < npages; ++i) stub_access(0, i, 1);
+		unsigned long faults = stub_faults, ops = stub_disk_ops;
+		double start = now_ns();
+		for(int p = 0; p < passes; ++p) {
+			for(int i = 0; i < npages; ++i) stub_access(0, i, 1);
+		}
+		double elapsed = now_ns() - start;
+		long n = (long)passes * npages;
+		printf("  swap_cluster %2s  %5.2f disk ops/page  %8.0f faults/s  %6.1f us/page\n",
+				cluster[k], (double)(stub_disk_ops - ops) / n,
+				(stub_faults - faults) / (elapsed / 1e9), elapsed / n / 1e3);
+		pager_destroy(BENCH_PID(0));
+	}
+	stub_disk_delay_ns = 0;
+	stub_disk_read_delay = 0;
+	pager_setopt("swap_cluster", "0");
+	pager_setopt("readahead", "0");
+}
+
+/* A client looping over 24 hot pages next to a client scanning 256 pages,
+ * on 64 frames; they take turns, a page each.  Without quotas the scan
+ * keeps evicting the hot pages; with them the scanner recycles its own
+ * frames.  Page-ins of each client per 100 of its accesses. */
+static void bench_quota(void)
+{
+	static const char *quotas[][2] = {{"0", "0"}, {"0", "32"}, {"24", "0"}, {"24", "40"}};
+	const int nframes = 64, hot = 24, scan = 256;
+	const long naccesses = 100000;
+	printf("quota: page-ins per 100 accesses, hot loop vs. scan "
+			"(%d frames, %d hot pages)\n", nframes, hot);
+	for(size_t k = 0; k < sizeof(quotas)/sizeof(quotas[0]); ++k) {
+		pager_setopt("quota_min", quotas[k][0]);
+		pager_setopt("quota_max", quotas[k][1]);
+		stub_init(nframes, hot + scan);
+		pager_create(BENCH_PID(0));
+		pager_create(BENCH_PID(1));
+		pager_extend_n(BENCH_PID(0), hot);
+		pager_extend_n(BENCH_PID(1), scan);
+		unsigned long pageins[2] = {0, 0};
+		for(long n = 0; n < naccesses; ++n) {
+			unsigned long before = stub_pageins;
+			stub_access(0, n % hot, 0);
+			pageins[0] += stub_pageins - before;
+			before = stub_pageins;
+			stub_access(1, n % scan, 0);
+			pageins[1] += stub_pageins - before;
+		}
+		printf("  quota_min %2s quota_max %2s  hot %6.2f  scan %6.2f\n",
+				quotas[k][0], quotas[k][1], 100.0 * pageins[0] / naccesses,
+				100.0 * pageins[1] / naccesses);
+		pager_destroy(BENCH_PID(0));
+		pager_destroy(BENCH_PID(1));
+	}
+	pager_setopt("quota_min", "0");
+	pager_setopt("quota_max", "0");
+}
+
+/* Startup cost of test12's shape, 64 clients extending 32 pages each,
+ * with one request per page and with one per client.  Each request
+ * models its MMU round trip with a 20us sleep; the pager-only time is
+ * measured without it. */
+static void bench_extend(void)
+{
+	static const size_t batch[] = {1, 8, 32};
+	const int nclients = 64, npages = 32;
+	printf("extend: %d clients x %d pages, pages per request "
+			"(20us round trips)\n", nclients, npages);
+	for(size_t k = 0; k < sizeof(batch)/sizeof(batch[0]); ++k) {
+		for(int delay = 0; delay < 2; ++delay) {
+			stub_delay_ns = delay ? 20000 : 0;
+			stub_init(nclients, nclients * npages);
+			unsigned long roundtrips = mmu_roundtrips;
+			double start = now_ns();
+			for(int c = 0; c < nclients; ++c) {
+				pager_create(BENCH_PID(c));
+				for(int i = 0; i < npages; i += batch[k]) {
+					stub_call(1);
+					if(!pager_extend_n(BENCH_PID(c), batch[k])) exit(EXIT_FAILURE);
+				}
+			}
+			double elapsed = now_ns() - start;
+			for(int c = 0; c < nclients; ++c) pager_destroy(BENCH_PID(c));
+			if(!delay) {
+				printf("  batch %2zu  %6.1f ns/page pager", batch[k],
+						elapsed / (nclients * npages));
+			} else {
+				printf("  %5lu requests  %7.2f ms total\n",
+						mmu_roundtrips - roundtrips, elapsed / 1e6);
+			}
+		}
+	}
+	stub_delay_ns = 0;
+}
+
+/* Fault throughput with concurrent clients, one thread each, like the
+ * MMU's thread-per-client server.  Every client cycles over more pages
+ * than there are frames, so every fault evicts; the MMU round trips are
+ * modeled with a sleep, so faults of different clients can overlap. */
+#define STRESS_FRAMES 64
+#define STRESS_PAGES 96
+#define STRESS_FAULTS 1000
+
+static void * stress_client(void *arg)
+{
+	pid_t pid = (pid_t)(intptr_t)arg;
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	for(int f = 0; f < STRESS_FAULTS; ++f) {
+		int i = f % STRESS_PAGES;
+		pager_fault(pid, (char *)UVM_BASEADDR + i * pagesz);
+	}
+	return NULL;
+}
+
+static void bench_stress(void)
+{
+	static const int nclients[] = {1, 2, 4, 8, 16, 32, 64};
+	printf("stress: fault throughput vs. concurrent clients "
+			"(%d frames, %d pages each, 20us round trips)\n",
+			STRESS_FRAMES, STRESS_PAGES);
+	stub_delay_ns = 20000;
+	for(size_t k = 0; k < sizeof(nclients)/sizeof(nclients[0]); ++k) {
+		int n = nclients[k];
+		stub_init(STRESS_FRAMES, n * STRESS_PAGES);
+		pthread_t *threads = malloc(n * sizeof(threads[0]));
+		for(int c = 0; c < n; ++c) {
+			pager_create(BENCH_PID(c));
+			for(int i = 0; i < STRESS_PAGES; ++i) pager_extend(BENCH_PID(c));
+		}
+		double start = now_ns();
+		for(int c = 0; c < n; ++c) {
+			pthread_create(&threads[c], NULL, stress_client,
+					(void *)(intptr_t)BENCH_PID(c));
+		}
+		for(int c = 0; c < n; ++c) pthread_join(threads[c], NULL);
+		double elapsed = now_ns() - start;
+		printf("  clients %5d  %10.0f faults/s\n", n,
+				n * STRESS_FAULTS / (elapsed / 1e9));
+		for(int c = 0; c < n; ++c) pager_destroy(BENCH_PID(c));
+		free(threads);
+	}
+	stub_delay_ns = 0;
+}
+
+/* Clock sweeps over the pages of many clients.  32 clients share 128
+ * frames; each rereads 3 hot pages between reads of the next of its 8
+ * cold pages, so every eviction sweeps past hot pages of several clients
+ * and revokes their access.  Every MMU round trip costs 20us. */
+static void bench_sweep(void)
+{
+	const int nclients = 32, nhot = 3, ncold = 8, nframes = 128, passes = 16;
+	printf("sweep: %d clients x %d hot + %d cold pages on %d frames, "
+			"20us round trips\n", nclients, nhot, ncold, nframes);
+	stub_init(nframes, nclients * (nhot + ncold));
+	for(int c = 0; c < nclients; ++c) {
+		pager_create(BENCH_PID(c));
+		pager_extend_n(BENCH_PID(c), nhot + ncold);
+	}
+	stub_delay_ns = 20000;
+	unsigned long faults = stub_faults, trips = mmu_roundtrips;
+	double start = now_ns();
+	for(int p = 0; p < passes; ++p) {
+		for(int i = 0; i < ncold; ++i) {
+			for(int c = 0; c < nclients; ++c) {
+				for(int h = 0; h < nhot; ++h) stub_access(c, h, 0);
+				stub_access(c, nhot + i, 0);
+			}
+		}
+	}
+	double elapsed = now_ns() - start;
+	unsigned long n = stub_faults - faults;
+	printf("  %5.2f round trips/fault  %8.0f faults/s\n",
+			(double)(mmu_roundtrips - trips) / n, n / (elapsed / 1e9));
+	for(int c = 0; c < nclients; ++c) pager_destroy(BENCH_PID(c));
+	stub_delay_ns = 0;
+}
+
+struct benchmark {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct benchmark benchmarks[] = {
+	{"registry", bench_registry},
+	{"pagetable", bench_pagetable},
+	{"frames", bench_frames},
+	{"clock", bench_clock},
+	{"small", bench_small},
+	{"policy", bench_policy},
+	{"writeback", bench_writeback},
+	{"cleaner", bench_cleaner},
+	{"reclaim", bench_reclaim},
+	{"readahead", bench_readahead},
+	{"zero", bench_zero},
+	{"dedup", bench_dedup},
+	{"overcommit", bench_overcommit},
+	{"extend", bench_extend},
+	{"quota", bench_quota},
+	{"cluster", bench_cluster},
+	{"sweep", bench_sweep},
+	{"stress", bench_stress},
+	{NULL, NULL}
+};
+
+int main(int argc, char **argv)
+{
+	int found = 0;
+	stub_main_thread = pthread_self();
+	for(const struct benchmark *b = benchmarks; b->name; ++b) {
+		if(argc > 1 && strcmp(argv[1], b->name)) continue;
+		b->run();
+		found = 1;
+	}
+	if(!found) {
+		printf("usage: %s [BENCHMARK]\n\nbenchmarks:", argv[0]);
+		for(const struct benchmark *b = benchmarks; b->name; ++b)
+			printf(" %s", b->name);
+		printf("\n");
+		exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,304 @@
+/* MMU server benchmark.
+ *
+ * Drives a running MMU (`bin/mmu`) with many clients from a few
+ * threads, speaking the protocol in `mmuproto.h` directly instead of
+ * forking a process per client.  Every client connects before the clock
+ * starts, so the MMU serves all of them at once.  Each client then sends
+ * CREATE and EXTEND and alternates SEGV and SYSLOG on its page for
+ * ROUNDS rounds before it exits.  The REMAP and CHPROT messages the
+ * pager sends, vectored or not, are acknowledged right away, as
+ * `uvm_thread` would.
+ *
+ * usage: bin/serverbench NCLIENTS ROUNDS MMUPID
+ *
+ * Prints requests per second, the mean request latency and the most
+ * threads the MMU ran, sampled from /proc.  `serverbench.sh` runs it
+ * against the thread-per-client and the epoll server. */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmuproto.h"
+
+#define DRIVERS 4
+/* Fake pids start high so they never collide with real ones. */
+#define BENCH_PID(i) ((uint32_t)(200000 + (i)))
+
+struct client {
+	int sock;
+	int rounds;
+	uint64_t vaddr;
+	double sent;
+};
+
+struct driver {
+	pthread_t thread;
+	struct client *clients;
+	int nclients;
+	unsigned long requests;
+	double latency;
+};
+
+static int nrounds = 0;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void xsend(int sock, const void *msg, size_t len)
+{
+	if(send(sock, msg, len, MSG_NOSIGNAL) != (ssize_t)len) {
+		perror("send");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void xrecv(int sock, void *msg, size_t len)
+{
+	if(recv(sock, msg, len, MSG_WAITALL) != (ssize_t)len) {
+		perror("recv");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void request(struct client *c, const void *msg, size_t len)
+{
+	c->sent = now_ns();
+	xsend(c->sock, msg, len);
+}
+
+static void request_segv(struct client *c)
+{
+	struct mmu_proto_segv_req req = {MMU_PROTO_SEGV_REQ, 0, c->vaddr};
+	request(c, &req, sizeof(req));
+}
+
+/* Handles the next message from the MMU; returns 1 once the client
+ * exited. */
+static int handle(struct driver *d, struct client *c)
+{
+	uint32_t type;
+	if(recv(c->sock, &type, sizeof(type), MSG_PEEK | MSG_WAITALL) != sizeof(type)) {
+		perror("recv");
+		exit(EXIT_FAILURE);
+	}
+	if(type == MMU_PROTO_REMAP_REP) {
+		struct mmu_proto_remap_rep rep;
+		xrecv(c->sock, &rep, sizeof(rep));
+		struct mmu_proto_remap_req ack = {MMU_PROTO_REMAP_REQ};
+		xsend(c->sock, &ack, sizeof(ack));
+		return 0;
+	}
+	if(type == MMU_PROTO_CHPROT_REP) {
+		struct mmu_proto_chprot_rep rep;
+		xrecv(c->sock, &rep, sizeof(rep));
+		struct mmu_proto_chprot_req ack = {MMU_PROTO_CHPROT_REQ};
+		xsend(c->sock, &ack, sizeof(ack));
+		return 0;
+	}
+	if(type == MMU_PROTO_REMAP_N_REP) {
+		struct mmu_proto_remap_n_rep rep;
+		size_t head = offsetof(struct mmu_proto_remap_n_rep, pages);
+		xrecv(c->sock, &rep, head);
+		xrecv(c->sock, rep.pages, rep.count * sizeof(rep.pages[0]));
+		struct mmu_proto_remap_req ack = {MMU_PROTO_REMAP_REQ};
+		xsend(c->sock, &ack, sizeof(ack));
+		return 0;
+	}
+	if(type == MMU_PROTO_CHPROT_N_REP) {
+		struct mmu_proto_chprot_n_rep rep;
+		size_t head = offsetof(struct mmu_proto_chprot_n_rep, pages);
+		xrecv(c->sock, &rep, head);
+		xrecv(c->sock, rep.pages, rep.count * sizeof(rep.pages[0]));
+		struct mmu_proto_chprot_req ack = {MMU_PROTO_CHPROT_REQ};
+		xsend(c->sock, &ack, sizeof(ack));
+		return 0;
+	}
+
+	d->requests++;
+	d->latency += now_ns() - c->sent;
+	switch(type) {
+	case MMU_PROTO_CREATE_REP: {
+		struct mmu_proto_create_rep rep;
+		xrecv(c->sock, &rep, sizeof(rep));
+		struct mmu_proto_extend_req req = {MMU_PROTO_EXTEND_REQ};
+		request(c, &req, sizeof(req));
+		return 0;
+	}
+	case MMU_PROTO_EXTEND_REP: {
+		struct mmu_proto_extend_rep rep;
+		xrecv(c->sock, &rep, sizeof(rep));
+		if(!rep.vaddr) {
+			fprintf(stderr, "extend failed; give the MMU more blocks\n");
+			exit(EXIT_FAILURE);
+		}
+		c->vaddr = rep.vaddr;
+		request_segv(c);
+		return 0;
+	}
+	case MMU_PROTO_SEGV_REP: {
+		struct mmu_proto_segv_rep rep;
+		xrecv(c->sock, &rep, sizeof(rep));
+		if(rep.retcode) {
+			fprintf(stderr, "fault failed; give the MMU more blocks\n");
+			exit(EXIT_FAILURE);
+		}
+		struct mmu_proto_syslog_req req = {MMU_PROTO_SYSLOG_REQ, 8, c->vaddr};
+		request(c, &req, sizeof(req));
+		return 0;
+	}
+	case MMU_PROTO_SYSLOG_REP: {
+		struct mmu_proto_syslog_rep rep;
+		xrecv(c->sock, &rep, sizeof(rep));
+		if(--c->rounds > 0) {
+			request_segv(c);
+		} else {
+			struct mmu_proto_exit_req req = {MMU_PROTO_EXIT_REQ};
+			request(c, &req, sizeof(req));
+		}
+		return 0;
+	}
+	case MMU_PROTO_EXIT_REP: {
+		struct mmu_proto_exit_rep rep;
+		xrecv(c->sock, &rep, sizeof(rep));
+		close(c->sock);
+		return 1;
+	}
+	default:
+		fprintf(stderr, "unexpected message type %u\n", type);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void * driver_thread(void *arg)
+{
+	struct driver *d = arg;
+	int epfd = epoll_create1(0);
+	if(epfd == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	for(int i = 0; i < d->nclients; ++i) {
+		struct epoll_event ev = {EPOLLIN, {.ptr = &d->clients[i]}};
+		epoll_ctl(epfd, EPOLL_CTL_ADD, d->clients[i].sock, &ev);
+	}
+
+	int left = d->nclients;
+	struct epoll_event events[64];
+	while(left > 0) {
+		int n = epoll_wait(epfd, events, 64, -1);
+		for(int k = 0; k < n; ++k) left -= handle(d, events[k].data.ptr);
+	}
+	close(epfd);
+	return NULL;
+}
+
+static int connect_mmu(void)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, MMU_PROTO_UNIX_PATH, sizeof(addr.sun_path) - 1);
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	return sock;
+}
+
+static int mmu_threads(pid_t pid)
+{
+	char path[64], line[128];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	FILE *f = fopen(path, "r");
+	if(!f) return 0;
+	int threads = 0;
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "Threads: %d", &threads) == 1) break;
+	}
+	fclose(f);
+	return threads;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 4) {
+		printf("usage: %s NCLIENTS ROUNDS MMUPID\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	int nclients = atoi(argv[1]);
+	nrounds = atoi(argv[2]);
+	pid_t mmu = (pid_t)atoi(argv[3]);
+	if(nclients < DRIVERS || nrounds < 1) {
+		printf("NCLIENTS must be at least %d and ROUNDS at least 1\n", DRIVERS);
+		exit(EXIT_FAILURE);
+	}
+
+	struct client *clients = calloc(nclients, sizeof(clients[0]));
+	if(!clients) exit(EXIT_FAILURE);
+	for(int i = 0; i < nclients; ++i) {
+		clients[i].sock = connect_mmu();
+		clients[i].rounds = nrounds;
+	}
+
+	struct driver drivers[DRIVERS];
+	int per = nclients / DRIVERS;
+	int peak = 0;
+	double start = now_ns();
+	for(int t = 0; t < DRIVERS; ++t) {
+		struct driver *d = &drivers[t];
+		d->clients = clients + t * per;
+		d->nclients = t == DRIVERS - 1 ? nclients - t * per : per;
+		d->requests = 0;
+		d->latency = 0;
+		for(int i = 0; i < d->nclients; ++i) {
+			struct client *c = &d->clients[i];
+			struct mmu_proto_create_req req = {MMU_PROTO_CREATE_REQ,
+					BENCH_PID(c - clients), 0};
+			request(c, &req, sizeof(req));
+		}
+		pthread_create(&d->thread, NULL, driver_thread, d);
+	}
+	for(int t = 0; t < DRIVERS; ++t) {
+		/* sample the MMU's threads while the drivers run */
+		while(pthread_tryjoin_np(drivers[t].thread, NULL) != 0) {
+			int threads = mmu_threads(mmu);
+			if(threads > peak) peak = threads;
+			struct timespec ts = {0, 1000000};
+			nanosleep(&ts, NULL);
+		}
+	}
+	double elapsed = now_ns() - start;
+
+	unsigned long requests = 0;
+	double latency = 0;
+	for(int t = 0; t < DRIVERS; ++t) {
+		requests += drivers[t].requests;
+		latency += drivers[t].latency;
+	}
+	printf("%8.0f requests/s  %7.1f us/request  %4d MMU threads\n",
+			requests / (elapsed / 1e9), latency / requests / 1e3, peak);
+	free(clients);
+	exit(EXIT_SUCCESS);
+}
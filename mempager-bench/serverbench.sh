@@ -0,0 +1,30 @@
+#!/bin/bash
+# Runs bin/serverbench against the thread-per-client MMU server
+# (workers=0) and the epoll one, for each client count given.
+#
+# usage: mempager-bench/serverbench.sh [NCLIENTS...]
+
+cd "$(dirname "$0")/.."
+ulimit -n 4096
+for n in ${@:-64 128 256 512 1024} ; do
+  for workers in 0 4 ; do
+    rm -f mmu.sock
+    ./bin/mmu 64 1024 workers=$workers > /dev/null &
+    mmu=$!
+    waited=0
+    while [ ! -S mmu.sock ] ; do
+      if ! kill -0 $mmu 2> /dev/null || [ $waited -ge 50 ] ; then
+        echo "mmu did not start with workers=$workers" >&2
+        kill -KILL $mmu 2> /dev/null
+        exit 1
+      fi
+      waited=$((waited + 1))
+      sleep 0.1
+    done
+    printf "clients %5d  workers %d  " $n $workers
+    ./bin/serverbench $n 16 $mmu
+    kill -INT $mmu ; sleep 0.2 ; kill -INT $mmu 2> /dev/null
+    wait $mmu
+  done
+done
+rm -f mmu.sock mmu.log.0
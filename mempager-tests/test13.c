@@ -0,0 +1,34 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uvm.h"
+
+/* test with mmu 4 8 overcommit=200: extends twice as many pages as
+ * there are blocks, which only works if blocks are given to pages when
+ * they are written back, then writes and reads back one page fewer than
+ * memory and disk hold together; the spare slot lets pages swap in. */
+int num_pages = 16;
+int num_written = 11;
+int main(void) {
+	size_t PAGESIZE = sysconf(_SC_PAGESIZE);
+	uvm_create();
+	char *first = uvm_extend();
+	for(int i = 1; i < num_pages; ++i) {
+		if(uvm_extend() == NULL) {
+			printf("extend %d failed\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("extended %d pages\n", num_pages);
+	for(int i = 0; i < num_written; ++i) {
+		sprintf(first + i*PAGESIZE, "page %d", i);
+	}
+	for(int i = 0; i < num_written; ++i) {
+		char *page = first + i*PAGESIZE;
+		if(strncmp(page, "page ", 5)) printf("page %d lost\n", i);
+		uvm_syslog(page, 7);
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,35 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uvm.h"
+
+/* test with mmu 4 8 overcommit=200: the child writes more pages than
+ * memory and disk hold together, so a fault fails and the child must
+ * exit with EXIT_FAILURE instead of faulting forever. */
+int num_pages = 16;
+int main(void) {
+	size_t PAGESIZE = sysconf(_SC_PAGESIZE);
+	pid_t pid = fork();
+	if(pid == 0) {
+		uvm_create();
+		char *first = uvm_extend();
+		for(int i = 1; i < num_pages; ++i) uvm_extend();
+		for(int i = 0; i < num_pages; ++i) {
+			sprintf(first + i*PAGESIZE, "page %d", i);
+		}
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if(WIFEXITED(status)) {
+		printf("child exited with status %d\n", WEXITSTATUS(status));
+	} else {
+		printf("child killed by signal %d\n", WTERMSIG(status));
+	}
+	exit(EXIT_SUCCESS);
+}
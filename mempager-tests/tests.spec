@@ -10,3 +10,5 @@
 10 4 8 0
 11 2 3 1
 12 256 1024 1
+13 4 8 0 overcommit=200
+14 4 8 0 overcommit=200
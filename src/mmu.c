@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -8,61 +11,124 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
 
+#include "mmu.h"
 #include "pager.h"
+#include "pidhash.h"
 #include "mmuproto.h"
+#include "ring.h"
 
-#define MMU_MAX_EVENTS 32
-#define MMU_MAX_SOCK 1024
+#define MMU_MIN_BUCKETS 64
+#define MMU_WORKER_IDLE_MS 100
+#define MMU_MAX_POSTED 64
+#define MMU_ACK_POLL_MS 10
 
 
-pid_t id2pid[UINT8_MAX];
-uint8_t nextid = 0;
-
 /****************************************************************************
  * structure definitions and static variables
  ***************************************************************************/
+struct mmu_zpool {/*{{{*/
+	pthread_mutex_t lock;
+	size_t max;
+	size_t bytes;
+	char **data;
+	uint16_t *len;
+	unsigned long pages;
+	unsigned long stores;
+	unsigned long loads;
+	unsigned long spills;
+	unsigned long rejects;
+	unsigned long discards;
+	unsigned long disk_reads;
+	unsigned long disk_writes;
+	unsigned long disk_batches;
+};/*}}}*/
 struct mmu_data {/*{{{*/
 	int running;
 	int npages;
+	int nblocks;
 	char *pmem;
 	char *disk;
+	struct mmu_zpool zpool;
 	char *pmem_fn;
 	int pmem_fd;
 	int sock;
-	struct mmu_client * sock2client[MMU_MAX_SOCK];
+	int epfd;
+	pthread_mutex_t pool_lock;
+	int nworkers;
+	int nbusy;
+	unsigned long changes;
+	unsigned long messages;
+	pthread_rwlock_t clients_lock;	/* guards the fields below */
+	struct mmu_client *clients;	/* every connected client */
+	struct mmu_client **pid2client;	/* hash buckets of created clients */
+	size_t nbuckets;
+	size_t ncreated;
+	int nextid;	/* next trace id given out */
+	uint64_t *ids;	/* bitmap of trace ids in use, with recycle_ids */
+	size_t nidwords;
 };/*}}}*/
 struct mmu_client {/*{{{*/
 	int running;
 	int sock;
 	pid_t pid;
 	pthread_t thread;
+	pthread_mutex_t ack_lock;	/* guards the fields below */
+	pthread_cond_t acked;
+	int acks;	/* acknowledgements not received yet */
+	int posts;	/* threads that posted changes and did not flush */
+	int qtype;	/* type of the queued message, 0 if none */
+	union {
+		struct mmu_proto_remap_n_rep remap;
+		struct mmu_proto_chprot_n_rep chprot;
+	} queue;
+	struct ring_shm *shm;	/* NULL if the client uses its socket */
+	pthread_mutex_t tx_lock;	/* serializes writes to shm->rep */
+	int id;		/* number in the trace, -1 before CREATE */
+	int listed;	/* in mmu->clients */
+	struct mmu_client *next;	/* in mmu->clients */
+	struct mmu_client *prev;
+	struct mmu_client *hnext;	/* in its mmu->pid2client bucket */
 };/*}}}*/
 static struct mmu_data *mmu = NULL;
 const char *pmem = NULL;
 static size_t PAGESIZE = 0;
+static size_t swap_pool = 0;
+static size_t mmu_workers = 4;
+static size_t mmu_rings = 0;
+static size_t mmu_recycle_ids = 0;
+static size_t pmem_memfd = 0;
+static size_t pmem_populate = 0;
+/* Clients the calling thread posted changes to since its last flush. */
+static __thread struct mmu_client *mmu_posted[MMU_MAX_POSTED];
+static __thread int mmu_nposted = 0;
 
 /****************************************************************************
  * static function declarations
  ***************************************************************************/
 static void mmu_destroy(void);
 static void mmu_client_destroy(struct mmu_client *c);
+static void mmu_client_abort(struct mmu_client *c);
 static void mmu_shutdown_action(int signum, siginfo_t *si, void *context);
 static void mmu_accept_loop(void);
 static void * mmu_client_thread(void *vclient);
-
-int get_pid_id(pid_t pid) {
-	int i = 0;
-	for(; id2pid[i] != pid; i++);
-	return i;
-}
+static void * mmu_worker_thread(void *arg);
+static int mmu_zpool_store(int frame_from, int block_to);
+static int mmu_zpool_load(int block_from, int frame_to);
+static void mmu_zpool_drop(int block);
+static void mmu_clients_add(struct mmu_client *c);
+static void mmu_clients_create(struct mmu_client *c, pid_t pid);
+static void mmu_clients_remove(struct mmu_client *c);
 
 /****************************************************************************
  * initialization functions {{{
@@ -81,12 +147,26 @@ void mmu_init(int npages, int nblocks)/*{{{*/
 	if(!mmu) logea(__FILE__, __LINE__, NULL);
 	mmu->running = 1;
 	mmu->npages = npages;
+	mmu->nblocks = nblocks;
+	mmu->epfd = -1;
+	pthread_mutex_init(&mmu->pool_lock, NULL);
+	mmu->nworkers = 0;
+	mmu->nbusy = 0;
+	mmu->changes = 0;
+	mmu->messages = 0;
+	pthread_rwlock_init(&mmu->clients_lock, NULL);
+	mmu->clients = NULL;
+	mmu->pid2client = NULL;
+	mmu->nbuckets = 0;
+	mmu->ncreated = 0;
+	mmu->nextid = 0;
+	mmu->ids = NULL;
+	mmu->nidwords = 0;
 
 	mmu_init_disk(nblocks);
 	mmu_init_pmem(npages);
 	mmu_init_sock();
 	mmu_init_sigs();
-	memset(mmu->sock2client, 0, MMU_MAX_SOCK*sizeof(mmu->sock2client[0]));
 }/*}}}*/
 
 void mmu_init_disk(int nblocks)/*{{{*/
@@ -95,25 +175,52 @@ void mmu_init_disk(int nblocks)/*{{{*/
 	mmu->disk = malloc(disksz);
 	if(!mmu->disk) logea(__FILE__, __LINE__, NULL);
 	logd(LOG_INFO, "%s: %zu bytes in %d blocks\n", __func__, disksz, nblocks);
+
+	memset(&mmu->zpool, 0, sizeof(mmu->zpool));
+	pthread_mutex_init(&mmu->zpool.lock, NULL);
+	mmu->zpool.max = swap_pool;
+	if(!swap_pool) return;
+	mmu->zpool.data = calloc(nblocks, sizeof(mmu->zpool.data[0]));
+	mmu->zpool.len = calloc(nblocks, sizeof(mmu->zpool.len[0]));
+	if(!mmu->zpool.data || !mmu->zpool.len) logea(__FILE__, __LINE__, NULL);
+	logd(LOG_INFO, "%s: compressed swap pool of %zu bytes\n", __func__,
+			swap_pool);
 }/*}}}*/
 
 void mmu_init_pmem(int npages)/*{{{*/
 {
-	mmu->pmem_fn = strdup("mmu.pmem.img.XXXXXX");
-	if(mmu->pmem_fn == NULL) logea(__FILE__, __LINE__, NULL);
-	mmu->pmem_fd = mkstemp(mmu->pmem_fn);
-	if(mmu->pmem_fd == -1) logea(__FILE__, __LINE__, NULL);
+	/* Clients open the frames by path, so a memfd is handed out as its
+	 * /proc entry. */
+	if(pmem_memfd) {
+		mmu->pmem_fd = memfd_create("mmu.pmem", MFD_CLOEXEC);
+		if(mmu->pmem_fd == -1) logea(__FILE__, __LINE__, NULL);
+		if(asprintf(&mmu->pmem_fn, "/proc/%d/fd/%d", (int)getpid(),
+				mmu->pmem_fd) == -1)
+			logea(__FILE__, __LINE__, NULL);
+	} else {
+		mmu->pmem_fn = strdup("mmu.pmem.img.XXXXXX");
+		if(mmu->pmem_fn == NULL) logea(__FILE__, __LINE__, NULL);
+		mmu->pmem_fd = mkstemp(mmu->pmem_fn);
+		if(mmu->pmem_fd == -1) logea(__FILE__, __LINE__, NULL);
+	}
 	logd(LOG_INFO, "%s: mmap fd %d path %s\n", __func__, mmu->pmem_fd,
 			mmu->pmem_fn);
 
+	/* Allocate the blocks up front so running out of space fails here
+	 * rather than as a SIGBUS when a frame is first touched. */
 	size_t memsz = PAGESIZE * npages;
-	for(size_t i = 0; i < npages*PAGESIZE; ++i) {
-		write(mmu->pmem_fd, "z", 1);
+	if(ftruncate(mmu->pmem_fd, memsz)) logea(__FILE__, __LINE__, NULL);
+	int rc = posix_fallocate(mmu->pmem_fd, 0, memsz);
+	if(rc && rc != EOPNOTSUPP && rc != EINVAL) {
+		errno = rc;
+		logea(__FILE__, __LINE__, NULL);
 	}
 
 	int prot = PROT_READ | PROT_WRITE;
-	mmu->pmem = mmap(NULL, memsz, prot, MAP_SHARED, mmu->pmem_fd, 0);
+	int flags = MAP_SHARED | (pmem_populate ? MAP_POPULATE : 0);
+	mmu->pmem = mmap(NULL, memsz, prot, flags, mmu->pmem_fd, 0);
 	if(mmu->pmem == MAP_FAILED) logea(__FILE__, __LINE__, NULL);
+	memset(mmu->pmem, 'z', memsz);
 	pmem = mmu->pmem;
 	logd(LOG_INFO, "%s: %zu bytes in %d pages\n", __func__, memsz, npages);
 }/*}}}*/
@@ -154,14 +261,30 @@ void mmu_destroy(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "%s: starting\n", __func__);
 	assert(mmu);
-	unlink(mmu->pmem_fn);
+	if(!pmem_memfd) unlink(mmu->pmem_fn);
 	free(mmu->pmem_fn);
-	for(int i = 3; i < MMU_MAX_SOCK; ++i) {
-		if(!mmu->sock2client[i]) continue;
-		mmu_client_destroy(mmu->sock2client[i]);
-	}
+	while(mmu->clients) mmu_client_destroy(mmu->clients);
+	free(mmu->pid2client);
+	free(mmu->ids);
+	pthread_rwlock_destroy(&mmu->clients_lock);
 	munmap(mmu->pmem, mmu->npages * PAGESIZE);
+	struct mmu_zpool *z = &mmu->zpool;
+	if(z->max) {
+		logd(LOG_INFO, "%s: swap pool %lu pages in %zu bytes, %lu stores "
+				"%lu loads %lu spills %lu rejects %lu discards\n",
+				__func__, z->pages, z->bytes, z->stores, z->loads,
+				z->spills, z->rejects, z->discards);
+		for(int i = 0; i < mmu->nblocks; ++i) free(z->data[i]);
+		free(z->data);
+		free(z->len);
+	}
+	logd(LOG_INFO, "%s: disk %lu reads %lu writes, %lu batched operations\n",
+			__func__, z->disk_reads, z->disk_writes, z->disk_batches);
+	logd(LOG_INFO, "%s: %lu protection changes in %lu messages\n",
+			__func__, mmu->changes, mmu->messages);
+	pthread_mutex_destroy(&z->lock);
 	free(mmu->disk);
+	if(mmu->epfd != -1) close(mmu->epfd);
 	close(mmu->sock);
 	unlink(MMU_PROTO_UNIX_PATH);
 	free(mmu);
@@ -173,15 +296,159 @@ void mmu_shutdown_action(int signum, siginfo_t *si, void *context)/*{{{*/
 {
 	assert(si->si_signo == SIGINT);
 	mmu->running = 0;
+	/* wakes accept even if we got here before mmu_accept_loop called it */
+	shutdown(mmu->sock, SHUT_RDWR);
 }
 /*}}}*/
 /*}}}*/
 
+/****************************************************************************
+ * client table {{{
+ *
+ * Every connected client is in the `clients` list; those that sent
+ * CREATE are also in the `pid2client` hash table, which doubles its
+ * buckets when it holds as many clients as buckets.  Clients are
+ * numbered in the trace in the order they send CREATE.  With
+ * `recycle_ids` set a client takes the lowest id no other created
+ * client has instead, which keeps ids small when many clients come
+ * and go but renumbers the trace whenever one exits before another is
+ * created.  Pager threads look clients up sharing `clients_lock`.
+ ***************************************************************************/
+static void mmu_clients_rehash(size_t nbuckets)/*{{{*/
+{
+	/* Called with clients_lock held for writing. */
+	struct mmu_client **buckets = calloc(nbuckets, sizeof(buckets[0]));
+	if(!buckets) logea(__FILE__, __LINE__, NULL);
+	for(struct mmu_client *c = mmu->clients; c; c = c->next) {
+		if(c->id < 0) continue;
+		size_t b = pid_hash(c->pid, nbuckets);
+		c->hnext = buckets[b];
+		buckets[b] = c;
+	}
+	free(mmu->pid2client);
+	mmu->pid2client = buckets;
+	mmu->nbuckets = nbuckets;
+}/*}}}*/
+
+static int mmu_clients_take_id(void)/*{{{*/
+{
+	/* Called with clients_lock held for writing. */
+	if(!mmu_recycle_ids) return mmu->nextid++;
+	size_t w = 0;
+	while(w < mmu->nidwords && mmu->ids[w] == UINT64_MAX) w++;
+	if(w == mmu->nidwords) {
+		size_t n = mmu->nidwords ? 2 * mmu->nidwords : 4;
+		uint64_t *ids = realloc(mmu->ids, n * sizeof(ids[0]));
+		if(!ids) logea(__FILE__, __LINE__, NULL);
+		memset(ids + mmu->nidwords, 0, (n - mmu->nidwords) * sizeof(ids[0]));
+		mmu->ids = ids;
+		mmu->nidwords = n;
+	}
+	int bit = __builtin_ctzll(~mmu->ids[w]);
+	mmu->ids[w] |= 1ULL << bit;
+	return (int)(w * 64 + bit);
+}/*}}}*/
+
+void mmu_clients_add(struct mmu_client *c)/*{{{*/
+{
+	pthread_rwlock_wrlock(&mmu->clients_lock);
+	c->prev = NULL;
+	c->next = mmu->clients;
+	if(mmu->clients) mmu->clients->prev = c;
+	mmu->clients = c;
+	c->listed = 1;
+	pthread_rwlock_unlock(&mmu->clients_lock);
+}/*}}}*/
+
+void mmu_clients_create(struct mmu_client *c, pid_t pid)/*{{{*/
+{
+	/* Gives c its pid and trace id and makes it searchable. */
+	pthread_rwlock_wrlock(&mmu->clients_lock);
+	assert(c->id < 0);
+	c->pid = pid;
+	c->id = mmu_clients_take_id();
+	if(mmu->ncreated >= mmu->nbuckets) {
+		size_t n = mmu->nbuckets ? 2 * mmu->nbuckets : MMU_MIN_BUCKETS;
+		mmu_clients_rehash(n);
+	}
+	size_t b = pid_hash(pid, mmu->nbuckets);
+	c->hnext = mmu->pid2client[b];
+	mmu->pid2client[b] = c;
+	mmu->ncreated++;
+	pthread_rwlock_unlock(&mmu->clients_lock);
+}/*}}}*/
+
+void mmu_clients_remove(struct mmu_client *c)/*{{{*/
+{
+	pthread_rwlock_wrlock(&mmu->clients_lock);
+	if(!c->listed) goto out;
+	if(c->prev) c->prev->next = c->next;
+	else mmu->clients = c->next;
+	if(c->next) c->next->prev = c->prev;
+	c->listed = 0;
+	if(c->id >= 0) {
+		struct mmu_client **link;
+		link = &mmu->pid2client[pid_hash(c->pid, mmu->nbuckets)];
+		while(*link != c) link = &(*link)->hnext;
+		*link = c->hnext;
+		if(mmu_recycle_ids)
+			mmu->ids[c->id / 64] &= ~(1ULL << (c->id % 64));
+		mmu->ncreated--;
+	}
+	out:
+	pthread_rwlock_unlock(&mmu->clients_lock);
+}/*}}}*/
+/*}}}*/
+
 /****************************************************************************
  * main loop and client functions {{{
  ***************************************************************************/
+/* With `mmu_workers` set, clients are served by a pool of worker threads
+ * sharing an epoll instance instead of a thread each.  Client sockets
+ * are registered with EPOLLONESHOT, so at most one worker serves a
+ * client at a time and its messages are handled in order; the worker
+ * rearms the socket once the message is handled.  Workers take one
+ * event at a time, so a worker blocked in the pager holds no other
+ * client back.
+ *
+ * A worker serving a fault may block in the pager waiting for another
+ * client to acknowledge a CHPROT or REMAP.  That acknowledgement can be
+ * queued behind a request the other client sent first, which a worker
+ * must consume before the pager sees it.  So the pool always keeps a
+ * worker waiting for events: when the last idle worker picks a message
+ * up, it starts another one.  Workers beyond `mmu_workers` exit after
+ * MMU_WORKER_IDLE_MS without events. */
+static void mmu_worker_start(void)/*{{{*/
+{
+	/* Called with pool_lock held. */
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, mmu_worker_thread, NULL)) {
+		logd(LOG_WARN, "%s: pthread_create failed\n", __func__);
+		return;
+	}
+	pthread_detach(thread);
+	mmu->nworkers++;
+}/*}}}*/
+
+static void mmu_client_rearm(struct mmu_client *c)/*{{{*/
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = c;
+	if(epoll_ctl(mmu->epfd, EPOLL_CTL_MOD, c->sock, &ev) == -1)
+		logea(__FILE__, __LINE__, NULL);
+}/*}}}*/
+
 void mmu_accept_loop(void)/*{{{*/
 {
+	if(mmu_workers) {
+		mmu->epfd = epoll_create1(0);
+		if(mmu->epfd == -1) logea(__FILE__, __LINE__, NULL);
+		pthread_mutex_lock(&mmu->pool_lock);
+		for(size_t i = 0; i < mmu_workers; ++i) mmu_worker_start();
+		pthread_mutex_unlock(&mmu->pool_lock);
+		logd(LOG_INFO, "%s: %zu workers\n", __func__, mmu_workers);
+	}
 	while(mmu->running) {
 		struct sockaddr_un addr;
 		socklen_t addrlen = sizeof(addr);
@@ -189,13 +456,29 @@ void mmu_accept_loop(void)/*{{{*/
 		int nsock = accept(mmu->sock, (struct sockaddr *)&addr, &addrlen);
 		if(nsock == -1) continue;
 		logd(LOG_DEBUG, "%s: sock %d\n", __func__, nsock);
-		logd(LOG_DEBUG, "%s: creating thread\n", __func__);
 		struct mmu_client *c = malloc(sizeof(*c));
 		if(!c) logea(__FILE__, __LINE__, NULL);
-		mmu->sock2client[nsock] = c;
 		c->running = 1;
 		c->sock = nsock;
 		c->pid = 0;
+		c->id = -1;
+		pthread_mutex_init(&c->ack_lock, NULL);
+		pthread_cond_init(&c->acked, NULL);
+		c->acks = 0;
+		c->posts = 0;
+		c->qtype = 0;
+		c->shm = NULL;
+		pthread_mutex_init(&c->tx_lock, NULL);
+		mmu_clients_add(c);
+		if(mmu_workers) {
+			struct epoll_event ev;
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.ptr = c;
+			if(epoll_ctl(mmu->epfd, EPOLL_CTL_ADD, nsock, &ev) == -1)
+				logea(__FILE__, __LINE__, NULL);
+			continue;
+		}
+		logd(LOG_DEBUG, "%s: creating thread\n", __func__);
 		pthread_create(&c->thread, NULL, mmu_client_thread, c);
 		pthread_detach(c->thread);
 	}
@@ -203,11 +486,57 @@ void mmu_accept_loop(void)/*{{{*/
 }/*}}}*/
 
 static void mmu_client_log(const struct mmu_client *c, const char *fname, const char *msg);
+static ssize_t mmu_client_peek(struct mmu_client *c, uint32_t *type, int block);
+static ssize_t mmu_client_recv(struct mmu_client *c, void *buf, size_t len);
+static ssize_t mmu_client_xmit(struct mmu_client *c, const void *buf, size_t len);
 static void mmu_client_create(struct mmu_client *c);
 static void mmu_client_extend(struct mmu_client *c);
+static void mmu_client_extend_n(struct mmu_client *c);
 static void mmu_client_syslog(struct mmu_client *c);
 static void mmu_client_segv(struct mmu_client *c);
 static void mmu_client_exit(struct mmu_client *c);
+static void mmu_client_quiesce(struct mmu_client *c);
+static int mmu_client_take_ack(struct mmu_client *c);
+static void mmu_client_free(struct mmu_client *c);
+
+static int mmu_client_dispatch(struct mmu_client *c, uint32_t type)/*{{{*/
+{
+	/* Returns -1 if the message is invalid. */
+	switch(type) {
+	case MMU_PROTO_CREATE_REQ:
+		mmu_client_create(c);
+		break;
+	case MMU_PROTO_EXTEND_REQ:
+		mmu_client_extend(c);
+		break;
+	case MMU_PROTO_EXTEND_N_REQ:
+		mmu_client_extend_n(c);
+		break;
+	case MMU_PROTO_SYSLOG_REQ:
+		mmu_client_syslog(c);
+		break;
+	case MMU_PROTO_SEGV_REQ:
+		mmu_client_segv(c);
+		break;
+	case MMU_PROTO_REMAP_REQ:
+	case MMU_PROTO_CHPROT_REQ:
+	{
+		/* acknowledgements the pager threads wait for */
+		pthread_mutex_lock(&c->ack_lock);
+		int r = mmu_client_take_ack(c);
+		pthread_mutex_unlock(&c->ack_lock);
+		if(r < 0) return -1;
+		break;
+	}
+	case MMU_PROTO_EXIT_REQ:
+		mmu_client_exit(c);
+		break;
+	default:
+		mmu_client_log(c, __func__, "invalid message type");
+		return -1;
+	}
+	return 0;
+}/*}}}*/
 
 void * mmu_client_thread(void *vclient)/*{{{*/
 {
@@ -215,40 +544,16 @@ void * mmu_client_thread(void *vclient)/*{{{*/
 	while(mmu->running && c->running) {
 		mmu_client_log(c, __func__, "recv");
 		uint32_t type;
-		ssize_t cnt = recv(c->sock, &type, sizeof(type), MSG_PEEK);
+		ssize_t cnt = mmu_client_peek(c, &type, 1);
 		if(!mmu->running || !c->running) {
 			mmu_client_log(c, __func__, "breaking loop");
 			break;
 		}
 		if(cnt != sizeof(type)) goto out_client;
-		switch(type) {
-		case MMU_PROTO_CREATE_REQ:
-			mmu_client_create(c);
-			break;
-		case MMU_PROTO_EXTEND_REQ:
-			mmu_client_extend(c);
-			break;
-		case MMU_PROTO_SYSLOG_REQ:
-			mmu_client_syslog(c);
-			break;
-		case MMU_PROTO_SEGV_REQ:
-			mmu_client_segv(c);
-			break;
-		case MMU_PROTO_REMAP_REQ:
-		case MMU_PROTO_CHPROT_REQ:
-			/* these messages are handled by the pager thread */
-			break;
-		case MMU_PROTO_EXIT_REQ:
-			mmu_client_exit(c);
-			break;
-		default:
-			mmu_client_log(c, __func__, "invalid message type");
-			goto out_client;
-			break;
-		}
+		if(mmu_client_dispatch(c, type)) goto out_client;
 	}
 	mmu_client_log(c, __func__, "finished");
-	free(c);
+	mmu_client_free(c);
 	pthread_exit(NULL);
 
 	out_client:
@@ -256,12 +561,137 @@ void * mmu_client_thread(void *vclient)/*{{{*/
 	pthread_exit(NULL);
 }/*}}}*/
 
+static void mmu_client_service_rings(struct mmu_client *c)/*{{{*/
+{
+	/* The socket of a client using rings only gets wakeup bytes, which
+	 * it sends when we armed its ring, so we handle messages until the
+	 * ring stays empty with the ring armed. */
+	char buf[64];
+	ssize_t cnt = recv(c->sock, buf, sizeof(buf), MSG_DONTWAIT);
+	if(cnt == 0) goto out_client;
+	if(cnt == -1 && errno != EAGAIN && errno != EWOULDBLOCK) goto out_client;
+	struct ring *r = &c->shm->req;
+	while(c->running) {
+		uint32_t type;
+		if(!ring_peek(r, &type, sizeof(type))) {
+			if(!ring_spin(r, sizeof(type)) && ring_arm(r, RING_WAIT_SOCK)) {
+				mmu_client_rearm(c);
+				return;
+			}
+			continue;
+		}
+		if(mmu_client_dispatch(c, type)) goto out_client;
+	}
+	mmu_client_free(c);
+	return;
+
+	out_client:
+	mmu_client_destroy(c);
+	mmu_client_free(c);
+}/*}}}*/
+
+static void mmu_client_service(struct mmu_client *c)/*{{{*/
+{
+	/* Handles one message of a client whose socket epoll reported
+	 * readable. */
+	if(c->shm) {
+		mmu_client_service_rings(c);
+		return;
+	}
+	uint32_t type;
+	ssize_t cnt = recv(c->sock, &type, sizeof(type), MSG_PEEK | MSG_DONTWAIT);
+	if(cnt == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		/* the pager took an acknowledgement meanwhile */
+		mmu_client_rearm(c);
+		return;
+	}
+	if(cnt != sizeof(type)) goto out_client;
+	if(mmu_client_dispatch(c, type)) goto out_client;
+	if(c->running) mmu_client_rearm(c);
+	else mmu_client_free(c);
+	return;
+
+	out_client:
+	mmu_client_destroy(c);
+	mmu_client_free(c);
+}/*}}}*/
+
+void * mmu_worker_thread(void *arg)/*{{{*/
+{
+	while(mmu->running) {
+		struct epoll_event ev;
+		int n = epoll_wait(mmu->epfd, &ev, 1, MMU_WORKER_IDLE_MS);
+		if(n == 0) {
+			pthread_mutex_lock(&mmu->pool_lock);
+			int surplus = mmu->nworkers > (int)mmu_workers;
+			if(surplus) mmu->nworkers--;
+			pthread_mutex_unlock(&mmu->pool_lock);
+			if(surplus) break;
+			continue;
+		}
+		if(n == -1) continue;
+
+		pthread_mutex_lock(&mmu->pool_lock);
+		if(++mmu->nbusy == mmu->nworkers) mmu_worker_start();
+		pthread_mutex_unlock(&mmu->pool_lock);
+
+		mmu_client_service(ev.data.ptr);
+
+		pthread_mutex_lock(&mmu->pool_lock);
+		mmu->nbusy--;
+		pthread_mutex_unlock(&mmu->pool_lock);
+	}
+	pthread_exit(NULL);
+}/*}}}*/
+
 void mmu_client_log(const struct mmu_client *c, const char *fname, const char *msg)/*{{{*/
 {
 	logd(LOG_DEBUG, "%s sock %d pid %d: %s\n", fname, c->sock,
 			(int)c->pid, msg);
 }/*}}}*/
 
+/* Message handlers read and write through these functions, which use
+ * the client's rings if it got them in CREATE and its socket if not.
+ * They return what recv and send would. */
+ssize_t mmu_client_peek(struct mmu_client *c, uint32_t *type, int block)/*{{{*/
+{
+	/* Returns the type of the next message without consuming it.  If
+	 * `block` is zero and there is no message, fails with EAGAIN. */
+	if(!c->shm) return recv(c->sock, type, sizeof(*type),
+			block ? MSG_PEEK : MSG_PEEK | MSG_DONTWAIT);
+	struct ring *r = &c->shm->req;
+	for(;;) {
+		if(ring_peek(r, type, sizeof(*type))) return sizeof(*type);
+		if(!block) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if(ring_spin(r, sizeof(*type)) || !ring_arm(r, RING_WAIT_SOCK))
+			continue;
+		char buf[64];
+		ssize_t cnt = recv(c->sock, buf, sizeof(buf), 0);
+		if(cnt <= 0) return cnt;
+	}
+}/*}}}*/
+
+ssize_t mmu_client_recv(struct mmu_client *c, void *buf, size_t len)/*{{{*/
+{
+	if(!c->shm) return recv(c->sock, buf, len, 0);
+	/* messages are written whole, so the peeked one is all there */
+	if(ring_used(&c->shm->req) < len) return -1;
+	ring_read(&c->shm->req, buf, len);
+	return len;
+}/*}}}*/
+
+ssize_t mmu_client_xmit(struct mmu_client *c, const void *buf, size_t len)/*{{{*/
+{
+	if(!c->shm) return send(c->sock, buf, len, MSG_NOSIGNAL);
+	pthread_mutex_lock(&c->tx_lock);
+	int r = ring_write(&c->shm->rep, buf, len, c->sock);
+	pthread_mutex_unlock(&c->tx_lock);
+	return r ? -1 : (ssize_t)len;
+}/*}}}*/
+
 void mmu_client_create(struct mmu_client *c)/*{{{*/
 {
 	char msg[96];
@@ -270,9 +700,8 @@ void mmu_client_create(struct mmu_client *c)/*{{{*/
 		goto out_client;
 	assert(req.type == MMU_PROTO_CREATE_REQ);
 
-	c->pid = (pid_t)req.pid;
-	int id = nextid;
-	id2pid[nextid++] = c->pid;
+	mmu_clients_create(c, (pid_t)req.pid);
+	int id = c->id;
 	printf("pager_create pid %d\n", id);
 	pager_create(c->pid);
 	snprintf(msg, 96, "create pid %d", id);
@@ -280,9 +709,41 @@ void mmu_client_create(struct mmu_client *c)/*{{{*/
 
 	struct mmu_proto_create_rep rep;
 	rep.type = MMU_PROTO_CREATE_REP;
+	rep.flags = 0;
 	memset(rep.pmem_fn, '\0', MMU_PROTO_PATH_MAX);
 	strncat(rep.pmem_fn, mmu->pmem_fn, MMU_PROTO_PATH_MAX);
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	int fd = -1;
+	if(mmu_rings && (req.flags & MMU_PROTO_CREATE_RINGS)) {
+		c->shm = ring_shm_create(&fd);
+		if(!c->shm) loge(LOG_WARN, __FILE__, __LINE__);
+	}
+	if(c->shm) {
+		/* the client's first message must wake whoever serves it */
+		c->shm->req.waiting = RING_WAIT_SOCK;
+		rep.flags |= MMU_PROTO_CREATE_RINGS;
+		mmu_client_log(c, __func__, "using rings");
+	}
+
+	/* the reply goes on the socket either way, with the ring fd */
+	struct iovec iov = {&rep, sizeof(rep)};
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if(fd != -1) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	ssize_t cnt = sendmsg(c->sock, &mh, MSG_NOSIGNAL);
+	if(fd != -1) close(fd);
+	if(cnt != sizeof(rep))
 		goto out_client;
 	return;
 
@@ -294,11 +755,11 @@ void mmu_client_extend(struct mmu_client *c)/*{{{*/
 {
 	char msg[96];
 	struct mmu_proto_extend_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
+	if(mmu_client_recv(c, &req, sizeof(req)) != sizeof(req))
 		goto out_client;
 	assert(req.type == MMU_PROTO_EXTEND_REQ);
 
-	int id = get_pid_id(c->pid);
+	int id = c->id;
 	void *vaddr = pager_extend(c->pid);
 	printf("pager_extend pid %d vaddr %p\n", id, vaddr);
 	snprintf(msg, 96, "extend vaddr %p", vaddr);
@@ -307,7 +768,38 @@ void mmu_client_extend(struct mmu_client *c)/*{{{*/
 	struct mmu_proto_extend_rep rep;
 	rep.type = MMU_PROTO_EXTEND_REP;
 	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(mmu_client_xmit(c, &rep, sizeof(rep)) != sizeof(rep))
+		goto out_client;
+	return;
+
+	out_client:
+	mmu_client_destroy(c);
+}/*}}}*/
+
+void mmu_client_extend_n(struct mmu_client *c)/*{{{*/
+{
+	char msg[96];
+	struct mmu_proto_extend_n_req req;
+	if(mmu_client_recv(c, &req, sizeof(req)) != sizeof(req))
+		goto out_client;
+	assert(req.type == MMU_PROTO_EXTEND_N_REQ);
+
+	int id = c->id;
+	void *vaddr = pager_extend_n(c->pid, req.count);
+	/* one trace line per page, as if the pages were extended one by one: */
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	for(uint32_t i = 0; vaddr && i < req.count; ++i) {
+		printf("pager_extend pid %d vaddr %p\n", id,
+				(void *)((char *)vaddr + i * pagesz));
+	}
+	if(!vaddr) printf("pager_extend pid %d vaddr %p\n", id, vaddr);
+	snprintf(msg, 96, "extend %u pages vaddr %p", req.count, vaddr);
+	mmu_client_log(c, __func__, msg);
+
+	struct mmu_proto_extend_n_rep rep;
+	rep.type = MMU_PROTO_EXTEND_N_REP;
+	rep.vaddr = (intptr_t)vaddr;
+	if(mmu_client_xmit(c, &rep, sizeof(rep)) != sizeof(rep))
 		goto out_client;
 	return;
 
@@ -319,14 +811,14 @@ void mmu_client_syslog(struct mmu_client *c)/*{{{*/
 {
 	char msg[96];
 	struct mmu_proto_syslog_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
+	if(mmu_client_recv(c, &req, sizeof(req)) != sizeof(req))
 		goto out_client;
 	assert(req.type == MMU_PROTO_SYSLOG_REQ);
 
 	assert(req.addr < UINTPTR_MAX);
 	void *vaddr = (void *)(uintptr_t)req.addr;
 	size_t len = (size_t)req.len;
-	int id = get_pid_id(c->pid);
+	int id = c->id;
 	printf("pager_syslog pid %d %p\n", id, vaddr);
 	int status = pager_syslog(c->pid, vaddr, len);
 	snprintf(msg, 96, "vaddr %p len %zu retcode %d", vaddr, len, status);
@@ -335,7 +827,7 @@ void mmu_client_syslog(struct mmu_client *c)/*{{{*/
 	struct mmu_proto_syslog_rep rep;
 	rep.type = MMU_PROTO_SYSLOG_REP;
 	rep.retcode = (uint32_t)status;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(mmu_client_xmit(c, &rep, sizeof(rep)) != sizeof(rep))
 		goto out_client;
 	return;
 
@@ -347,7 +839,7 @@ void mmu_client_segv(struct mmu_client *c)/*{{{*/
 {
 	char msg[96];
 	struct mmu_proto_segv_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
+	if(mmu_client_recv(c, &req, sizeof(req)) != sizeof(req))
 		goto out_client;
 	assert(req.type == MMU_PROTO_SEGV_REQ);
 
@@ -357,13 +849,15 @@ void mmu_client_segv(struct mmu_client *c)/*{{{*/
 	snprintf(msg, 96, "vaddr %p code %d", vaddr, code);
 	mmu_client_log(c, __func__, msg);
 
-	int id = get_pid_id(c->pid);
+	int id = c->id;
 	printf("pager_fault pid %d vaddr %p\n", id, vaddr);
-	pager_fault(c->pid, vaddr);
+	int rc = pager_fault(c->pid, vaddr);
+	if(rc) mmu_client_log(c, __func__, "fault failed, out of memory");
 
 	struct mmu_proto_segv_rep rep;
 	rep.type = MMU_PROTO_SEGV_REP;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	rep.retcode = (uint32_t)rc;
+	if(mmu_client_xmit(c, &rep, sizeof(rep)) != sizeof(rep))
 		goto out_client;
 	return;
 
@@ -374,20 +868,22 @@ void mmu_client_segv(struct mmu_client *c)/*{{{*/
 void mmu_client_exit(struct mmu_client *c)/*{{{*/
 {
 	struct mmu_proto_exit_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
+	if(mmu_client_recv(c, &req, sizeof(req)) != sizeof(req))
 		goto out_client;
 	mmu_client_log(c, __func__, "exiting cleanly");
 	assert(req.type == MMU_PROTO_EXIT_REQ);
 	assert(c->pid);
-	int id = get_pid_id(c->pid);
+	int id = c->id;
 	printf("pager_destroy pid %d\n", id);
 	pager_destroy(c->pid);
 
 	struct mmu_proto_segv_rep rep;
 	rep.type = MMU_PROTO_EXIT_REP;
-	send(c->sock, &rep, sizeof(rep), 0); /* ignoring return value */
+	rep.retcode = 0;
+	mmu_client_xmit(c, &rep, sizeof(rep)); /* ignoring return value */
 
-	mmu->sock2client[c->sock] = NULL;
+	mmu_client_quiesce(c);
+	mmu_clients_remove(c);
 	c->running = 0;
 	close(c->sock);
 	return;
@@ -400,12 +896,163 @@ void mmu_client_destroy(struct mmu_client *c)/*{{{*/
 {
 	loge(LOG_WARN, __FILE__, __LINE__);
 	mmu_client_log(c, __func__, "running");
-	mmu->sock2client[c->sock] = NULL;
-	c->running = 0;
-	close(c->sock);
+	/* the pager may be evicting this client's pages from another
+	 * thread, so it must forget the client before we do: */
 	if(c->pid) { /* may get here before CREATE_REQ happens */
 		pager_destroy(c->pid);
 	}
+	mmu_client_quiesce(c);
+	mmu_clients_remove(c);
+	c->running = 0;
+	close(c->sock);
+}/*}}}*/
+
+void mmu_client_quiesce(struct mmu_client *c)/*{{{*/
+{
+	/* Waits until no pager thread will flush changes it posted to
+	 * the client; the socket must stay open until then.  The pager
+	 * forgot the client, so nothing is posted to it anymore. */
+	pthread_mutex_lock(&c->ack_lock);
+	while(c->posts) pthread_cond_wait(&c->acked, &c->ack_lock);
+	pthread_mutex_unlock(&c->ack_lock);
+}/*}}}*/
+
+void mmu_client_free(struct mmu_client *c)/*{{{*/
+{
+	if(c->shm) ring_shm_unmap(c->shm);
+	pthread_mutex_destroy(&c->ack_lock);
+	pthread_cond_destroy(&c->acked);
+	pthread_mutex_destroy(&c->tx_lock);
+	free(c);
+}/*}}}*/
+
+void mmu_client_abort(struct mmu_client *c)/*{{{*/
+{
+	/* Called when a client fails while the pager is talking to it.  The
+	 * pager holds locks on the client's pages here, so we cannot call
+	 * pager_destroy; shutting the socket down makes the client's own
+	 * thread fail its next recv and run mmu_client_destroy. */
+	loge(LOG_WARN, __FILE__, __LINE__);
+	mmu_client_log(c, __func__, "running");
+	shutdown(c->sock, SHUT_RDWR);
+}/*}}}*/
+/*}}}*/
+
+/****************************************************************************
+ * compressed swap pool {{{
+ *
+ * With swap_pool set, mmu_disk_write compresses the page into a pool of
+ * at most swap_pool bytes instead of writing it to the disk, and
+ * mmu_disk_read looks for the block in the pool first.  Pages are
+ * compressed by run-length encoding, as they are mostly runs of the '0'
+ * mmu_zero_fill writes.  A page that does not compress to half its size
+ * is rejected and one that does not fit the pool spills; both go to the
+ * disk.  A block stays in the pool after it is read, since the pager does
+ * not write back pages whose block is current.
+ ***************************************************************************/
+static size_t mmu_zcompress(const char *src, char *dst, size_t cap)/*{{{*/
+{
+	/* A control byte below 0x80 is followed by that many literal
+	 * bytes plus one; from 0x80 up, by a byte repeated that many
+	 * times minus 0x80 plus three. */
+	size_t i = 0, n = 0;
+	while(i < PAGESIZE) {
+		size_t run = 1;
+		while(i + run < PAGESIZE && run < 130 && src[i + run] == src[i])
+			run++;
+		if(run >= 3) {
+			if(n + 2 > cap) return 0;
+			dst[n++] = (char)(0x80 | (run - 3));
+			dst[n++] = src[i];
+			i += run;
+			continue;
+		}
+		size_t lit = 0;
+		while(i + lit < PAGESIZE && lit < 128) {
+			if(i + lit + 2 < PAGESIZE && src[i + lit] == src[i + lit + 1]
+					&& src[i + lit] == src[i + lit + 2])
+				break;
+			lit++;
+		}
+		if(n + 1 + lit > cap) return 0;
+		dst[n++] = (char)(lit - 1);
+		memcpy(dst + n, src + i, lit);
+		n += lit;
+		i += lit;
+	}
+	return n;
+}/*}}}*/
+
+static void mmu_zdecompress(const char *src, size_t len, char *dst)/*{{{*/
+{
+	size_t i = 0, n = 0;
+	while(i < len) {
+		unsigned char c = src[i++];
+		if(c & 0x80) {
+			size_t run = (c & 0x7f) + 3;
+			memset(dst + n, src[i++], run);
+			n += run;
+		} else {
+			size_t lit = c + 1;
+			memcpy(dst + n, src + i, lit);
+			i += lit;
+			n += lit;
+		}
+	}
+	assert(n == PAGESIZE);
+}/*}}}*/
+
+int mmu_zpool_store(int frame_from, int block_to)/*{{{*/
+{
+	struct mmu_zpool *z = &mmu->zpool;
+	char buf[PAGESIZE / 2];
+	size_t len = mmu_zcompress(mmu->pmem + frame_from*PAGESIZE, buf,
+			sizeof(buf));
+	char *data = len ? malloc(len) : NULL;
+	if(data) memcpy(data, buf, len);
+
+	pthread_mutex_lock(&z->lock);
+	mmu_zpool_drop(block_to);
+	if(data && z->bytes + len <= z->max) {
+		z->data[block_to] = data;
+		z->len[block_to] = (uint16_t)len;
+		z->bytes += len;
+		z->pages++;
+		z->stores++;
+		pthread_mutex_unlock(&z->lock);
+		return 1;
+	}
+	if(len) z->spills++;
+	else z->rejects++;
+	pthread_mutex_unlock(&z->lock);
+	free(data);
+	return 0;
+}/*}}}*/
+
+void mmu_zpool_drop(int block)/*{{{*/
+{
+	/* Called with the pool lock held. */
+	struct mmu_zpool *z = &mmu->zpool;
+	if(!z->data[block]) return;
+	free(z->data[block]);
+	z->data[block] = NULL;
+	z->bytes -= z->len[block];
+	z->pages--;
+}/*}}}*/
+
+int mmu_zpool_load(int block_from, int frame_to)/*{{{*/
+{
+	/* Only the page owning the block writes it, and not meanwhile. */
+	struct mmu_zpool *z = &mmu->zpool;
+	if(!z->max) return 0;
+	pthread_mutex_lock(&z->lock);
+	char *data = z->data[block_from];
+	size_t len = data ? z->len[block_from] : 0;
+	if(data) z->loads++;
+	pthread_mutex_unlock(&z->lock);
+	if(!data) return 0;
+	mmu_zdecompress(data, len, mmu->pmem + frame_to*PAGESIZE);
+	return 1;
 }/*}}}*/
 /*}}}*/
 
@@ -414,10 +1061,12 @@ void mmu_client_destroy(struct mmu_client *c)/*{{{*/
  ***************************************************************************/
 struct mmu_client * mmu_client_search(pid_t pid)/*{{{*/
 {
-	for(int i = 3; i < MMU_MAX_SOCK; ++i) {
-		if(!mmu->sock2client[i]) continue;
-		if(mmu->sock2client[i]->pid == pid) return mmu->sock2client[i];
-	}
+	pthread_rwlock_rdlock(&mmu->clients_lock);
+	struct mmu_client *c = NULL;
+	if(mmu->nbuckets) c = mmu->pid2client[pid_hash(pid, mmu->nbuckets)];
+	while(c && c->pid != pid) c = c->hnext;
+	pthread_rwlock_unlock(&mmu->clients_lock);
+	if(c) return c;
 	printf("error: pid %d not found.  aborting.\n", (int)pid);
 	logd(LOG_FATAL, "pid %d not found.  aborting.\n", (int)pid);
 	mmu_destroy();
@@ -431,122 +1080,334 @@ void mmu_zero_fill(int frame)/*{{{*/
 	memset(mmu->pmem + (PAGESIZE*frame), '0', PAGESIZE);
 }/*}}}*/
 
-void mmu_resident(pid_t pid, void *vaddr, int frame, int prot)/*{{{*/
+void mmu_frame_copy(int frame_from, int frame_to)/*{{{*/
 {
-	int id = get_pid_id(pid);
-	printf("%s pid %d vaddr %p prot %d frame %u\n", __func__,
-			id, vaddr, prot, frame);
-	logd(LOG_DEBUG, "%s pid %d vaddr %p prot %d frame %u\n", __func__,
-			id, vaddr, prot, frame);
-	struct mmu_client *c = mmu_client_search(pid);
-	struct mmu_proto_remap_rep rep;
-	rep.type = MMU_PROTO_REMAP_REP;
-	rep.prot = (int32_t)prot;
-	rep.offset = (uint64_t)(PAGESIZE * frame);
-	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
+	printf("%s from frame %d to frame %d\n", __func__, frame_from, frame_to);
+	logd(LOG_DEBUG, "%s from frame %d to frame %d\n", __func__,
+			frame_from, frame_to);
+	memcpy(mmu->pmem + PAGESIZE*frame_to, mmu->pmem + PAGESIZE*frame_from,
+			PAGESIZE);
+}/*}}}*/
 
-	/* We need these functions to wait for the application to
-	 * effect the protection change before we return to the
-	 * pager.  This loop is necessary because mmu_client_thread
-	 * is already in the pager and blocked here (so we cannot
-	 * wait on a condition variable to be signaled forward as
-	 * there is no one else to recv the REMAP_REQ message).  An
-	 * alternative approach would be to use two sockets or
-	 * threads. */
+static void mmu_client_send(struct mmu_client *c)/*{{{*/
+{
+	/* Sends the changes queued for c in one message and counts the
+	 * acknowledgement it takes.  Called with c->ack_lock held, so
+	 * changes go out in the order they were queued.  A single change
+	 * goes in a plain REMAP or CHPROT message. */
+	const void *msg = &c->queue;
+	size_t len;
+	uint32_t count;
+	struct mmu_proto_remap_rep remap;
+	struct mmu_proto_chprot_rep chprot;
+	if(!c->qtype) return;
+	if(c->qtype == MMU_PROTO_REMAP_N_REP) {
+		const struct mmu_proto_remap_n_rep *q = &c->queue.remap;
+		count = q->count;
+		len = offsetof(struct mmu_proto_remap_n_rep, pages) +
+				count * sizeof(q->pages[0]);
+		if(count == 1) {
+			remap.type = MMU_PROTO_REMAP_REP;
+			remap.prot = q->pages[0].prot;
+			remap.offset = q->pages[0].offset;
+			remap.vaddr = q->pages[0].vaddr;
+			msg = &remap;
+			len = sizeof(remap);
+		}
+	} else {
+		const struct mmu_proto_chprot_n_rep *q = &c->queue.chprot;
+		count = q->count;
+		len = offsetof(struct mmu_proto_chprot_n_rep, pages) +
+				count * sizeof(q->pages[0]);
+		if(count == 1) {
+			chprot.type = MMU_PROTO_CHPROT_REP;
+			chprot.prot = q->pages[0].prot;
+			chprot.vaddr = q->pages[0].vaddr;
+			msg = &chprot;
+			len = sizeof(chprot);
+		}
+	}
+	c->qtype = 0;
+	__atomic_fetch_add(&mmu->changes, count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mmu->messages, 1, __ATOMIC_RELAXED);
+	if(mmu_client_xmit(c, msg, len) != (ssize_t)len) {
+		mmu_client_abort(c);
+		return;
+	}
+	c->acks++;
+}/*}}}*/
+
+static void mmu_client_queue_remap(struct mmu_client *c, int prot, uint64_t offset, uint64_t vaddr)/*{{{*/
+{
+	pthread_mutex_lock(&c->ack_lock);
+	struct mmu_proto_remap_n_rep *q = &c->queue.remap;
+	if(c->qtype != MMU_PROTO_REMAP_N_REP || q->count == MMU_PROTO_VEC_MAX) {
+		mmu_client_send(c);
+		c->qtype = MMU_PROTO_REMAP_N_REP;
+		q->type = MMU_PROTO_REMAP_N_REP;
+		q->count = 0;
+	}
+	struct mmu_proto_remap_entry *e = &q->pages[q->count++];
+	e->prot = (int32_t)prot;
+	e->offset = offset;
+	e->vaddr = vaddr;
+	pthread_mutex_unlock(&c->ack_lock);
+}/*}}}*/
+
+static void mmu_client_queue_chprot(struct mmu_client *c, int prot, uint64_t vaddr)/*{{{*/
+{
+	pthread_mutex_lock(&c->ack_lock);
+	struct mmu_proto_chprot_n_rep *q = &c->queue.chprot;
+	if(c->qtype != MMU_PROTO_CHPROT_N_REP || q->count == MMU_PROTO_VEC_MAX) {
+		mmu_client_send(c);
+		c->qtype = MMU_PROTO_CHPROT_N_REP;
+		q->type = MMU_PROTO_CHPROT_N_REP;
+		q->count = 0;
+	}
+	struct mmu_proto_chprot_entry *e = &q->pages[q->count++];
+	e->prot = (int32_t)prot;
+	e->vaddr = vaddr;
+	pthread_mutex_unlock(&c->ack_lock);
+}/*}}}*/
+
+static int mmu_client_take_ack(struct mmu_client *c)/*{{{*/
+{
+	/* Receives the acknowledgement at the head of c's socket, if
+	 * there is one.  Called with c->ack_lock held; returns 1 if it
+	 * took one, 0 if the socket holds a request or nothing, and -1
+	 * if the client failed. */
 	uint32_t t;
-	do {
-		 if(recv(c->sock, &t, sizeof(t), MSG_PEEK) != sizeof(t))
-			goto out_client;
-	} while(t != MMU_PROTO_REMAP_REQ);
-	struct mmu_proto_remap_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
-	assert(req.type == MMU_PROTO_REMAP_REQ);
+	ssize_t cnt = mmu_client_peek(c, &t, 0);
+	if(cnt == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+	if(cnt != sizeof(t)) return -1;
+	if(t == MMU_PROTO_REMAP_REQ) {
+		struct mmu_proto_remap_req req;
+		if(mmu_client_recv(c, &req, sizeof(req)) != sizeof(req)) return -1;
+	} else if(t == MMU_PROTO_CHPROT_REQ) {
+		struct mmu_proto_chprot_req req;
+		if(mmu_client_recv(c, &req, sizeof(req)) != sizeof(req)) return -1;
+	} else {
+		return 0;
+	}
+	assert(c->acks > 0);
+	c->acks--;
+	return 1;
+}/*}}}*/
+
+static int mmu_client_idle(struct mmu_client *c)/*{{{*/
+{
+	/* Waits a while for c to send something.  Returns -1 if the
+	 * client is gone. */
+	if(!c->shm) {
+		struct pollfd pfd = {c->sock, POLLIN, 0};
+		if(poll(&pfd, 1, MMU_ACK_POLL_MS) > 0) sched_yield();
+		return 0;
+	}
+	/* The socket only says whether the client is gone; its wakeup
+	 * bytes are left for the thread serving the client. */
+	struct ring *r = &c->shm->req;
+	uint32_t tail = ring_tail(r);
+	if(ring_used(r) || ring_spin(r, 1)) {
+		sched_yield();
+		return 0;
+	}
+	if(ring_arm(r, RING_WAIT_FUTEX))
+		ring_futex_wait(r, tail, MMU_ACK_POLL_MS);
+	if(ring_used(r)) return 0;
+	return ring_peer_gone(c->sock) ? -1 : 0;
+}/*}}}*/
+
+static void mmu_client_wait(struct mmu_client *c)/*{{{*/
+{
+	/* We need the application to effect the protection changes sent
+	 * to it before we return to the pager.  The application effects
+	 * changes in the order they were sent, so once as many
+	 * acknowledgements as messages were taken every change is in
+	 * effect, whichever thread queued it.  The thread serving the
+	 * client takes acknowledgements it finds too, but it may be in
+	 * the pager and blocked here, so we also take them ourselves;
+	 * a request ahead of them is left for that thread. */
+	pthread_mutex_lock(&c->ack_lock);
+	mmu_client_send(c);
+	while(c->acks > 0) {
+		int r = mmu_client_take_ack(c);
+		if(r < 0) goto out_client;
+		if(r > 0) continue;
+		pthread_mutex_unlock(&c->ack_lock);
+		r = mmu_client_idle(c);
+		pthread_mutex_lock(&c->ack_lock);
+		if(r < 0) goto out_client;
+	}
+	pthread_mutex_unlock(&c->ack_lock);
 	return;
 
 	out_client:
-	mmu_client_destroy(c);
+	c->acks = 0;
+	pthread_mutex_unlock(&c->ack_lock);
+	mmu_client_abort(c);
 }/*}}}*/
 
+static void mmu_client_post(struct mmu_client *c)/*{{{*/
+{
+	/* Records that the calling thread must flush c.  The pager holds
+	 * the process's lock here, so c cannot go away meanwhile. */
+	for(int i = 0; i < mmu_nposted; ++i) {
+		if(mmu_posted[i] == c) return;
+	}
+	if(mmu_nposted == MMU_MAX_POSTED) mmu_flush();
+	pthread_mutex_lock(&c->ack_lock);
+	c->posts++;
+	pthread_mutex_unlock(&c->ack_lock);
+	mmu_posted[mmu_nposted++] = c;
+}/*}}}*/
 
-void mmu_nonresident(pid_t pid, void *vaddr)/*{{{*/
+static struct mmu_client * mmu_resident_queue(pid_t pid, void *vaddr, int frame, int prot)/*{{{*/
 {
-	int id = get_pid_id(pid);
-	printf("%s pid %d vaddr %p\n", __func__, id, vaddr);
-	logd(LOG_DEBUG, "%s pid %d vaddr %p\n", __func__, id, vaddr);
 	struct mmu_client *c = mmu_client_search(pid);
-	struct mmu_proto_chprot_rep rep;
-	rep.type = MMU_PROTO_CHPROT_REP;
-	rep.prot = PROT_NONE;
-	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
+	int id = c->id;
+	printf("mmu_resident pid %d vaddr %p prot %d frame %u\n",
+			id, vaddr, prot, frame);
+	logd(LOG_DEBUG, "mmu_resident pid %d vaddr %p prot %d frame %u\n",
+			id, vaddr, prot, frame);
+	mmu_client_queue_remap(c, prot, (uint64_t)(PAGESIZE * frame),
+			(intptr_t)vaddr);
+	return c;
+}/*}}}*/
 
-	uint32_t t;
-	do {
-		if(recv(c->sock, &t, sizeof(t), MSG_PEEK) != sizeof(t))
-			goto out_client;
-	} while(t != MMU_PROTO_CHPROT_REQ);
-	struct mmu_proto_chprot_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
-	assert(req.type == MMU_PROTO_CHPROT_REQ);
-	return;
+static struct mmu_client * mmu_nonresident_queue(pid_t pid, void *vaddr)/*{{{*/
+{
+	struct mmu_client *c = mmu_client_search(pid);
+	int id = c->id;
+	printf("mmu_nonresident pid %d vaddr %p\n", id, vaddr);
+	logd(LOG_DEBUG, "mmu_nonresident pid %d vaddr %p\n", id, vaddr);
+	mmu_client_queue_chprot(c, PROT_NONE, (intptr_t)vaddr);
+	return c;
+}/*}}}*/
 
-	out_client:
-	mmu_client_destroy(c);
+static struct mmu_client * mmu_chprot_queue(pid_t pid, void *vaddr, int prot)/*{{{*/
+{
+	struct mmu_client *c = mmu_client_search(pid);
+	int id = c->id;
+	printf("mmu_chprot pid %d vaddr %p prot %d\n", id, vaddr, prot);
+	logd(LOG_DEBUG, "mmu_chprot pid %d vaddr %p prot %d\n",
+			id, vaddr,prot);
+	mmu_client_queue_chprot(c, prot, (intptr_t)vaddr);
+	return c;
+}/*}}}*/
+
+void mmu_resident(pid_t pid, void *vaddr, int frame, int prot)/*{{{*/
+{
+	mmu_client_wait(mmu_resident_queue(pid, vaddr, frame, prot));
+}/*}}}*/
+
+void mmu_nonresident(pid_t pid, void *vaddr)/*{{{*/
+{
+	mmu_client_wait(mmu_nonresident_queue(pid, vaddr));
 }/*}}}*/
 
 void mmu_chprot(pid_t pid, void *vaddr, int prot)/*{{{*/
 {
-	int id = get_pid_id(pid);
-	printf("%s pid %d vaddr %p prot %d\n", __func__, id, vaddr, prot);
-	logd(LOG_DEBUG, "%s pid %d vaddr %p prot %d\n", __func__,
-			id, vaddr,prot);
-	struct mmu_client *c = mmu_client_search(pid);
-	struct mmu_proto_chprot_rep rep;
-	rep.type = MMU_PROTO_CHPROT_REP;
-	rep.prot = (int32_t)prot;
-	rep.vaddr = (intptr_t)vaddr;
-	if(send(c->sock, &rep, sizeof(rep), 0) != sizeof(rep))
-		goto out_client;
+	mmu_client_wait(mmu_chprot_queue(pid, vaddr, prot));
+}/*}}}*/
 
-	uint32_t t;
-	do {
-		if(recv(c->sock, &t, sizeof(t), MSG_PEEK) != sizeof(t))
-			goto out_client;
-	} while(t != MMU_PROTO_CHPROT_REQ);
-	struct mmu_proto_chprot_req req;
-	if(recv(c->sock, &req, sizeof(req), 0) != sizeof(req))
-		goto out_client;
-	assert(req.type == MMU_PROTO_CHPROT_REQ);
-	return;
+void mmu_resident_async(pid_t pid, void *vaddr, int frame, int prot)/*{{{*/
+{
+	mmu_client_post(mmu_resident_queue(pid, vaddr, frame, prot));
+}/*}}}*/
 
-	out_client:
-	mmu_client_destroy(c);
+void mmu_nonresident_async(pid_t pid, void *vaddr)/*{{{*/
+{
+	mmu_client_post(mmu_nonresident_queue(pid, vaddr));
 }/*}}}*/
 
-void mmu_disk_read(int block_from, int frame_to)/*{{{*/
+void mmu_chprot_async(pid_t pid, void *vaddr, int prot)/*{{{*/
 {
-	printf("%s from block %d to frame %d\n", __func__,
+	mmu_client_post(mmu_chprot_queue(pid, vaddr, prot));
+}/*}}}*/
+
+void mmu_flush(void)/*{{{*/
+{
+	/* Every client gets its queued changes first, so they effect them
+	 * in parallel and this takes about the slowest round trip. */
+	for(int i = 0; i < mmu_nposted; ++i) {
+		struct mmu_client *c = mmu_posted[i];
+		pthread_mutex_lock(&c->ack_lock);
+		mmu_client_send(c);
+		pthread_mutex_unlock(&c->ack_lock);
+	}
+	for(int i = 0; i < mmu_nposted; ++i) {
+		struct mmu_client *c = mmu_posted[i];
+		mmu_client_wait(c);
+		pthread_mutex_lock(&c->ack_lock);
+		c->posts--;
+		pthread_cond_broadcast(&c->acked);
+		pthread_mutex_unlock(&c->ack_lock);
+	}
+	mmu_nposted = 0;
+}/*}}}*/
+
+static void mmu_disk_read_page(int block_from, int frame_to)/*{{{*/
+{
+	printf("mmu_disk_read from block %d to frame %d\n",
 			block_from, frame_to);
-	logd(LOG_DEBUG, "%s from block %d to frame %d\n", __func__,
+	logd(LOG_DEBUG, "mmu_disk_read from block %d to frame %d\n",
 			block_from, frame_to);
+	if(mmu_zpool_load(block_from, frame_to)) return;
+	__atomic_fetch_add(&mmu->zpool.disk_reads, 1, __ATOMIC_RELAXED);
 	memcpy(mmu->pmem + frame_to*PAGESIZE, mmu->disk + block_from*PAGESIZE,
 			PAGESIZE);
 }/*}}}*/
 
-void mmu_disk_write(int frame_from, int block_to)/*{{{*/
+static void mmu_disk_write_page(int frame_from, int block_to)/*{{{*/
 {
-	printf("%s from frame %d to block %d\n", __func__,
+	printf("mmu_disk_write from frame %d to block %d\n",
 			frame_from, block_to);
-	logd(LOG_DEBUG, "%s from frame %d to block %d\n", __func__,
+	logd(LOG_DEBUG, "mmu_disk_write from frame %d to block %d\n",
 			frame_from, block_to);
+	if(mmu->zpool.max && mmu_zpool_store(frame_from, block_to)) return;
+	__atomic_fetch_add(&mmu->zpool.disk_writes, 1, __ATOMIC_RELAXED);
 	memcpy(mmu->disk + block_to*PAGESIZE, mmu->pmem + frame_from*PAGESIZE,
 			PAGESIZE);
 }/*}}}*/
+
+void mmu_disk_read(int block_from, int frame_to)/*{{{*/
+{
+	mmu_disk_read_page(block_from, frame_to);
+}/*}}}*/
+
+void mmu_disk_write(int frame_from, int block_to)/*{{{*/
+{
+	mmu_disk_write_page(frame_from, block_to);
+}/*}}}*/
+
+void mmu_disk_discard(int block)/*{{{*/
+{
+	struct mmu_zpool *z = &mmu->zpool;
+	if(!z->max) return;
+	logd(LOG_DEBUG, "%s block %d\n", __func__, block);
+	pthread_mutex_lock(&z->lock);
+	if(z->data[block]) z->discards++;
+	mmu_zpool_drop(block);
+	pthread_mutex_unlock(&z->lock);
+}/*}}}*/
+
+void mmu_disk_readv(int block_from, const int *frames, int count)/*{{{*/
+{
+	logd(LOG_DEBUG, "%s %d blocks from block %d\n", __func__, count,
+			block_from);
+	__atomic_fetch_add(&mmu->zpool.disk_batches, 1, __ATOMIC_RELAXED);
+	for(int i = 0; i < count; ++i)
+		mmu_disk_read_page(block_from + i, frames[i]);
+}/*}}}*/
+
+void mmu_disk_writev(const int *frames, int count, int block_to)/*{{{*/
+{
+	logd(LOG_DEBUG, "%s %d frames to block %d\n", __func__, count,
+			block_to);
+	__atomic_fetch_add(&mmu->zpool.disk_batches, 1, __ATOMIC_RELAXED);
+	for(int i = 0; i < count; ++i)
+		mmu_disk_write_page(frames[i], block_to + i);
+}/*}}}*/
 /*}}}*/
 
 /****************************************************************************
@@ -555,27 +1416,83 @@ void mmu_disk_write(int frame_from, int block_to)/*{{{*/
 #ifdef MMUFREE
 void pager_free(void);
 #endif
+int mmu_setopt(const char *name, const char *value) {/*{{{*/
+	/* Returns 1 for options that are not the MMU's. */
+	size_t *opt;
+	if(!strcmp(name, "swap_pool")) opt = &swap_pool;
+	else if(!strcmp(name, "workers")) opt = &mmu_workers;
+	else if(!strcmp(name, "rings")) opt = &mmu_rings;
+	else if(!strcmp(name, "recycle_ids")) opt = &mmu_recycle_ids;
+	else if(!strcmp(name, "pmem_memfd")) opt = &pmem_memfd;
+	else if(!strcmp(name, "pmem_populate")) opt = &pmem_populate;
+	else return 1;
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(value, &end, 10);
+	if(errno || end == value || *end != '\0') return -1;
+	*opt = n;
+	return 0;
+}/*}}}*/
+
 void usage(int argc, char **argv) {/*{{{*/
-	printf("usage: %s NFRAMES NBLOCKS\n", argv[0]);
+	printf("usage: %s NFRAMES NBLOCKS [OPTION=VALUE ...]\n", argv[0]);
 	printf("\n");
 	printf("valid ranges: 2 <= NFRAMES <= 256\n");
 	printf("              4 <= NBLOCKS <= 1024\n");
+	printf("\n");
+	printf("options are passed to the pager, see pager_setopt in pager.h:\n");
+	printf("  policy=clock|wsclock|clockpro|arc\n");
+	printf("  wsclock_tau=N\n");
+	printf("  cleaner=0|1 cleaner_lookahead=N cleaner_batch=N cleaner_interval=USECS\n");
+	printf("  reclaim_low=N reclaim_high=N\n");
+	printf("  readahead=N readahead_map=0|1\n");
+	printf("  zero_frame=0|1\n");
+	printf("  overcommit=PERCENT\n");
+	printf("  swap_cluster=N\n");
+	printf("  quota_min=N quota_max=N ws_window=N\n");
+	printf("  dedup=0|1 dedup_batch=N dedup_interval=USECS\n");
+	printf("\n");
+	printf("options handled by the MMU:\n");
+	printf("  swap_pool=BYTES   compressed in-memory swap in front of the disk\n");
+	printf("  workers=N         serve clients with N threads and epoll, 0 for\n");
+	printf("                    a thread per client (default 4)\n");
+	printf("  rings=0|1         talk to clients over shared-memory rings\n");
+	printf("                    instead of their sockets (default 0)\n");
+	printf("  recycle_ids=0|1   reuse the trace ids of clients that exited\n");
+	printf("                    (default 0, ids follow the order of CREATE)\n");
+	printf("  pmem_memfd=0|1    keep physical memory in a memfd instead of\n");
+	printf("                    a file in the working directory (default 0)\n");
+	printf("  pmem_populate=0|1 prefault physical memory at startup (default 0)\n");
 	exit(EXIT_FAILURE);
 }/*}}}*/
 
 int main(int argc, char **argv) {/*{{{*/
-	if(argc != 3) usage(argc, argv);
+	if(argc < 3) usage(argc, argv);
 	int npages = atoi(argv[1]);
 	if(npages < 1 || npages > 256) usage(argc, argv);
 	int nblocks = atoi(argv[2]);
 	if(nblocks < 2 || nblocks > 1024) usage(argc, argv);
+	for(int i = 3; i < argc; ++i) {
+		char *value = strchr(argv[i], '=');
+		if(!value) usage(argc, argv);
+		*value++ = '\0';
+		int rc = mmu_setopt(argv[i], value);
+		if(rc > 0) rc = pager_setopt(argv[i], value);
+		if(rc) usage(argc, argv);
+	}
 	#ifdef MMULOG
 	log_init(LOG_EXTRA, "mmu.log", 1, 1<<20);
 	#endif
-	memset(id2pid, 255, UINT8_MAX * sizeof(pid_t));
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	mmu_init(npages, nblocks);
 	pager_init(npages, nblocks);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	logd(LOG_INFO, "%s: started in %.3f ms\n", __func__,
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
 	mmu_accept_loop();
+	pager_shutdown();
+	pager_stats();
 	#ifdef MMUFREE
 	pager_free();
 	#endif
@@ -23,15 +23,20 @@
  * pager should never write to `pmem`.  */
 extern const char *pmem;
 
-/* All functions in this module are blocking, i.e., they only return after
- * changes to physical memory, disk, and program virtual addresses are
- * complete.  */
+/* All functions in this module but the `_async` ones are blocking,
+ * i.e., they only return after changes to physical memory, disk, and
+ * program virtual addresses are complete.  */
 
 /* `mmu_zero_fill` will fill `frame` with zeroes (character '0').
  * Your page should use this function to initialize memory before
  * allowing read access to a page.  */
 void mmu_zero_fill(int frame);
 
+/* `mmu_frame_copy` copies the contents of frame `frame_from` into
+ * frame `frame_to`.  Like the other MMU operations it is traced, with
+ * a "mmu_frame_copy from frame F to frame T" line.  */
+void mmu_frame_copy(int frame_from, int frame_to);
+
 /* `mmu_resident` will map address `vaddr` in process `pid` to
  * `frame` with protection level `prot`.  `vaddr` should be
  * page-aligned (i.e., `vaddr & (PAGESIZE-1)` should be zero).
@@ -49,6 +54,20 @@ void mmu_nonresident(pid_t pid, void *vaddr);
  * on `vaddr` and `prot`.  */
 void mmu_chprot(pid_t pid, void *vaddr, int prot);
 
+/* `mmu_resident_async`, `mmu_nonresident_async` and `mmu_chprot_async`
+ * queue the same changes as the functions above for process `pid` and
+ * return without waiting for the process to effect them.  `mmu_flush`
+ * sends each process the changes queued for it in one message and
+ * waits until every change the calling thread queued is in effect;
+ * processes effect their changes in parallel, so a flush costs about
+ * one round trip however many processes it waits for.  A blocking
+ * call on a process sends and waits for the changes queued for it
+ * before.  */
+void mmu_resident_async(pid_t pid, void *vaddr, int frame, int prot);
+void mmu_nonresident_async(pid_t pid, void *vaddr);
+void mmu_chprot_async(pid_t pid, void *vaddr, int prot);
+void mmu_flush(void);
+
 /* `mmu_disk_read` copies content from disk block `block_from` into
  * physical frame `frame_to`.  `mmu_disk_write` copies content from
  * frame `frame_from` to disk block `block_to`.  Your pager should
@@ -56,4 +75,19 @@ void mmu_chprot(pid_t pid, void *vaddr, int prot);
 void mmu_disk_read(int block_from, int frame_to);
 void mmu_disk_write(int frame_from, int block_to);
 
+/* `mmu_disk_readv` and `mmu_disk_writev` move `count` pages between
+ * the frames in `frames` and the consecutive disk blocks starting at
+ * `block_from` or `block_to` in a single disk operation.  The pages
+ * are traced one by one, as `mmu_disk_read` and `mmu_disk_write`
+ * would trace them.  */
+void mmu_disk_readv(int block_from, const int *frames, int count);
+void mmu_disk_writev(const int *frames, int count, int block_to);
+
+/* `mmu_disk_discard` tells the MMU that disk block `block` no longer
+ * holds a page, so copies of it the MMU keeps, like the one in the
+ * compressed swap pool, can go.  Your pager should call it before
+ * returning a block to its free blocks, including in `pager_destroy`.
+ * Nothing is traced.  */
+void mmu_disk_discard(int block);
+
 #endif
@@ -14,16 +14,29 @@
  * receive the path to the memory-mapped file representing physical
  * memory.
  *
+ * A client that sets MMU_PROTO_CREATE_RINGS in `flags` can talk to
+ * the MMU over shared-memory rings (see ring.h).  If the MMU grants
+ * them, the reply has the flag set and carries the ring memfd as
+ * SCM_RIGHTS ancillary data.  Every later message then goes through
+ * the rings, and the socket only carries wakeup bytes from client to
+ * MMU and tells either side when the other one is gone.
+ *
  * The `EXTEND` and `SEGV` messages are generated by the client when
  * they allocate memory and experience a segmentation fault,
  * respectively.  The request functions (`uvm_extend` and
  * `uvm_segv_action`) wait on a condition variable for the request
- * to be serviced.
+ * to be serviced.  `EXTEND_N` allocates `count` contiguous pages in
+ * one round trip (`uvm_extend_n`); its reply carries the address of
+ * the first page, or zero if none was allocated.
  *
  * The `REMAP` and `CHPROT` messages are generated by the MMU and
  * are processed by `uvm_thread` asynchronously.  These messages are
  * used to service sergmentation faults and whenever the pager pages
- * some of the processes pages to disk. */
+ * some of the processes pages to disk.  `REMAP_N` and `CHPROT_N`
+ * carry `count` such changes, at most `MMU_PROTO_VEC_MAX`, in an
+ * array of entries; only the first `count` entries are sent.  The
+ * client effects them in order and acknowledges them all with a
+ * single `REMAP` or `CHPROT` request. */
 
 #ifndef __MMUPROTO_HEADER__
 #define __MMUPROTO_HEADER__
@@ -31,6 +44,9 @@
 /* From UNIX_PATH_MAX, see man (7) unix: */
 #define MMU_PROTO_PATH_MAX 108
 #define MMU_PROTO_UNIX_PATH "mmu.sock"
+#define MMU_PROTO_VEC_MAX 64
+
+#define MMU_PROTO_CREATE_RINGS 1
 
 #define MMU_PROTO_CREATE_REQ 1
 #define MMU_PROTO_CREATE_REP 2
@@ -44,15 +60,21 @@
 #define MMU_PROTO_REMAP_REP 10
 #define MMU_PROTO_CHPROT_REQ 11
 #define MMU_PROTO_CHPROT_REP 12
+#define MMU_PROTO_EXTEND_N_REQ 13
+#define MMU_PROTO_EXTEND_N_REP 14
+#define MMU_PROTO_REMAP_N_REP 16
+#define MMU_PROTO_CHPROT_N_REP 18
 #define MMU_PROTO_EXIT_REQ 32
 #define MMU_PROTO_EXIT_REP 33
 
 struct mmu_proto_create_req {
 	uint32_t type;
 	uint32_t pid;
+	uint32_t flags;
 } __attribute__((packed));
 struct mmu_proto_create_rep {
 	uint32_t type;
+	uint32_t flags;
 	char pmem_fn[MMU_PROTO_PATH_MAX];
 } __attribute__((packed));
 
@@ -64,6 +86,15 @@ struct mmu_proto_extend_rep {
 	uint64_t vaddr;
 } __attribute__((packed));
 
+struct mmu_proto_extend_n_req {
+	uint32_t type;
+	uint32_t count;
+} __attribute__((packed));
+struct mmu_proto_extend_n_rep {
+	uint32_t type;
+	uint64_t vaddr;
+} __attribute__((packed));
+
 struct mmu_proto_syslog_req {
 	uint32_t type;
 	uint32_t len;
@@ -81,6 +112,7 @@ struct mmu_proto_segv_req {
 } __attribute__((packed));
 struct mmu_proto_segv_rep {
 	uint32_t type;
+	uint32_t retcode;	/* nonzero if the fault could not be serviced */
 } __attribute__((packed));
 // segv causes remap and chprot to happen
 
@@ -103,6 +135,27 @@ struct mmu_proto_chprot_rep {
 	uint64_t vaddr;
 } __attribute__((packed));
 
+struct mmu_proto_remap_entry {
+	int32_t prot;
+	uint64_t offset;
+	uint64_t vaddr;
+} __attribute__((packed));
+struct mmu_proto_remap_n_rep {
+	uint32_t type;
+	uint32_t count;
+	struct mmu_proto_remap_entry pages[MMU_PROTO_VEC_MAX];
+} __attribute__((packed));
+
+struct mmu_proto_chprot_entry {
+	int32_t prot;
+	uint64_t vaddr;
+} __attribute__((packed));
+struct mmu_proto_chprot_n_rep {
+	uint32_t type;
+	uint32_t count;
+	struct mmu_proto_chprot_entry pages[MMU_PROTO_VEC_MAX];
+} __attribute__((packed));
+
 struct mmu_proto_exit_req {
 	uint32_t type;
 } __attribute__((packed));
@@ -5,293 +5,2805 @@
 #include "pager.h"
 #include "uvm.h"
 #include "mmu.h"
+#include "log.h"
+#include "pidhash.h"
 
 #include <sys/mman.h>
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-#define NUM_PAGES (UVM_MAXADDR - UVM_BASEADDR + 1) / sysconf(_SC_PAGESIZE)
+/****************************************************************************
+ * Address Space Geometry
+ ***************************************************************************/
+
+static size_t page_size = 0;   /**< System page size, cached by pager_init */
+static int page_shift = 0;     /**< log2(page_size) */
+static size_t num_pages = 0;   /**< Number of pages between UVM_BASEADDR and UVM_MAXADDR */
+
+/**
+ * Caches the page size, its log2 and the number of pages in the virtual
+ * address space managed by the MMU, so faults never call sysconf.
+ */
+static void initGeometry(void) {
+  page_size = sysconf(_SC_PAGESIZE);
+  page_shift = __builtin_ctzl(page_size);
+  num_pages = (UVM_MAXADDR - UVM_BASEADDR + 1) >> page_shift;
+}
+
+/**
+ * Computes the page table index of a virtual address.
+ * Pages are always laid out at `UVM_BASEADDR + i * page_size`.
+ *
+ * @param virtual_addr The virtual address.
+ * @return The index of the page containing `virtual_addr`, or -1 if the
+ *         address is outside the range managed by the MMU.
+ */
+static inline long pageIndex(__intptr_t virtual_addr) {
+  if (virtual_addr < UVM_BASEADDR || virtual_addr > UVM_MAXADDR) return -1;
+  return (virtual_addr - UVM_BASEADDR) >> page_shift;
+}
+
+/**
+ * Computes the virtual address of the page with the given index.
+ *
+ * @param idx The page table index.
+ * @return The first virtual address of the page.
+ */
+static inline __intptr_t pageAddress(size_t idx) {
+  return UVM_BASEADDR + (__intptr_t)(idx << page_shift);
+}
 
 /****************************************************************************
- * Chained List Data Structure
+ * Process Registry Data Structures
  ***************************************************************************/
 
 /**
- * @struct least_frequently_pointer
- * @brief Represents a pointer to the least frequently used page in a process.
+ * @typedef pte_t
+ * @brief A page table entry packed in 32 bits.
+ *
+ * The low `PTE_FRAME_BITS` bits hold the frame number while the page is
+ * present or mapped to a shared frame, and the high bits hold the flags below.  The page's address
+ * follows from its index in the page table, and the disk block backing it
+ * lives in a parallel array, so a page costs 8 bytes of metadata and scans
+ * over a page table stream through dense memory.
+ */
+typedef uint32_t pte_t;
+
+#define PTE_FRAME_BITS 20
+#define PTE_FRAME_MASK ((1u << PTE_FRAME_BITS) - 1) /**< Frame number of a present page */
+#define PTE_VALID      (1u << 20)   /**< The page was touched at least once */
+#define PTE_PRESENT    (1u << 21)   /**< The page occupies a frame */
+#define PTE_READ       (1u << 22)   /**< The page is mapped readable */
+#define PTE_WRITE      (1u << 23)   /**< The page is mapped writable */
+#define PTE_HAS_DATA   (1u << 24)   /**< The page was written, its contents must be kept */
+#define PTE_DIRTY      (1u << 25)   /**< Written since it was last read from or written to its block */
+#define PTE_UNMAPPED   (1u << 26)   /**< Present in its frame, but not mapped by the MMU yet */
+#define PTE_READAHEAD  (1u << 27)   /**< Read ahead and not faulted on since */
+#define PTE_ZERO       (1u << 28)   /**< Mapped read-only to the shared zero frame */
+#define PTE_SHARED     (1u << 29)   /**< Mapped read-only to a frame shared by identical pages */
+#define PTE_PROT_MASK  (PTE_READ | PTE_WRITE)
+
+#define PAGE_TABLE_MIN_CAPACITY 4
+
+/**
+ * Extracts the frame number of a present page.
+ *
+ * @param pte The page table entry.
+ * @return The frame number.
+ */
+static inline int pteFrame(pte_t pte) {
+  return pte & PTE_FRAME_MASK;
+}
+
+/**
+ * Stores a frame number in a page table entry.
+ *
+ * @param pte The page table entry.
+ * @param frame The frame number.
+ */
+static inline void pteSetFrame(pte_t *pte, int frame) {
+  *pte = (*pte & ~PTE_FRAME_MASK) | ((pte_t)frame & PTE_FRAME_MASK);
+}
+
+/**
+ * Extracts the protection a page is mapped with.
+ *
+ * @param pte The page table entry.
+ * @return PROT_NONE, PROT_READ or PROT_READ | PROT_WRITE.
+ */
+static inline int pteProt(pte_t pte) {
+  return ((pte & PTE_READ) ? PROT_READ : 0) | ((pte & PTE_WRITE) ? PROT_WRITE : 0);
+}
+
+/**
+ * Stores the protection a page is mapped with in a page table entry.
+ *
+ * @param pte The page table entry.
+ * @param prot PROT_NONE, PROT_READ or PROT_READ | PROT_WRITE.
+ */
+static inline void pteSetProt(pte_t *pte, int prot) {
+  *pte &= ~PTE_PROT_MASK;
+  if (prot & PROT_READ) *pte |= PTE_READ;
+  if (prot & PROT_WRITE) *pte |= PTE_WRITE;
+}
+
+/**
+ * @struct pager_stats
+ * @brief Counters reported by pager_stats.
+ *
+ * Each process counts the events that happen to its pages under its own
+ * lock, so faults need no shared counter; pager_destroy adds a process's
+ * counts to `retired_stats`.
+ */
+struct pager_stats {
+  unsigned long faults;       /**< Calls to pager_fault */
+  unsigned long pageins;      /**< Pages made resident, zero-filled, copied or read from disk */
+  unsigned long evictions;    /**< Pages evicted to free a frame */
+  unsigned long writebacks;   /**< Evictions that wrote the page to disk */
+  unsigned long clean_evictions;   /**< Evictions of pages with data whose block was current */
+  unsigned long cleaned;      /**< Dirty pages written back by the cleaner */
+  unsigned long background_evictions;   /**< Evictions done by the reclaim thread */
+  unsigned long readaheads;   /**< Pages read ahead */
+  unsigned long readahead_hits;    /**< Pages read ahead and used later */
+  unsigned long readahead_waste;   /**< Pages read ahead and evicted unused */
+  unsigned long zero_maps;    /**< Faults served by mapping the zero frame */
+  unsigned long merges;       /**< Pages merged into a shared frame */
+  unsigned long cow_breaks;   /**< Writes that gave a shared page a frame of its own */
+  unsigned long swap_failures;   /**< Faults that failed for lack of a free block to evict to */
+  unsigned long revocations;  /**< Reference bits cleared, each costing a chprot */
+  unsigned long stolen;       /**< Pages evicted to serve another process's fault */
+  unsigned long clustered;    /**< Neighbours evicted along with a victim */
+};
+
+#define STAT_INC(node, field) ((node)->data.stats.field++)
+
+/**
+ * Adds counters to a running total.
+ *
+ * @param total The total.
+ * @param counts The counters to add.
+ */
+static void statsAdd(struct pager_stats *total, const struct pager_stats *counts) {
+  total->faults += counts->faults;
+  total->pageins += counts->pageins;
+  total->evictions += counts->evictions;
+  total->writebacks += counts->writebacks;
+  total->clean_evictions += counts->clean_evictions;
+  total->cleaned += counts->cleaned;
+  total->background_evictions += counts->background_evictions;
+  total->readaheads += counts->readaheads;
+  total->readahead_hits += counts->readahead_hits;
+  total->readahead_waste += counts->readahead_waste;
+  total->zero_maps += counts->zero_maps;
+  total->merges += counts->merges;
+  total->cow_breaks += counts->cow_breaks;
+  total->swap_failures += counts->swap_failures;
+  total->revocations += counts->revocations;
+  total->stolen += counts->stolen;
+  total->clustered += counts->clustered;
+}
+
+/**
+ * @struct process_data
+ * @brief Represents the data associated with a process.
+ * 
+ * This struct contains information such as the process ID, the number of frames it holds,
+ * the queue the process belongs to, the page table and the blocks backing each page.  The
+ * page table only grows as the process extends its memory.  `lock` protects the page
+ * table and the counters; MMU calls that target the process are only made while holding it.
+ */
+struct process_data {
+  pid_t pid; /**< The process ID */
+  pthread_mutex_t lock; /**< Protects the page table and the counters */
+  size_t frames_allocated; /**< The number of frames holding the process's pages */
+  size_t frames_peak; /**< The most frames the process held at once */
+  size_t ws_size; /**< Working set estimate, in frames */
+  unsigned long ws_fault; /**< Virtual time of the last fault that took a frame */
+  unsigned long created; /**< Virtual time when the process was created */
+  size_t npages; /**< The number of pages extended, all at the start of the page table */
+  size_t capacity; /**< The number of entries allocated in `page_table` and `blocks` */
+  short queue; /**< The queue the process belongs to */
+  int ra_last; /**< Page of the last fault that read from disk, for readahead */
+  int ra_stride; /**< Distance between the last two such faults */
+  int ra_window; /**< Pages to read ahead when the stride repeats */
+  int failed_faults; /**< Faults in a row that failed for lack of frames and blocks */
+  pte_t *page_table; /**< Page table entries, indexed by page */
+  int32_t *blocks; /**< Disk block backing each page */
+  struct pager_stats stats; /**< Events that happened to the process's pages */
+};
+
+/**
+ * @struct Node
+ * Represents a process in the pager's process registry.
+ * Each node is linked twice: in a doubly linked list that keeps creation
+ * order and in the chain of the hash bucket its pid falls into (used for
+ * lookups).
+ */
+struct Node {
+  struct process_data data;
+  struct Node *next;  /**< Next process in creation order */
+  struct Node *prev;  /**< Previous process in creation order */
+  struct Node *hnext; /**< Next process in the same hash bucket */
+};
+
+/**
+ * @struct process_table
+ * @brief Pid-keyed hash table holding every process known to the pager.
+ *
+ * Lookups, insertions and removals are O(1) on average.  The bucket array
+ * doubles whenever the number of processes exceeds the number of buckets,
+ * and `head`/`tail` keep the creation order for walking every process.
+ */
+struct process_table {
+  struct Node **buckets; /**< Bucket array, `nbuckets` chains */
+  size_t nbuckets;       /**< Number of buckets, always a power of two */
+  size_t count;          /**< Number of processes in the table */
+  struct Node *head;     /**< Oldest process */
+  struct Node *tail;     /**< Newest process */
+  pthread_rwlock_t lock; /**< Protects the table; lookups share it */
+};
+
+#define PROCESS_TABLE_MIN_BUCKETS 64
+
+/**
+ * Resizes the bucket array of the process table and rehashes every node.
+ *
+ * @param table The process table.
+ * @param nbuckets The new number of buckets (a power of two).
+ */
+static void rehash(struct process_table *table, size_t nbuckets) {
+  struct Node **buckets = calloc(nbuckets, sizeof(struct Node*));
+  if (buckets == NULL) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (struct Node *current = table->head; current != NULL; current = current->next) {
+    size_t idx = pid_hash(current->data.pid, nbuckets);
+    current->hnext = buckets[idx];
+    buckets[idx] = current;
+  }
+
+  free(table->buckets);
+  table->buckets = buckets;
+  table->nbuckets = nbuckets;
+}
+
+/**
+ * Creates a new node for the process registry with the given process ID.
+ * The node contains a page table and other data related to the process.
+ *
+ * @param pid The process ID of the new node.
+ * @return A pointer to the newly created node.
+ */
+struct Node* createNode(pid_t pid) {
+  // Allocate memory for the new node
+  struct Node* newNode = (struct Node*)malloc(sizeof(struct Node));
+  if (newNode == NULL) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // The page table is allocated on the first pager_extend
+  newNode->data.page_table = NULL;
+  newNode->data.blocks = NULL;
+  newNode->data.capacity = 0;
+  newNode->data.pid = pid;
+  newNode->data.frames_allocated = 0;
+  newNode->data.frames_peak = 0;
+  newNode->data.ws_size = 0;
+  newNode->data.npages = 0;
+  newNode->data.queue = 0;
+  newNode->data.ra_last = -1;
+  newNode->data.ra_stride = 0;
+  newNode->data.ra_window = 0;
+  newNode->data.failed_faults = 0;
+  memset(&newNode->data.stats, 0, sizeof(newNode->data.stats));
+  pthread_mutex_init(&newNode->data.lock, NULL);
+  newNode->next = NULL;
+  newNode->prev = NULL;
+  newNode->hnext = NULL;
+
+  return newNode;
+}
+
+/**
+ * Frees a node that is no longer in the process table, together with its
+ * page table.
+ *
+ * @param node The node to be freed.
+ */
+void freeNode(struct Node *node) {
+  pthread_mutex_destroy(&node->data.lock);
+  free(node->data.page_table);
+  free(node->data.blocks);
+  free(node);
+}
+
+/**
+ * Inserts a new node with the given process ID into the process table.
+ * The node is appended to the end of the creation order list.
+ *
+ * @param table The process table.
+ * @param pid Process ID to be inserted.
+ */
+void insert(struct process_table *table, pid_t pid) {
+  if (table->count >= table->nbuckets) {
+    size_t nbuckets = table->nbuckets ? 2 * table->nbuckets : PROCESS_TABLE_MIN_BUCKETS;
+    rehash(table, nbuckets);
+  }
+
+  struct Node* newNode = createNode(pid);
+
+  size_t idx = pid_hash(pid, table->nbuckets);
+  newNode->hnext = table->buckets[idx];
+  table->buckets[idx] = newNode;
+
+  newNode->prev = table->tail;
+  if (table->tail == NULL) {
+    table->head = newNode;
+  } else {
+    table->tail->next = newNode;
+  }
+  table->tail = newNode;
+  table->count++;
+}
+
+/**
+ * Removes a process node from the process table.  The node is not freed.
+ *
+ * @param table The process table.
+ * @param pid The process ID to be removed.
+ * @return The removed node, or NULL if the process was not found.
+ */
+struct Node* removeProcess(struct process_table *table, pid_t pid) {
+  if (table->nbuckets == 0) return NULL;
+
+  struct Node **link = &table->buckets[pid_hash(pid, table->nbuckets)];
+  while (*link != NULL && (*link)->data.pid != pid) {
+    link = &(*link)->hnext;
+  }
+
+  struct Node *current = *link;
+  if (current == NULL) return NULL;
+  *link = current->hnext;
+
+  if (current->prev == NULL) {
+    table->head = current->next;
+  } else {
+    current->prev->next = current->next;
+  }
+  if (current->next == NULL) {
+    table->tail = current->prev;
+  } else {
+    current->next->prev = current->prev;
+  }
+  table->count--;
+
+  return current;
+}
+
+/**
+ * Searches for the node with a specific process ID (pid) in the process table.
  * 
- * This struct holds a reference to the initial process and the initial page number
- * of the least frequently used page in that process.
+ * @param table The process table.
+ * @param pid The process ID to search for.
+ * @return A pointer to the node with the specified pid, or NULL if not found.
+ */
+struct Node* searchByPid(struct process_table *table, pid_t pid) {
+  if (table->nbuckets == 0) return NULL;
+
+  struct Node* current = table->buckets[pid_hash(pid, table->nbuckets)];
+  while (current != NULL) {
+    if (current->data.pid == pid) {
+      return current;
+    }
+    current = current->hnext;
+  } 
+
+  return NULL;
+}
+
+/**
+ * Grows the page table of a process so it can hold at least one more page.
+ * The capacity doubles, up to the number of pages the MMU manages.
+ *
+ * @param process_node The process node.
+ */
+void growPageTable(struct Node *process_node) {
+  size_t capacity = process_node->data.capacity * 2;
+  if (capacity < PAGE_TABLE_MIN_CAPACITY) capacity = PAGE_TABLE_MIN_CAPACITY;
+  if (capacity > num_pages) capacity = num_pages;
+
+  pte_t *page_table = realloc(process_node->data.page_table, capacity * sizeof(pte_t));
+  int32_t *blocks = realloc(process_node->data.blocks, capacity * sizeof(int32_t));
+  if (page_table == NULL || blocks == NULL) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  process_node->data.page_table = page_table;
+  process_node->data.blocks = blocks;
+  process_node->data.capacity = capacity;
+}
+
+/**
+ * Searches for a page in the page table of a process based on the virtual
+ * address.  The entry index is computed directly from the address, so the
+ * lookup takes constant time.
+ *
+ * @param pid_proccess The node of the target process.
+ * @param virtual_addr The virtual address to search for.
+ * @return The page table index if found, -1 otherwise.
+ */
+long searchByPage(struct Node *pid_proccess, __intptr_t virtual_addr) {
+  long idx = pageIndex(virtual_addr);
+  if (idx < 0 || (size_t) idx >= pid_proccess->data.npages) return -1;
+
+  return idx;
+}
+
+/**
+ * Prints the data of each process, in creation order.
+ *
+ * @param table The process table.
+ */
+void printList(struct process_table *table) {
+  struct Node* current = table->head;
+
+  while (current != NULL) {
+    printf("PID: %d\n", current->data.pid);
+    current = current->next;
+  }
+}
+
+
+/****************************************************************************
+ * Bitmap Allocator
+ ***************************************************************************/
+
+/**
+ * @struct bitmap_allocator
+ * @brief Hands out the lowest-numbered free slot out of a fixed range.
+ *
+ * Free slots are kept as set bits in `words`.  A second level, `summary`,
+ * has bit `w` set whenever `words[w]` still has a free slot, so finding the
+ * lowest free slot scans one summary word per 4096 slots and then uses two
+ * find-first-set instructions.  Freeing a slot is O(1).
+ */
+struct bitmap_allocator {
+  uint64_t *words;   /**< One bit per slot, set when the slot is free */
+  uint64_t *summary; /**< One bit per word of `words`, set when it has free slots */
+  size_t nwords;     /**< Number of words in `words` */
+  size_t nsummary;   /**< Number of words in `summary` */
+  int size;          /**< Number of slots */
+  int nfree;         /**< Number of free slots */
+};
+
+/**
+ * Initializes an allocator with `size` slots, all of them free.
+ *
+ * @param allocator The allocator.
+ * @param size The number of slots.
+ */
+static void allocatorInit(struct bitmap_allocator *allocator, int size) {
+  allocator->nwords = (size + 63) / 64;
+  allocator->nsummary = (allocator->nwords + 63) / 64;
+  allocator->words = calloc(allocator->nwords, sizeof(uint64_t));
+  allocator->summary = calloc(allocator->nsummary, sizeof(uint64_t));
+  if (allocator->words == NULL || allocator->summary == NULL) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  allocator->size = size;
+  allocator->nfree = size;
+
+  for (size_t w = 0; w < allocator->nwords; w++) {
+    size_t left = size - w * 64;
+    allocator->words[w] = left >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << left) - 1;
+    allocator->summary[w / 64] |= (uint64_t)1 << (w % 64);
+  }
+}
+
+/**
+ * Releases the memory held by an allocator.
+ *
+ * @param allocator The allocator.
+ */
+static void allocatorFree(struct bitmap_allocator *allocator) {
+  free(allocator->words);
+  free(allocator->summary);
+  allocator->words = allocator->summary = NULL;
+  allocator->size = allocator->nfree = 0;
+}
+
+/**
+ * Takes the lowest-numbered free slot.
+ *
+ * @param allocator The allocator.
+ * @return The slot number, or -1 if every slot is in use.
+ */
+static int allocatorGet(struct bitmap_allocator *allocator) {
+  for (size_t s = 0; s < allocator->nsummary; s++) {
+    if (allocator->summary[s] == 0) continue;
+
+    size_t w = s * 64 + __builtin_ctzll(allocator->summary[s]);
+    int bit = __builtin_ctzll(allocator->words[w]);
+    allocator->words[w] &= allocator->words[w] - 1;
+    if (allocator->words[w] == 0) {
+      allocator->summary[s] &= ~((uint64_t)1 << (w % 64));
+    }
+    allocator->nfree--;
+    return (int)(w * 64 + bit);
+  }
+
+  return -1;
+}
+
+/**
+ * Takes the lowest-numbered run of `n` consecutive free slots.
+ *
+ * @param allocator The allocator.
+ * @param n The length of the run.
+ * @return The first slot of the run, or -1 if no run is that long.
+ */
+static int allocatorGetRun(struct bitmap_allocator *allocator, int n) {
+  int start = -1, length = 0;
+  for (int slot = 0; slot < allocator->size && length < n; slot++) {
+    uint64_t word = allocator->words[slot / 64];
+    if (word == 0) {
+      // A word with no free slot breaks the run
+      slot |= 63;
+      length = 0;
+    } else if (word & ((uint64_t)1 << (slot % 64))) {
+      if (length++ == 0) start = slot;
+    } else {
+      length = 0;
+    }
+  }
+  if (length < n) return -1;
+
+  for (int slot = start; slot < start + n; slot++) {
+    size_t w = slot / 64;
+    allocator->words[w] &= ~((uint64_t)1 << (slot % 64));
+    if (allocator->words[w] == 0) {
+      allocator->summary[w / 64] &= ~((uint64_t)1 << (w % 64));
+    }
+  }
+  allocator->nfree -= n;
+  return start;
+}
+
+/**
+ * Returns a slot to the allocator.
+ *
+ * @param allocator The allocator.
+ * @param slot The slot number, previously returned by allocatorGet.
+ */
+static void allocatorPut(struct bitmap_allocator *allocator, int slot) {
+  size_t w = slot / 64;
+  assert(!(allocator->words[w] & ((uint64_t)1 << (slot % 64))));
+  allocator->words[w] |= (uint64_t)1 << (slot % 64);
+  allocator->summary[w / 64] |= (uint64_t)1 << (w % 64);
+  allocator->nfree++;
+}
+
+
+/****************************************************************************
+ * Frame Table
+ ***************************************************************************/
+
+/**
+ * @struct frame_table
+ * @brief Inverted page table describing what occupies each physical frame.
+ *
+ * The frame table is indexed by frame number, so replacement policies
+ * sweep physical frames directly: a sweep visits at most `nframes`
+ * entries no matter how many processes there are or how their pages are
+ * laid out.  Fields are kept as separate arrays, so a sweep streams
+ * through one byte of reference bit per frame.
+ *
+ * `owner` and `page` change only with both `frame_lock` and the owner's
+ * lock held, so either lock is enough to read them.  `referenced` belongs
+ * to the owner's page and is protected by the owner's lock alone.
+ */
+struct frame_table {
+  struct Node **owner;  /**< Process whose page occupies each frame, NULL if free */
+  int32_t *page;        /**< Page table index of that page in the owner */
+  uint8_t *referenced;  /**< Set when the page is accessed, cleared when access is revoked */
+  int size;             /**< Number of frames */
+};
+
+/**
+ * @struct replacement_policy
+ * @brief Hooks a page replacement policy implements.
+ *
+ * The pager only learns about accesses through faults, so every policy
+ * works from the frame table's reference bits: a page is referenced when
+ * it is mapped or when a fault raises its protection, and a policy that
+ * wants to observe the next access clears the bit with revokeAccess, which
+ * maps the page PROT_NONE.
+ *
+ * `on_insert`, `on_evict` and `choose_victim` are called with `frame_lock`
+ * held; `on_access` is called with the owner's lock held only, so it must
+ * not touch state shared between processes.  Any hook but `choose_victim`
+ * may be NULL.
+ */
+struct replacement_policy {
+  const char *name;                      /**< Name used to select the policy */
+  void (*init)(int nframes);             /**< Resets the policy for `nframes` empty frames */
+  void (*on_insert)(int frame);          /**< A page was mapped into `frame` */
+  void (*on_access)(int frame);          /**< The page in `frame` was accessed */
+  void (*on_evict)(int frame);           /**< The page in `frame` is leaving memory */
+  /**
+   * Chooses a victim when no frame is free.  Returns the frame still mapped,
+   * with its owner locked, or -1 if every candidate belongs to a busy process.
+   * May drop and retake `frame_lock`.
+   */
+  int (*choose_victim)(struct Node *self);
+  /**
+   * Lists up to `max` mapped frames in the order the policy would examine
+   * them for eviction, so the cleaner can write them back ahead of time.
+   * Returns the number of frames listed.
+   */
+  int (*lookahead)(int *frames, int max);
+};
+
+struct bitmap_allocator frame_allocator;   /**< Free memory frames */
+static struct frame_table frame_table;     /**< What occupies each frame */
+static int clock_hand = 0;                 /**< Next frame a clock sweep examines */
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER; /**< Protects the frame allocator, the frame table and the policy state */
+struct bitmap_allocator block_allocator;   /**< Free disk blocks */
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;   /**< Protects the block allocator */
+static const struct replacement_policy *policy;   /**< Selected replacement policy */
+static unsigned long vtime = 0;            /**< Virtual time, advanced by every frame taken */
+static struct pager_stats retired_stats;   /**< Counts of destroyed processes, under `frame_lock` */
+
+/**
+ * Allocates the frame table with every frame free and resets the clock hand.
+ *
+ * @param nframes The number of frames.
+ */
+static void frameTableInit(int nframes) {
+  free(frame_table.owner);
+  free(frame_table.page);
+  free(frame_table.referenced);
+  frame_table.owner = calloc(nframes, sizeof(struct Node*));
+  frame_table.page = calloc(nframes, sizeof(int32_t));
+  frame_table.referenced = calloc(nframes, sizeof(uint8_t));
+  if (frame_table.owner == NULL || frame_table.page == NULL || frame_table.referenced == NULL) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  frame_table.size = nframes;
+  clock_hand = 0;
+}
+
+/**
+ * Records that page `idx` of `process_node` now occupies `frame`.
+ * The page starts with its reference bit set, as it is being accessed.
+ * Must be called with `frame_lock` and the process's lock held.
+ *
+ * @param frame The frame number.
+ * @param process_node The owner process.
+ * @param idx The page table index of the page.
+ */
+static void frameTableMap(int frame, struct Node *process_node, size_t idx) {
+  frame_table.owner[frame] = process_node;
+  frame_table.page[frame] = idx;
+  frame_table.referenced[frame] = 1;
+  pteSetFrame(&process_node->data.page_table[idx], frame);
+  if (++process_node->data.frames_allocated > process_node->data.frames_peak) {
+    process_node->data.frames_peak = process_node->data.frames_allocated;
+  }
+  if (policy->on_insert) policy->on_insert(frame);
+}
+
+/**
+ * Marks `frame` as holding no page.  Must be called with `frame_lock` and
+ * the owner's lock held.
+ *
+ * @param frame The frame number.
+ */
+static void frameTableUnmap(int frame) {
+  if (policy->on_evict) policy->on_evict(frame);
+  frame_table.owner[frame]->data.frames_allocated--;
+  frame_table.owner[frame] = NULL;
+  frame_table.page[frame] = -1;
+  frame_table.referenced[frame] = 0;
+}
+
+/**
+ * Records an access to the page in `frame`.  Must be called with the
+ * owner's lock held.
+ *
+ * @param frame The frame number.
+ */
+static void frameAccessed(int frame) {
+  frame_table.referenced[frame] = 1;
+  if (policy->on_access) policy->on_access(frame);
+}
+
+/**
+ * Locks the owner of `frame` so its page can be examined.  Called with
+ * `frame_lock` and `self`'s lock held.  Other owners are only try-locked,
+ * since their own faults may be waiting on `frame_lock`.
+ *
+ * @param frame The frame number.
+ * @param self The process that needs a frame, whose lock is held.
+ * @return The owner, locked, or NULL if the frame is free or its owner busy.
+ */
+static struct Node *lockFrameOwner(int frame, struct Node *self) {
+  struct Node *owner = frame_table.owner[frame];
+  if (owner == NULL || (owner != self && pthread_mutex_trylock(&owner->data.lock) != 0)) {
+    return NULL;
+  }
+  return owner;
+}
+
+/**
+ * Releases an owner locked by lockFrameOwner.
+ *
+ * @param owner The owner.
+ * @param self The process that needs a frame.
+ */
+static void unlockFrameOwner(struct Node *owner, struct Node *self) {
+  if (owner != self) pthread_mutex_unlock(&owner->data.lock);
+}
+
+/**
+ * Clears the reference bit of the page in `frame` and maps it PROT_NONE,
+ * so its next access faults and sets the bit again.  The chprot is only
+ * posted: a sweep revokes access to pages of many processes, and the
+ * thread that sweeps waits for all of them at once with mmu_flush when it
+ * evicts its victim.  The owner, locked by lockFrameOwner, is released.
+ *
+ * @param frame The frame number.
+ * @param owner The owner of the page, locked.
+ * @param self The process that needs a frame.
+ */
+static void revokeAccess(int frame, struct Node *owner, struct Node *self) {
+  int page = frame_table.page[frame];
+  frame_table.referenced[frame] = 0;
+  mmu_chprot_async(owner->data.pid, (void *) pageAddress(page), PROT_NONE);
+  pteSetProt(&owner->data.page_table[page], PROT_NONE);
+  STAT_INC(owner, revocations);
+  unlockFrameOwner(owner, self);
+}
+
+/**
+ * Tells whether evicting the page in `frame` requires writing it to disk.
+ * The owner's lock must be held.
+ *
+ * @param frame The frame number.
+ * @return Nonzero if the page is dirty.
+ */
+static int frameNeedsWriteback(int frame) {
+  struct Node *owner = frame_table.owner[frame];
+  return (owner->data.page_table[frame_table.page[frame]] & PTE_DIRTY) != 0;
+}
+
+
+/****************************************************************************
+ * Working Sets and Frame Quotas
+ ***************************************************************************/
+
+/*
+ * Each process keeps a working set estimate driven by its page fault
+ * frequency: a fault that takes a frame within `ws_window` of virtual time
+ * after the previous one grows the estimate by a frame, and every full
+ * window without faults shrinks it by one.  Quotas are off by default;
+ * with them, the policies only offer victims the quotas allow:
+ *
+ *  - a process holding `quota_max` frames replaces its own pages, so a
+ *    scan recycles its own frames instead of taking everyone else's;
+ *  - a process keeps up to `quota_min` frames of its working set against
+ *    other processes' faults and the reclaim thread.
+ *
+ * When no frame is allowed, one selection ignores the quotas, so a fault
+ * always makes progress.
+ */
+static unsigned long quota_min = 0;    /**< Frames of its working set a process keeps, 0 for none */
+static unsigned long quota_max = 0;    /**< Frames a process may hold, 0 for no limit */
+static unsigned long ws_window = 0;    /**< Fault interval that grows a working set, 0 for the number of frames */
+static int quotas_relaxed = 0;         /**< The next selection ignores the quotas, under `frame_lock` */
+
+#define QUOTAS_ENABLED() (quota_min != 0 || quota_max != 0)
+
+/**
+ * Updates the working set estimate of a process that is taking a frame.
+ * Called with `frame_lock` and the process's lock held.
+ *
+ * @param process_node The process.
+ */
+static void workingSetFault(struct Node *process_node) {
+  struct process_data *data = &process_node->data;
+  unsigned long window = ws_window ? ws_window : (unsigned long) frame_table.size;
+  unsigned long idle = (vtime - data->ws_fault) / window;
+  if (idle == 0) {
+    if (data->ws_size <= data->frames_allocated) data->ws_size++;
+  } else {
+    data->ws_size = idle < data->ws_size ? data->ws_size - idle : 0;
+  }
+  data->ws_fault = vtime;
+}
+
+/**
+ * Tells whether the quotas let the page of `owner` be evicted to serve
+ * `self`.  Called with `frame_lock` held.
+ *
+ * @param owner The owner of the candidate frame.
+ * @param self The process that needs a frame, or NULL for the reclaim thread.
+ * @return Nonzero if the frame may be evicted.
+ */
+static int victimAllowed(struct Node *owner, struct Node *self) {
+  if (!QUOTAS_ENABLED() || quotas_relaxed) return 1;
+  if (self != NULL && quota_max && self->data.frames_allocated >= quota_max) return owner == self;
+  if (owner == self) return 1;
+  size_t reserve = owner->data.ws_size < quota_min ? owner->data.ws_size : quota_min;
+  return owner->data.frames_allocated > reserve;
+}
+
+/**
+ * Locks the owner of `frame` like lockFrameOwner, for a policy choosing a
+ * victim: frames the quotas protect from `self` are treated as busy.
+ *
+ * @param frame The frame number.
+ * @param self The process that needs a frame, whose lock is held.
+ * @return The owner, locked, or NULL if the frame cannot be taken now.
+ */
+static struct Node *lockVictimOwner(int frame, struct Node *self) {
+  struct Node *owner = lockFrameOwner(frame, self);
+  if (owner != NULL && !victimAllowed(owner, self)) {
+    unlockFrameOwner(owner, self);
+    return NULL;
+  }
+  return owner;
+}
+
+/**
+ * Logs the resident set and fault rate of a process.
+ *
+ * @param process_node The process.
+ * @param what What is happening to it.
+ */
+static void logWorkingSet(struct Node *process_node, const char *what) {
+  struct process_data *data = &process_node->data;
+  unsigned long lifetime = vtime - data->created;
+  logd(LOG_INFO, "%s: pid %d resident %zu peak %zu ws %zu, faults %lu pageins %lu "
+       "(%.1f%% of frames taken) stolen %lu\n", what, (int) data->pid,
+       data->frames_allocated, data->frames_peak, data->ws_size, data->stats.faults,
+       data->stats.pageins, lifetime ? 100.0 * data->stats.pageins / lifetime : 0.0,
+       data->stats.stolen);
+}
+
+
+/****************************************************************************
+ * Replacement Policies
+ ***************************************************************************/
+
+/*
+ * Policies that keep pages in lists link them through `ring_next` and
+ * `ring_prev`, indexed by node: nodes below `nframes` are frames, the
+ * others are ghosts, which remember pages that were evicted recently.
+ *
+ * Pages are mapped with their reference bit set, so a policy that tells
+ * reused pages from pages touched once marks new pages NODE_FRESH: the
+ * first time a hand finds such a page referenced, it only revokes access,
+ * and only a reference seen after that counts as reuse.
+ */
+#define NODE_FRESH 0x80   /**< The reference bit may only record the access that mapped the page */
+
+static int32_t *ring_next = NULL;     /**< Next node in the node's ring */
+static int32_t *ring_prev = NULL;     /**< Previous node in the node's ring */
+static uint8_t *node_flags = NULL;    /**< Policy specific flags of each node */
+static unsigned long *frame_stamp = NULL;   /**< Virtual time of each frame's last observed use */
+
+/**
+ * @struct ghost_table
+ * @brief Directory of evicted pages, keyed by process and page.
+ *
+ * Ghosts are nodes `base` to `base + capacity - 1`; free ones are chained
+ * through `hnext`, used ones hash on their process ID and page index.
+ */
+struct ghost_table {
+  pid_t *pid;           /**< Process of each ghost */
+  int32_t *page;        /**< Page index of each ghost */
+  int32_t *hnext;       /**< Next ghost in the bucket or in the free list */
+  int32_t *buckets;     /**< First ghost of each bucket */
+  int nbuckets;         /**< Number of buckets, a power of two */
+  int32_t free;         /**< First free ghost */
+  int base;             /**< Node number of the first ghost */
+  int capacity;         /**< Number of ghosts */
+  int count;            /**< Ghosts in use */
+};
+
+static struct ghost_table ghosts;
+
+/**
+ * Allocates the node arrays for `nframes` frames and `nghosts` ghosts.
+ *
+ * @param nframes The number of frames.
+ * @param nghosts The number of ghosts, possibly zero.
+ */
+static void policyStateInit(int nframes, int nghosts) {
+  int nnodes = nframes + nghosts;
+  free(ring_next);
+  free(ring_prev);
+  free(node_flags);
+  free(frame_stamp);
+  free(ghosts.pid);
+  free(ghosts.page);
+  free(ghosts.hnext);
+  free(ghosts.buckets);
+  ring_next = malloc(nnodes * sizeof(int32_t));
+  ring_prev = malloc(nnodes * sizeof(int32_t));
+  node_flags = calloc(nnodes, sizeof(uint8_t));
+  frame_stamp = calloc(nframes, sizeof(unsigned long));
+
+  ghosts.nbuckets = 1;
+  while (ghosts.nbuckets < nghosts) ghosts.nbuckets <<= 1;
+  ghosts.pid = malloc((nghosts + 1) * sizeof(pid_t));
+  ghosts.page = malloc((nghosts + 1) * sizeof(int32_t));
+  ghosts.hnext = malloc((nghosts + 1) * sizeof(int32_t));
+  ghosts.buckets = malloc(ghosts.nbuckets * sizeof(int32_t));
+  if (ring_next == NULL || ring_prev == NULL || node_flags == NULL || frame_stamp == NULL
+      || ghosts.pid == NULL || ghosts.page == NULL || ghosts.hnext == NULL || ghosts.buckets == NULL) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int b = 0; b < ghosts.nbuckets; b++) ghosts.buckets[b] = -1;
+  for (int g = 0; g < nghosts; g++) ghosts.hnext[g] = g + 1 < nghosts ? g + 1 : -1;
+  ghosts.free = nghosts > 0 ? 0 : -1;
+  ghosts.base = nframes;
+  ghosts.capacity = nghosts;
+  ghosts.count = 0;
+}
+
+/**
+ * Hashes a ghost key into a bucket.
+ *
+ * @param pid The process ID.
+ * @param page The page index.
+ * @return The bucket index.
+ */
+static inline int ghostBucket(pid_t pid, int page) {
+  uint32_t key = (uint32_t) pid * 0x9E3779B1u ^ (uint32_t) page * 0x85EBCA77u;
+  return (key >> 7) & (ghosts.nbuckets - 1);
+}
+
+/**
+ * Finds the ghost of a page.
+ *
+ * @param pid The process ID.
+ * @param page The page index.
+ * @return The ghost's node number, or -1 if the page has no ghost.
+ */
+static int ghostFind(pid_t pid, int page) {
+  if (ghosts.capacity == 0) return -1;
+  for (int g = ghosts.buckets[ghostBucket(pid, page)]; g >= 0; g = ghosts.hnext[g]) {
+    if (ghosts.pid[g] == pid && ghosts.page[g] == page) return ghosts.base + g;
+  }
+  return -1;
+}
+
+/**
+ * Creates the ghost of a page.  A free ghost must exist.
+ *
+ * @param pid The process ID.
+ * @param page The page index.
+ * @return The ghost's node number.
+ */
+static int ghostAlloc(pid_t pid, int page) {
+  int g = ghosts.free;
+  assert(g >= 0);
+  ghosts.free = ghosts.hnext[g];
+  int b = ghostBucket(pid, page);
+  ghosts.pid[g] = pid;
+  ghosts.page[g] = page;
+  ghosts.hnext[g] = ghosts.buckets[b];
+  ghosts.buckets[b] = g;
+  ghosts.count++;
+  return ghosts.base + g;
+}
+
+/**
+ * Forgets a ghost.
+ *
+ * @param node The ghost's node number.
+ */
+static void ghostFree(int node) {
+  int g = node - ghosts.base;
+  int32_t *link = &ghosts.buckets[ghostBucket(ghosts.pid[g], ghosts.page[g])];
+  while (*link != g) link = &ghosts.hnext[*link];
+  *link = ghosts.hnext[g];
+  ghosts.hnext[g] = ghosts.free;
+  ghosts.free = g;
+  ghosts.count--;
+}
+
+/**
+ * Links `node` into a ring right before `pos`, or alone if `pos` is -1.
+ *
+ * @param pos A node of the ring, or -1.
+ * @param node The node to link.
+ */
+static void ringLinkBefore(int pos, int node) {
+  if (pos < 0) {
+    ring_next[node] = ring_prev[node] = node;
+    return;
+  }
+  ring_next[node] = pos;
+  ring_prev[node] = ring_prev[pos];
+  ring_next[ring_prev[pos]] = node;
+  ring_prev[pos] = node;
+}
+
+/**
+ * Unlinks `node` from its ring.
+ *
+ * @param node The node to unlink.
+ * @return The node that followed it, or -1 if it was alone.
+ */
+static int ringUnlink(int node) {
+  int next = ring_next[node];
+  if (next == node) return -1;
+  ring_next[ring_prev[node]] = next;
+  ring_prev[next] = ring_prev[node];
+  return next;
+}
+
+/**
+ * @struct ring_list
+ * @brief An LRU list kept as a ring, oldest node first.
+ */
+struct ring_list {
+  int head;   /**< Oldest node, -1 if empty */
+  int size;   /**< Number of nodes */
+};
+
+static void listPushTail(struct ring_list *list, int node) {
+  ringLinkBefore(list->head, node);
+  if (list->head < 0) list->head = node;
+  list->size++;
+}
+
+static void listRemove(struct ring_list *list, int node) {
+  int next = ringUnlink(node);
+  if (list->head == node) list->head = next;
+  list->size--;
+}
+
+/*
+ * CLOCK: the second chance algorithm.  The hand advances over physical
+ * frames; pages with their reference bit set lose it, pages without it are
+ * evicted.  The hand stops right after the victim.
+ */
+
+/**
+ * Chooses a victim with the second chance algorithm.
+ *
+ * @param self The process that needs a frame, whose lock is held.
+ * @return The victim frame, with its owner locked, or -1 if a full sweep
+ *         found every candidate frame busy.
+ */
+static int clockChooseVictim(struct Node *self) {
+  int skipped = 0;
+  while (skipped < frame_table.size) {
+    int frame = clock_hand;
+    clock_hand = (clock_hand + 1) % frame_table.size;
+
+    struct Node *owner = lockVictimOwner(frame, self);
+    if (owner == NULL) {
+      skipped++;
+      continue;
+    }
+    skipped = 0;
+
+    if (!frame_table.referenced[frame]) return frame;
+    revokeAccess(frame, owner, self);
+  }
+
+  return -1;
+}
+
+/**
+ * Lists the frames a clock hand reaches next.
+ *
+ * @param frames Set to the frames.
+ * @param max The maximum number of frames.
+ * @return The number of frames listed.
+ */
+static int clockLookahead(int *frames, int max) {
+  int count = 0;
+  for (int i = 0; i < frame_table.size && count < max; i++) {
+    int frame = (clock_hand + i) % frame_table.size;
+    if (frame_table.owner[frame] != NULL) frames[count++] = frame;
+  }
+  return count;
+}
+
+static const struct replacement_policy clock_policy = {
+  "clock", NULL, NULL, NULL, NULL, clockChooseVictim, clockLookahead
+};
+
+/*
+ * WSClock: the clock hand also ages pages.  A page seen referenced gets
+ * the current virtual time, counted in frames taken; an unreferenced page
+ * older than `wsclock_tau` is outside the working set of its process.  Such pages are
+ * evicted if they are clean; a dirty one is only taken after a full
+ * revolution found no clean page, and if no page is old enough either,
+ * the next unreferenced page is taken, as with CLOCK.
+ */
+static unsigned long wsclock_tau = 0;   /**< Working set window in frames taken, 0 for `nframes / 2` */
+
+static void wsclockInit(int nframes) {
+  policyStateInit(nframes, 0);
+}
+
+static void wsclockInsert(int frame) {
+  frame_stamp[frame] = vtime;
+}
+
+/**
+ * Chooses a victim with the WSClock algorithm.
+ *
+ * @param self The process that needs a frame, whose lock is held.
+ * @return The victim frame, with its owner locked, or -1 if a full sweep
+ *         found every candidate frame busy.
+ */
+static int wsclockChooseVictim(struct Node *self) {
+  unsigned long now = vtime;
+  unsigned long tau = wsclock_tau ? wsclock_tau : (unsigned long) frame_table.size / 2 + 1;
+  int skipped = 0, examined = 0, dirty_candidate = -1, any_unreferenced = 0;
+
+  while (skipped < frame_table.size) {
+    int frame = clock_hand;
+    clock_hand = (clock_hand + 1) % frame_table.size;
+
+    struct Node *owner = lockVictimOwner(frame, self);
+    if (owner == NULL) {
+      skipped++;
+      continue;
+    }
+    skipped = 0;
+
+    int old = now > frame_stamp[frame] + tau;
+    if (frame_table.referenced[frame]) {
+      frame_stamp[frame] = now;
+      revokeAccess(frame, owner, self);
+    } else if (any_unreferenced || (old && !frameNeedsWriteback(frame))) {
+      return frame;
+    } else {
+      if (old && dirty_candidate < 0) dirty_candidate = frame;
+      unlockFrameOwner(owner, self);
+    }
+
+    if (++examined == frame_table.size) {
+      // A full revolution found no clean page outside the working sets
+      if (dirty_candidate >= 0 && (owner = lockVictimOwner(dirty_candidate, self)) != NULL) {
+        if (!frame_table.referenced[dirty_candidate]) {
+          clock_hand = (dirty_candidate + 1) % frame_table.size;
+          return dirty_candidate;
+        }
+        unlockFrameOwner(owner, self);
+      }
+      any_unreferenced = 1;
+    }
+  }
+
+  return -1;
+}
+
+static const struct replacement_policy wsclock_policy = {
+  "wsclock", wsclockInit, wsclockInsert, NULL, NULL, wsclockChooseVictim, clockLookahead
+};
+
+/*
+ * ARC, in its clock form (CAR): resident pages live in T1, seen once
+ * since they entered memory, or T2, seen again; both are clocks.  Evicted
+ * pages leave ghosts in B1 or B2.  A fault on a ghost in B1 grows `car_p`,
+ * the target size of T1, one in B2 shrinks it, so the split between
+ * recency and frequency adapts to the workload.  Exact ARC moves a page on
+ * every hit, which would need a fault per access; CAR only needs the
+ * reference bits.
+ */
+#define CAR_T1 1
+#define CAR_T2 2
+#define CAR_B1 3
+#define CAR_B2 4
+#define CAR_LIST 0x7
+
+static struct ring_list car_t1, car_t2, car_b1, car_b2;
+static int car_p = 0;   /**< Target size of T1 */
+
+static void carInit(int nframes) {
+  policyStateInit(nframes, nframes);
+  car_t1 = car_t2 = car_b1 = car_b2 = (struct ring_list) {-1, 0};
+  car_p = 0;
+}
+
+/**
+ * Forgets the oldest ghost of B1 or B2.
+ *
+ * @param list The ghost list.
+ */
+static void carDropGhost(struct ring_list *list) {
+  int node = list->head;
+  listRemove(list, node);
+  ghostFree(node);
+}
+
+static void carInsert(int frame) {
+  struct Node *owner = frame_table.owner[frame];
+  int c = frame_table.size;
+  int ghost = ghostFind(owner->data.pid, frame_table.page[frame]);
+
+  if (ghost >= 0) {
+    // The page was evicted too early; favour the list that lost it
+    if (node_flags[ghost] == CAR_B1) {
+      int delta = car_b2.size > car_b1.size ? car_b2.size / car_b1.size : 1;
+      car_p = car_p + delta < c ? car_p + delta : c;
+      listRemove(&car_b1, ghost);
+    } else {
+      int delta = car_b1.size > car_b2.size ? car_b1.size / car_b2.size : 1;
+      car_p = car_p - delta > 0 ? car_p - delta : 0;
+      listRemove(&car_b2, ghost);
+    }
+    ghostFree(ghost);
+    listPushTail(&car_t2, frame);
+    node_flags[frame] = CAR_T2 | NODE_FRESH;
+    return;
+  }
+
+  listPushTail(&car_t1, frame);
+  node_flags[frame] = CAR_T1 | NODE_FRESH;
+  if (car_t1.size + car_b1.size > c && car_b1.size > 0) {
+    carDropGhost(&car_b1);
+  } else if (car_t1.size + car_t2.size + car_b1.size + car_b2.size > 2 * c && car_b2.size > 0) {
+    carDropGhost(&car_b2);
+  }
+}
+
+static void carEvict(int frame) {
+  int from_t1 = (node_flags[frame] & CAR_LIST) == CAR_T1;
+  listRemove(from_t1 ? &car_t1 : &car_t2, frame);
+
+  if (ghosts.count == ghosts.capacity) {
+    carDropGhost(car_b1.size > 0 ? &car_b1 : &car_b2);
+  }
+  struct Node *owner = frame_table.owner[frame];
+  int ghost = ghostAlloc(owner->data.pid, frame_table.page[frame]);
+  listPushTail(from_t1 ? &car_b1 : &car_b2, ghost);
+  node_flags[ghost] = from_t1 ? CAR_B1 : CAR_B2;
+}
+
+/**
+ * Chooses a victim with the CAR algorithm: the head of T1 if T1 is above
+ * its target size, else the head of T2.  Referenced heads move to the
+ * tail of T2.  Frames whose owner is busy are walked past with a cursor
+ * per list and keep their place, so the lists stay in LRU order.
+ *
+ * @param self The process that needs a frame, whose lock is held.
+ * @return The victim frame, with its owner locked, or -1 if every
+ *         candidate frame is busy.
+ */
+static int carChooseVictim(struct Node *self) {
+  int cursor[2] = {-1, -1};   // Next frame of T1 and T2 to look at, -1 for the head
+  int skipped = 0;
+  while (skipped < frame_table.size) {
+    struct ring_list *list = car_t1.size >= (car_p > 1 ? car_p : 1) ? &car_t1 : &car_t2;
+    if (list->size == 0) list = list == &car_t1 ? &car_t2 : &car_t1;
+    if (list->size == 0) return -1;
+
+    int l = list == &car_t2;
+    int frame = cursor[l] >= 0 ? cursor[l] : list->head;
+    struct Node *owner = lockVictimOwner(frame, self);
+    if (owner == NULL) {
+      cursor[l] = ring_next[frame];
+      skipped++;
+      continue;
+    }
+    skipped = 0;
+
+    if (!frame_table.referenced[frame]) return frame;
+
+    cursor[l] = ring_next[frame] != frame ? ring_next[frame] : -1;
+    listRemove(list, frame);
+    if (node_flags[frame] & NODE_FRESH) {
+      listPushTail(list, frame);
+      node_flags[frame] &= ~NODE_FRESH;
+    } else {
+      listPushTail(&car_t2, frame);
+      node_flags[frame] = CAR_T2;
+    }
+    revokeAccess(frame, owner, self);
+  }
+
+  return -1;
+}
+
+/**
+ * Lists the frames at the head of the list CAR evicts from next, then
+ * those at the head of the other list.
+ *
+ * @param frames Set to the frames.
+ * @param max The maximum number of frames.
+ * @return The number of frames listed.
+ */
+static int carLookahead(int *frames, int max) {
+  struct ring_list *first = car_t1.size >= (car_p > 1 ? car_p : 1) ? &car_t1 : &car_t2;
+  struct ring_list *lists[2] = {first, first == &car_t1 ? &car_t2 : &car_t1};
+  int count = 0;
+  for (int l = 0; l < 2; l++) {
+    int node = lists[l]->head;
+    for (int i = 0; i < lists[l]->size && count < max; i++) {
+      frames[count++] = node;
+      node = ring_next[node];
+    }
+  }
+  return count;
+}
+
+static const struct replacement_policy car_policy = {
+  "arc", carInit, carInsert, NULL, carEvict, carChooseVictim, carLookahead
+};
+
+/*
+ * CLOCK-Pro: resident pages are hot or cold, and a page is in its test
+ * period from its first access until the hot hand passes it.  Hot, cold
+ * and ghost pages (evicted cold pages still in their test period) share
+ * one ring with three hands.  The cold hand evicts unreferenced cold pages
+ * and promotes cold pages referenced during their test period; the hot
+ * hand demotes unreferenced hot pages so at most `nframes - cp_cold_target`
+ * stay hot; the test hand ends test periods to bound the ghosts.  A fault
+ * on a ghost means the page's reuse distance fits in memory, so it comes
+ * back hot and the cold target grows; a test period ending unused shrinks
+ * it.  Pages touched once, as in a scan, stay cold and leave quickly.
+ */
+#define CP_HOT 1
+#define CP_TEST 2
+
+static int cp_hand_hot = -1, cp_hand_cold = -1, cp_hand_test = -1;
+static int cp_hot = 0;           /**< Resident hot pages */
+static int cp_cold = 0;          /**< Resident cold pages */
+static int cp_cold_target = 1;   /**< Adaptive target for resident cold pages */
+
+static void cpInit(int nframes) {
+  policyStateInit(nframes, nframes);
+  cp_hand_hot = cp_hand_cold = cp_hand_test = -1;
+  cp_hot = cp_cold = 0;
+  cp_cold_target = nframes / 100 > 1 ? nframes / 100 : 1;
+}
+
+/**
+ * Links a node at the head of the ring, which the hot hand reaches last.
+ *
+ * @param node The node.
+ */
+static void cpLink(int node) {
+  ringLinkBefore(cp_hand_hot, node);
+  if (cp_hand_hot < 0) cp_hand_hot = cp_hand_cold = cp_hand_test = node;
+}
+
+/**
+ * Unlinks a node from the ring, moving the hands that point at it forward.
+ *
+ * @param node The node.
+ */
+static void cpUnlink(int node) {
+  int next = ringUnlink(node);
+  if (cp_hand_hot == node) cp_hand_hot = next;
+  if (cp_hand_cold == node) cp_hand_cold = next;
+  if (cp_hand_test == node) cp_hand_test = next;
+}
+
+/**
+ * Ends the test period of a cold page the hot or test hand passes over.
+ * A ghost is forgotten.
+ *
+ * @param node The node.
+ */
+static void cpEndTest(int node) {
+  if (cp_cold_target > 1) cp_cold_target--;
+  if (node >= ghosts.base) {
+    cpUnlink(node);
+    ghostFree(node);
+  } else {
+    node_flags[node] &= ~CP_TEST;
+  }
+}
+
+/**
+ * Advances the test hand until a ghost is forgotten.  There must be ghosts.
+ */
+static void cpRunHandTest(void) {
+  int count = ghosts.count;
+  while (ghosts.count == count) {
+    int node = cp_hand_test;
+    cp_hand_test = ring_next[node];
+    if ((node_flags[node] & (CP_HOT | CP_TEST)) == CP_TEST) cpEndTest(node);
+  }
+}
+
+/**
+ * Advances the hot hand until a hot page is demoted to cold.
+ *
+ * @param self The process that needs a frame, whose lock is held.
+ * @return 1 if a page was demoted, 0 if the hot pages were all busy.
+ */
+static int cpRunHandHot(struct Node *self) {
+  int budget = 2 * (frame_table.size + ghosts.count);
+  while (budget-- > 0 && cp_hand_hot >= 0) {
+    int node = cp_hand_hot;
+    cp_hand_hot = ring_next[node];
+    if (!(node_flags[node] & CP_HOT)) {
+      if (node_flags[node] & CP_TEST) cpEndTest(node);
+      continue;
+    }
+
+    struct Node *owner = lockFrameOwner(node, self);
+    if (owner == NULL) continue;
+    if (frame_table.referenced[node]) {
+      revokeAccess(node, owner, self);
+      continue;
+    }
+    node_flags[node] = 0;
+    cp_hot--;
+    cp_cold++;
+    unlockFrameOwner(owner, self);
+    return 1;
+  }
+  return 0;
+}
+
+static void cpInsert(int frame) {
+  struct Node *owner = frame_table.owner[frame];
+  int ghost = ghostFind(owner->data.pid, frame_table.page[frame]);
+  if (ghost >= 0) {
+    // Reused within its test period: the page deserves to be hot
+    if (cp_cold_target < frame_table.size) cp_cold_target++;
+    cpUnlink(ghost);
+    ghostFree(ghost);
+    node_flags[frame] = CP_HOT | NODE_FRESH;
+    cp_hot++;
+  } else {
+    node_flags[frame] = CP_TEST | NODE_FRESH;
+    cp_cold++;
+  }
+  cpLink(frame);
+}
+
+static void cpEvict(int frame) {
+  uint8_t flags = node_flags[frame] & ~NODE_FRESH;
+  if (flags & CP_HOT) cp_hot--;
+  else cp_cold--;
+
+  if (flags != CP_TEST) {
+    cpUnlink(frame);
+    return;
+  }
+
+  // A cold page in its test period stays in the ring as a ghost
+  if (ghosts.count == ghosts.capacity) cpRunHandTest();
+  struct Node *owner = frame_table.owner[frame];
+  int ghost = ghostAlloc(owner->data.pid, frame_table.page[frame]);
+  node_flags[ghost] = CP_TEST;
+  ringLinkBefore(frame, ghost);
+  if (cp_hand_hot == frame) cp_hand_hot = ghost;
+  if (cp_hand_cold == frame) cp_hand_cold = ghost;
+  if (cp_hand_test == frame) cp_hand_test = ghost;
+  ringUnlink(frame);
+}
+
+/**
+ * Chooses a victim with the CLOCK-Pro algorithm.
+ *
+ * @param self The process that needs a frame, whose lock is held.
+ * @return The victim frame, with its owner locked, or -1 if every
+ *         candidate frame is busy.
+ */
+static int cpChooseVictim(struct Node *self) {
+  while (cp_hot > frame_table.size - cp_cold_target && cpRunHandHot(self));
+  if (cp_cold == 0 && !cpRunHandHot(self)) return -1;
+
+  int budget = 4 * (frame_table.size + ghosts.count);
+  while (budget-- > 0 && cp_hand_cold >= 0) {
+    int node = cp_hand_cold;
+    cp_hand_cold = ring_next[node];
+    if (node >= ghosts.base || (node_flags[node] & CP_HOT)) continue;
+
+    struct Node *owner = lockVictimOwner(node, self);
+    if (owner == NULL) continue;
+    if (!frame_table.referenced[node]) return node;
+
+    if (node_flags[node] & NODE_FRESH) {
+      node_flags[node] &= ~NODE_FRESH;
+    } else if (node_flags[node] & CP_TEST) {
+      node_flags[node] = CP_HOT;
+      cp_cold--;
+      cp_hot++;
+    } else {
+      node_flags[node] = CP_TEST;
+    }
+    cpUnlink(node);
+    cpLink(node);
+    revokeAccess(node, owner, self);
+    if (cp_hot > frame_table.size - cp_cold_target) cpRunHandHot(self);
+    if (cp_cold == 0 && !cpRunHandHot(self)) return -1;
+  }
+
+  return -1;
+}
+
+/**
+ * Lists the resident cold pages the cold hand reaches next.
+ *
+ * @param frames Set to the frames.
+ * @param max The maximum number of frames.
+ * @return The number of frames listed.
+ */
+static int cpLookahead(int *frames, int max) {
+  int count = 0, node = cp_hand_cold;
+  for (int i = 0; i < frame_table.size + ghosts.count && node >= 0 && count < max; i++) {
+    if (node < ghosts.base && !(node_flags[node] & CP_HOT)) frames[count++] = node;
+    node = ring_next[node];
+  }
+  return count;
+}
+
+static const struct replacement_policy clockpro_policy = {
+  "clockpro", cpInit, cpInsert, NULL, cpEvict, cpChooseVictim, cpLookahead
+};
+
+static const struct replacement_policy *policies[] = {
+  &clock_policy, &wsclock_policy, &clockpro_policy, &car_policy, NULL
+};
+
+static const struct replacement_policy *policy = &clock_policy;
+
+/****************************************************************************
+ * Frame Reclaim
+ ***************************************************************************/
+
+/*
+ * Frames are reclaimed directly, by a fault that finds no free frame, or
+ * in the background by the reclaim thread.  When `reclaim_high` is set,
+ * the thread wakes up once fewer than `reclaim_low` frames are free and
+ * evicts pages until `reclaim_high` frames are free, so most faults find a
+ * free frame right away.
+ */
+static unsigned long reclaim_low = 0;    /**< Free frames below which the reclaim thread wakes up */
+static unsigned long reclaim_high = 0;   /**< Free frames the reclaim thread restores, 0 to disable it */
+static int reclaim_running = 0;          /**< Whether the reclaim thread runs, under `frame_lock` */
+static pthread_t reclaim_thread;
+static pthread_cond_t reclaim_wakeup = PTHREAD_COND_INITIALIZER;   /**< Signaled with `frame_lock` held */
+
+/*
+ * By default pager_extend gives every page its own block.  With
+ * `overcommit` set, pages extended may total `overcommit` percent of the
+ * blocks and a page only gets a block the first time it is written back.
+ * When no block is left, victims that would need one are passed over; a
+ * fault that finds no other victim fails and, after a short delay, the
+ * process faults again, so it makes progress once memory is freed.  When
+ * `SWAP_FAILURE_RETRIES` faults of a process fail in a row, pager_fault
+ * reports the failure and the MMU ends the process, which frees its frames
+ * and blocks for the others.
+ */
+static unsigned long overcommit = 0;         /**< Percent of the blocks pages may total, 0 to reserve blocks up front */
+static unsigned long committed_pages = 0;    /**< Pages extended, under `block_lock` */
+static int blocks_short = 0;                 /**< A writeback found no free block, under `block_lock` */
+#define SWAP_FAILURE_BACKOFF_NS 1000000       /**< Delay before a fault that failed returns */
+#define SWAP_FAILURE_RETRIES 16               /**< Faults in a row that may fail before one is reported */
+/** Victims passed over before giving up: a sweep may revoke the pages that
+ *  can be evicted and only offer them on the next one. */
+#define REFUSALS_MAX (3 * frame_table.size)
+
+/**
+ * Returns a block to the free blocks after telling the MMU to drop the
+ * copies it keeps of the block's page.  Must be called with `block_lock`
+ * held, so the block is not handed out again before the MMU forgets it.
+ *
+ * @param block The block.
+ */
+static void blockPut(int block) {
+  mmu_disk_discard(block);
+  allocatorPut(&block_allocator, block);
+}
+
+/**
+ * Wakes the reclaim thread up.  Must be called with `frame_lock` held.
+ */
+static void wakeReclaim(void) {
+  if (reclaim_running) pthread_cond_signal(&reclaim_wakeup);
+}
+
+/**
+ * Gives a page that is about to be written back a block, if it has none
+ * yet.  Only pages extended with overcommit lack one.  The owner's lock
+ * must be held.
+ *
+ * @param owner The process.
+ * @param page The page table index.
+ * @return 0 if the page can be written back, -1 if no block is free.
+ */
+static int pageReserveBlock(struct Node *owner, int page) {
+  if (owner->data.blocks[page] >= 0 || !(owner->data.page_table[page] & PTE_DIRTY)) return 0;
+  pthread_mutex_lock(&block_lock);
+  int block = allocatorGet(&block_allocator);
+  if (block < 0) blocks_short = 1;
+  pthread_mutex_unlock(&block_lock);
+  if (block < 0) return -1;
+  owner->data.blocks[page] = block;
+  return 0;
+}
+
+/**
+ * Gives up the block of a page that is being written while blocks are
+ * short.  The block's contents are stale once the page is dirty, and
+ * keeping it would tie up both a frame and a block for one page; the page
+ * gets a block again when it is next written back.
+ *
+ * @param owner The process that owns the page; its lock must be held.
+ * @param page The page table index.
+ */
+static void pageReleaseBlock(struct Node *owner, int page) {
+  int block = owner->data.blocks[page];
+  if (!overcommit || block < 0) return;
+  pthread_mutex_lock(&block_lock);
+  if (blocks_short) {
+    blockPut(block);
+    owner->data.blocks[page] = -1;
+    blocks_short = 0;
+  }
+  pthread_mutex_unlock(&block_lock);
+}
+
+/**
+ * Makes a page nonresident, leaving the write back of a dirty page to the
+ * caller.  The unmap is only posted; the caller must mmu_flush before it
+ * writes the page or reuses its frame.  The frame must already be
+ * unmapped from the frame table; the owner's lock must be held.
+ *
+ * @param owner The process that owned the page.
+ * @param page The page table index of the page being evicted.
+ * @return Nonzero if the page must be written to its block.
+ */
+static int evictPage(struct Node *owner, int page) {
+  pte_t *pte = &owner->data.page_table[page];
+  if(!(*pte & PTE_UNMAPPED)) {
+    mmu_nonresident_async(owner->data.pid, (void *) pageAddress(page));
+  }
+  if(*pte & PTE_READAHEAD) {
+    // The stream did not get this far; read less ahead next time
+    owner->data.ra_window = owner->data.ra_window / 2;
+    STAT_INC(owner, readahead_waste);
+  }
+  int dirty = (*pte & PTE_DIRTY) != 0;
+  if(!dirty && (*pte & PTE_HAS_DATA)) {
+    STAT_INC(owner, clean_evictions);
+  }
+  *pte &= ~(PTE_PRESENT | PTE_DIRTY | PTE_UNMAPPED | PTE_READAHEAD);
+  STAT_INC(owner, evictions);
+  return dirty;
+}
+
+/**
+ * Evicts a page from its frame, writing it to its disk block if it was
+ * written since it was last read from or written to the block; a clean
+ * page's block is still current.  The frame must already be unmapped from
+ * the frame table; the owner's lock must be held.
+ *
+ * @param frame The frame number.
+ * @param owner The process that owned the page.
+ * @param page The page table index of the page being evicted.
+ */
+static void evictFrame(int frame, struct Node *owner, int page) {
+  int dirty = evictPage(owner, page);
+  mmu_flush();
+  if(dirty) {
+    mmu_disk_write(frame, owner->data.blocks[page]);
+    STAT_INC(owner, writebacks);
+  }
+}
+
+/*
+ * With `swap_cluster` set, evicting a page also evicts the cold pages
+ * next to it in its owner's address space, up to `swap_cluster` pages in
+ * all, and frees their frames.  Each run of consecutive dirty pages goes
+ * to consecutive blocks, moved to a free run of blocks if theirs are
+ * scattered, in one mmu_disk_writev; readahead then brings the run back
+ * with one mmu_disk_readv.  A neighbour is cold if it was not referenced
+ * since the policy last looked at it.
+ */
+static unsigned long swap_cluster = 0;   /**< Pages evicted together, 0 or 1 for one at a time */
+#define SWAP_CLUSTER_MAX 64
+
+/**
+ * Tells whether page `page` of `owner` can be evicted along with a
+ * neighbour, giving it a block if it needs one.  Called with `frame_lock`
+ * and the owner's lock held.
+ *
+ * @param owner The process.
+ * @param page The page table index, possibly out of range.
+ * @return Nonzero if the page joins the cluster.
+ */
+static int clusterCandidate(struct Node *owner, long page) {
+  if (page < 0 || (size_t) page >= owner->data.npages) return 0;
+  pte_t pte = owner->data.page_table[page];
+  if ((pte & (PTE_PRESENT | PTE_SHARED | PTE_READAHEAD)) != PTE_PRESENT) return 0;
+  if (frame_table.referenced[pteFrame(pte)]) return 0;
+  return pageReserveBlock(owner, page) == 0;
+}
+
+/**
+ * Gathers the cold neighbours of the victim `page` into a cluster of
+ * consecutive pages and unmaps their frames from the frame table.  Called
+ * with `frame_lock` and the owner's lock held, the victim's frame already
+ * unmapped.
+ *
+ * @param owner The process that owns the victim.
+ * @param page The victim's page table index.
+ * @param frame The victim's frame.
+ * @param pages Set to the pages of the cluster, in address order.
+ * @param frames Set to their frames.
+ * @return The number of pages in the cluster, at least 1.
+ */
+static int gatherCluster(struct Node *owner, int page, int frame, int *pages, int *frames) {
+  int max = swap_cluster < SWAP_CLUSTER_MAX ? (int) swap_cluster : SWAP_CLUSTER_MAX;
+  int lo = page, hi = page, forward = 1, backward = 1;
+  while (hi - lo + 1 < max && (forward || backward)) {
+    if (forward && (forward = clusterCandidate(owner, hi + 1))) {
+      hi++;
+    } else if (backward && (backward = clusterCandidate(owner, lo - 1))) {
+      lo--;
+    }
+  }
+
+  for (int i = lo; i <= hi; i++) {
+    pages[i - lo] = i;
+    frames[i - lo] = i == page ? frame : (int) pteFrame(owner->data.page_table[i]);
+    if (i != page) frameTableUnmap(frames[i - lo]);
+  }
+  return hi - lo + 1;
+}
+
+/**
+ * Writes a run of consecutive dirty pages of `owner` to consecutive
+ * blocks, moving them to a free run if their blocks are scattered.
+ * Pages whose blocks cannot be made consecutive are written in pieces.
+ * The owner's lock must be held.
+ *
+ * @param owner The process.
+ * @param pages The pages, consecutive.
+ * @param frames Their frames.
+ * @param n The number of pages.
+ */
+static void writeRun(struct Node *owner, const int *pages, const int *frames, int n) {
+  int32_t *blocks = owner->data.blocks;
+  int scattered = 0;
+  for (int i = 1; i < n; i++) {
+    if (blocks[pages[i]] != blocks[pages[0]] + i) scattered = 1;
+  }
+  if (scattered) {
+    pthread_mutex_lock(&block_lock);
+    int run = allocatorGetRun(&block_allocator, n);
+    if (run >= 0) {
+      // The old blocks hold stale copies of dirty pages
+      for (int i = 0; i < n; i++) {
+        blockPut(blocks[pages[i]]);
+        blocks[pages[i]] = run + i;
+      }
+    }
+    pthread_mutex_unlock(&block_lock);
+  }
+
+  for (int i = 0; i < n; ) {
+    int j = i + 1;
+    while (j < n && blocks[pages[j]] == blocks[pages[i]] + (j - i)) j++;
+    if (j - i == 1) {
+      mmu_disk_write(frames[i], blocks[pages[i]]);
+    } else {
+      mmu_disk_writev(frames + i, j - i, blocks[pages[i]]);
+    }
+    owner->data.stats.writebacks += j - i;
+    i = j;
+  }
+}
+
+/**
+ * Evicts the victim in `frame` along with its cluster and frees the
+ * frames of the other pages of the cluster.  Called with `frame_lock` and
+ * the owner's lock held and the frame unmapped from the frame table;
+ * releases `frame_lock`, so the MMU is called without it.
+ *
+ * @param frame The victim's frame.
+ * @param owner The process that owns the victim.
+ * @param page The victim's page table index.
+ */
+static void evictVictim(int frame, struct Node *owner, int page) {
+  int pages[SWAP_CLUSTER_MAX], frames[SWAP_CLUSTER_MAX];
+  int n = swap_cluster > 1 ? gatherCluster(owner, page, frame, pages, frames) : 1;
+  pthread_mutex_unlock(&frame_lock);
+  if (n == 1) {
+    evictFrame(frame, owner, page);
+    return;
+  }
+
+  int dirty[SWAP_CLUSTER_MAX];
+  for (int i = 0; i < n; i++) dirty[i] = evictPage(owner, pages[i]);
+  mmu_flush();
+  for (int i = 0; i < n; ) {
+    if (!dirty[i]) {
+      i++;
+      continue;
+    }
+    int j = i;
+    while (j < n && dirty[j]) j++;
+    writeRun(owner, pages + i, frames + i, j - i);
+    i = j;
+  }
+  owner->data.stats.clustered += n - 1;
+
+  pthread_mutex_lock(&frame_lock);
+  for (int i = 0; i < n; i++) {
+    if (frames[i] != frame) allocatorPut(&frame_allocator, frames[i]);
+  }
+  pthread_mutex_unlock(&frame_lock);
+}
+
+/**
+ * Takes a frame for a page of `self` that is about to become resident:
+ * the lowest-numbered free frame if there is one, or else the frame the
+ * replacement policy evicts.  The frame is returned unmapped, so no other
+ * thread touches it until the caller maps it.
+ *
+ * @param self The process that needs the frame, whose lock is held.
+ * @return The frame number, or -1 if every victim would need a block and
+ *         none is free.
+ */
+static int takeFrame(struct Node *self) {
+  int refused = 0;
+  pthread_mutex_lock(&frame_lock);
+  vtime++;
+  workingSetFault(self);
+  while (1) {
+    if (frame_allocator.nfree > 0) {
+      int frame = allocatorGet(&frame_allocator);
+      if ((unsigned long) frame_allocator.nfree < reclaim_low) wakeReclaim();
+      quotas_relaxed = 0;
+      pthread_mutex_unlock(&frame_lock);
+      mmu_flush();
+      return frame;
+    }
+
+    wakeReclaim();
+    int frame = policy->choose_victim(self);
+    if (frame >= 0) {
+      struct Node *owner = frame_table.owner[frame];
+      int page = frame_table.page[frame];
+      if (pageReserveBlock(owner, page) < 0) {
+        // Out of blocks: look for a victim that can be dropped instead
+        unlockFrameOwner(owner, self);
+        if (++refused < REFUSALS_MAX) continue;
+        quotas_relaxed = 0;
+        pthread_mutex_unlock(&frame_lock);
+        mmu_flush();
+        STAT_INC(self, swap_failures);
+        return -1;
+      }
+      frameTableUnmap(frame);
+      quotas_relaxed = 0;
+      if (owner != self) STAT_INC(owner, stolen);
+
+      // Unmap the victim from its process without holding frame_lock
+      evictVictim(frame, owner, page);
+      unlockFrameOwner(owner, self);
+      return frame;
+    }
+
+    if (QUOTAS_ENABLED() && !quotas_relaxed) {
+      // Every frame may be protected by a quota rather than busy
+      quotas_relaxed = 1;
+      continue;
+    }
+
+    // Every frame belongs to a process that is busy; let them progress
+    pthread_mutex_unlock(&frame_lock);
+    mmu_flush();
+    sched_yield();
+    pthread_mutex_lock(&frame_lock);
+  }
+}
+
+/**
+ * Waits for the access revocations the calling thread posted while it
+ * looked for victims.  Their acknowledgements would hold up the next
+ * requests of the processes, so the reclaim thread flushes them before
+ * it sleeps.  Called with `frame_lock` held, which is dropped meanwhile.
+ */
+static void flushRevocations(void) {
+  pthread_mutex_unlock(&frame_lock);
+  mmu_flush();
+  pthread_mutex_lock(&frame_lock);
+}
+
+/**
+ * Body of the reclaim thread.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *reclaimMain(void *arg) {
+  pthread_mutex_lock(&frame_lock);
+  while (reclaim_running) {
+    if ((unsigned long) frame_allocator.nfree >= reclaim_low) {
+      flushRevocations();
+      pthread_cond_wait(&reclaim_wakeup, &frame_lock);
+      continue;
+    }
+
+    int refused = 0;
+    while (reclaim_running && (unsigned long) frame_allocator.nfree < reclaim_high) {
+      int frame = policy->choose_victim(NULL);
+      if (frame < 0 && QUOTAS_ENABLED()) {
+        // The quotas may protect every frame; wait for the next fault
+        flushRevocations();
+        pthread_cond_wait(&reclaim_wakeup, &frame_lock);
+        continue;
+      }
+      if (frame < 0) {
+        pthread_mutex_unlock(&frame_lock);
+        mmu_flush();
+        sched_yield();
+        pthread_mutex_lock(&frame_lock);
+        continue;
+      }
+
+      struct Node *owner = frame_table.owner[frame];
+      int page = frame_table.page[frame];
+      if (pageReserveBlock(owner, page) < 0) {
+        unlockFrameOwner(owner, NULL);
+        if (++refused >= REFUSALS_MAX) {
+          // Out of blocks; wait for the next fault rather than spin
+          flushRevocations();
+          pthread_cond_wait(&reclaim_wakeup, &frame_lock);
+          refused = 0;
+        }
+        continue;
+      }
+      frameTableUnmap(frame);
+      evictVictim(frame, owner, page);
+      STAT_INC(owner, background_evictions);
+      unlockFrameOwner(owner, NULL);
+      pthread_mutex_lock(&frame_lock);
+      allocatorPut(&frame_allocator, frame);
+    }
+  }
+  pthread_mutex_unlock(&frame_lock);
+  return NULL;
+}
+
+/**
+ * Starts the reclaim thread if watermarks are set, clamping them to the
+ * number of frames.
+ */
+static void startReclaim(void) {
+  if (reclaim_high == 0) return;
+  if (reclaim_high > (unsigned long) frame_allocator.size) reclaim_high = frame_allocator.size;
+  if (reclaim_low > reclaim_high) reclaim_low = reclaim_high;
+  reclaim_running = 1;
+  if (pthread_create(&reclaim_thread, NULL, reclaimMain, NULL) != 0) {
+    reclaim_running = 0;
+    logd(LOG_WARN, "%s: could not start the reclaim thread\n", __func__);
+    return;
+  }
+  logd(LOG_INFO, "%s: free frame watermarks %lu/%lu\n", __func__, reclaim_low, reclaim_high);
+}
+
+/**
+ * Stops the reclaim thread if it runs.
+ */
+static void stopReclaim(void) {
+  pthread_mutex_lock(&frame_lock);
+  int running = reclaim_running;
+  reclaim_running = 0;
+  pthread_cond_signal(&reclaim_wakeup);
+  pthread_mutex_unlock(&frame_lock);
+  if (running) pthread_join(reclaim_thread, NULL);
+}
+
+
+/****************************************************************************
+ * Page Cleaner
+ ***************************************************************************/
+
+/*
+ * The cleaner thread writes back dirty pages the replacement policy will
+ * examine next, so that evicting them later is a cheap unmap instead of a
+ * disk write on the fault path.  Every `cleaner_interval` microseconds it
+ * looks at the next `cleaner_lookahead` frames and writes at most
+ * `cleaner_batch` unreferenced dirty pages among them.  It only runs while
+ * fewer than `cleaner_lookahead` frames are free, since evictions only
+ * happen when memory is full.
+ */
+static int cleaner_enabled = 0;               /**< Whether pager_init starts the cleaner */
+static unsigned long cleaner_lookahead = 0;   /**< Frames examined per pass, 0 for `nframes / 4` */
+static unsigned long cleaner_batch = 8;       /**< Pages written per pass at most */
+static unsigned long cleaner_interval = 1000; /**< Microseconds between passes */
+static int cleaner_running = 0;               /**< Cleared to stop the cleaner */
+static pthread_t cleaner_thread;
+
+/**
+ * Writes a dirty page to its block and marks it clean.  The page is write
+ * protected first, so a later write faults and marks it dirty again.
+ * Called with `frame_lock` and the owner's lock held, the latter taken by
+ * lockFrameOwner; `frame_lock` is dropped during the MMU calls and the
+ * owner is released.
+ *
+ * @param frame The frame number.
+ * @param owner The owner of the page, locked.
+ */
+static void cleanFrame(int frame, struct Node *owner) {
+  int page = frame_table.page[frame];
+  pte_t *pte = &owner->data.page_table[page];
+
+  pthread_mutex_unlock(&frame_lock);
+  if (pteProt(*pte) & PROT_WRITE) {
+    mmu_chprot(owner->data.pid, (void *) pageAddress(page), PROT_READ);
+    pteSetProt(pte, PROT_READ);
+  }
+  mmu_disk_write(frame, owner->data.blocks[page]);
+  *pte &= ~PTE_DIRTY;
+  STAT_INC(owner, cleaned);
+  unlockFrameOwner(owner, NULL);
+  pthread_mutex_lock(&frame_lock);
+}
+
+/**
+ * Body of the cleaner thread.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *cleanerMain(void *arg) {
+  int max = cleaner_lookahead ? (int) cleaner_lookahead : frame_table.size / 4 + 1;
+  int *frames = malloc(max * sizeof(int));
+  if (frames == NULL) return NULL;
+
+  while (__atomic_load_n(&cleaner_running, __ATOMIC_RELAXED)) {
+    struct timespec delay = {cleaner_interval / 1000000, (cleaner_interval % 1000000) * 1000};
+    nanosleep(&delay, NULL);
+
+    pthread_mutex_lock(&frame_lock);
+    if (frame_allocator.nfree < max && policy->lookahead) {
+      int count = policy->lookahead(frames, max);
+      unsigned long written = 0;
+      for (int i = 0; i < count && written < cleaner_batch; i++) {
+        struct Node *owner = lockFrameOwner(frames[i], NULL);
+        if (owner == NULL) continue;
+        if (frame_table.referenced[frames[i]] || !frameNeedsWriteback(frames[i]) ||
+            pageReserveBlock(owner, frame_table.page[frames[i]]) < 0) {
+          unlockFrameOwner(owner, NULL);
+          continue;
+        }
+        cleanFrame(frames[i], owner);
+        written++;
+      }
+    }
+    pthread_mutex_unlock(&frame_lock);
+  }
+
+  free(frames);
+  return NULL;
+}
+
+/**
+ * Starts the cleaner thread if it is enabled.
+ */
+static void startCleaner(void) {
+  if (!cleaner_enabled) return;
+  cleaner_running = 1;
+  if (pthread_create(&cleaner_thread, NULL, cleanerMain, NULL) != 0) {
+    cleaner_running = 0;
+    logd(LOG_WARN, "%s: could not start the cleaner\n", __func__);
+  }
+}
+
+/**
+ * Stops the cleaner thread if it runs.
+ */
+static void stopCleaner(void) {
+  if (!cleaner_running) return;
+  __atomic_store_n(&cleaner_running, 0, __ATOMIC_RELAXED);
+  pthread_join(cleaner_thread, NULL);
+}
+
+
+/****************************************************************************
+ * Readahead
+ ***************************************************************************/
+
+/*
+ * When a process faults on swapped-out pages at a constant stride, the
+ * pager reads the next `ra_window` pages of the stream from disk into free
+ * frames, without evicting anything.  Those frames are charged to the
+ * process like the frames its faults take, so readahead stops at
+ * `quota_max` and the pages count in its working set.  The window grows by one page each
+ * time a page read ahead is used, up to `readahead_max`, and halves each
+ * time one is evicted unused.  By default pages read ahead are not mapped,
+ * so no MMU round trip is spent on them until they are used; with
+ * `readahead_map` they are mapped read-only right away, which saves the
+ * fault on their first read.  Such a read goes unseen, so a page read
+ * ahead also counts as used once the stream moves past it.
+ */
+static unsigned long readahead_max = 0;   /**< Largest readahead window, 0 to disable readahead */
+static int readahead_map = 0;             /**< Whether pages read ahead are mapped right away */
+#define READAHEAD_BATCH 32                  /**< Pages read ahead with one disk operation at most */
+
+/**
+ * Takes the lowest-numbered free frame for readahead, unless that would
+ * leave fewer frames free than the reclaim thread keeps or take the
+ * process past `quota_max`.  The frame counts as taken by the process, in
+ * virtual time and in its working set, as if it had faulted.  The
+ * process's lock must be held.
+ *
+ * @param process_node The process reading ahead.
+ * @param pending Frames it took for readahead that are not mapped yet.
+ * @return The frame number, or -1 if no frame can be spared.
+ */
+static int takeSpareFrame(struct Node *process_node, int pending) {
+  pthread_mutex_lock(&frame_lock);
+  int frame = -1;
+  int over_quota = quota_max && process_node->data.frames_allocated + pending >= quota_max;
+  if (!over_quota && frame_allocator.nfree > 0 && (unsigned long) frame_allocator.nfree > reclaim_low) {
+    frame = allocatorGet(&frame_allocator);
+    vtime++;
+    workingSetFault(process_node);
+  }
+  pthread_mutex_unlock(&frame_lock);
+  return frame;
+}
+
+/**
+ * Records that a page read ahead was used and widens the window.  The
+ * process's lock must be held.
+ *
+ * @param process_node The process.
+ * @param pte The page's entry.
+ */
+static void readAheadUsed(struct Node *process_node, pte_t *pte) {
+  *pte &= ~PTE_READAHEAD;
+  if ((unsigned long) process_node->data.ra_window < readahead_max) process_node->data.ra_window++;
+  STAT_INC(process_node, readahead_hits);
+}
+
+/**
+ * Reads pages ahead into the frames taken for them, with one disk
+ * operation since their blocks are consecutive, and maps them.  The
+ * process's lock must be held.
+ *
+ * @param process_node The process.
+ * @param pages The pages read ahead.
+ * @param frames Their frames.
+ * @param count The number of pages.
+ */
+static void readAheadRead(struct Node *process_node, const int *pages, const int *frames, int count) {
+  struct process_data *data = &process_node->data;
+  if (count == 0) return;
+  if (count == 1) {
+    mmu_disk_read(data->blocks[pages[0]], frames[0]);
+  } else {
+    mmu_disk_readv(data->blocks[pages[0]], frames, count);
+  }
+
+  for (int i = 0; i < count; i++) {
+    pte_t *pte = &data->page_table[pages[i]];
+    pthread_mutex_lock(&frame_lock);
+    frameTableMap(frames[i], process_node, pages[i]);
+    frame_table.referenced[frames[i]] = readahead_map;
+    pthread_mutex_unlock(&frame_lock);
+
+    if (readahead_map) {
+      mmu_resident_async(data->pid, (void *) pageAddress(pages[i]), frames[i], PROT_READ);
+      pteSetProt(pte, PROT_READ);
+      *pte |= PTE_PRESENT | PTE_READAHEAD;
+    } else {
+      pteSetProt(pte, PROT_NONE);
+      *pte |= PTE_PRESENT | PTE_READAHEAD | PTE_UNMAPPED;
+    }
+    STAT_INC(process_node, readaheads);
+    STAT_INC(process_node, pageins);
+  }
+  mmu_flush();
+}
+
+/**
+ * Records a fault that read page `idx` from disk or hit a page read ahead
+ * and, if it continues a strided stream, reads the next pages of the
+ * stream ahead.  The process's lock must be held.
+ *
+ * @param process_node The process.
+ * @param idx The page faulted on.
+ */
+static void readAhead(struct Node *process_node, int idx) {
+  struct process_data *data = &process_node->data;
+  int stride = idx - data->ra_last;
+  int streaming = stride != 0 && stride == data->ra_stride;
+  if (!streaming && data->ra_stride != 0) {
+    // A stream that read mapped pages ahead without faulting skips them
+    long behind = (long) idx - data->ra_stride;
+    if (behind >= 0 && (size_t) behind < data->npages && (data->page_table[behind] & PTE_READAHEAD)) {
+      stride = data->ra_stride;
+      streaming = 1;
+    }
+  }
+  data->ra_last = idx;
+  data->ra_stride = stride;
+  if (!streaming) return;
+  if (data->ra_window == 0) data->ra_window = 1;
+
+  // Pages of the stream behind this fault were read without faulting
+  for (long page = idx - stride; page >= 0 && (size_t) page < data->npages; page -= stride) {
+    pte_t *pte = &data->page_table[page];
+    if (!(*pte & PTE_READAHEAD)) break;
+    readAheadUsed(process_node, pte);
+  }
+
+  // The `count` frames of the batch are not in frames_allocated until it is read
+  int pages[READAHEAD_BATCH], frames[READAHEAD_BATCH], count = 0;
+  for (int k = 1; k <= data->ra_window; k++) {
+    long page = idx + (long) k * stride;
+    if (page < 0 || (size_t) page >= data->npages) break;
+    pte_t *pte = &data->page_table[page];
+    if ((*pte & (PTE_PRESENT | PTE_SHARED)) || !(*pte & PTE_HAS_DATA)) continue;
+
+    int frame = takeSpareFrame(process_node, count);
+    if (frame < 0) break;
+    if (count == READAHEAD_BATCH || (count > 0 && data->blocks[page] != data->blocks[pages[count - 1]] + 1)) {
+      readAheadRead(process_node, pages, frames, count);
+      count = 0;
+    }
+    pages[count] = page;
+    frames[count++] = frame;
+  }
+  readAheadRead(process_node, pages, frames, count);
+}
+
+/**
+ * Handles the first fault on a page that was read ahead: maps it if it
+ * was not mapped yet and widens the readahead window.  The process's lock
+ * must be held.
+ *
+ * @param process_node The process.
+ * @param idx The page faulted on.
+ * @return 1 if the page was mapped, 0 if it already was and the fault
+ *         must be handled as usual.
+ */
+static int readAheadHit(struct Node *process_node, int idx) {
+  pte_t *pte = &process_node->data.page_table[idx];
+  int unmapped = (*pte & PTE_UNMAPPED) != 0;
+  if (unmapped) {
+    mmu_resident(process_node->data.pid, (void *) pageAddress(idx), pteFrame(*pte), PROT_READ);
+    pteSetProt(pte, PROT_READ);
+  }
+  *pte &= ~PTE_UNMAPPED;
+  readAheadUsed(process_node, pte);
+  readAhead(process_node, idx);
+  return unmapped;
+}
+
+
+/****************************************************************************
+ * Zero Frame
+ ***************************************************************************/
+
+/*
+ * Pages that were never written read as zero-filled.  With
+ * `zero_frame_enabled`, the highest frame is reserved and filled once, and
+ * the first fault on such a page maps it read-only instead of taking and
+ * filling a frame of its own.  The page holds no frame, so it is never
+ * evicted; it gets one only when it is first written.
+ */
+static int zero_frame_enabled = 0;   /**< Whether unwritten pages share the zero frame */
+static int zero_frame = -1;          /**< The reserved zero frame, or -1 */
+
+/**
+ * Maps page `idx` read-only to the zero frame.  The process's lock must be
+ * held.
+ *
+ * @param process_node The process.
+ * @param idx The page faulted on.
+ */
+static void mapZeroFrame(struct Node *process_node, int idx) {
+  pte_t *pte = &process_node->data.page_table[idx];
+  mmu_resident(process_node->data.pid, (void *) pageAddress(idx), zero_frame, PROT_READ);
+  pteSetFrame(pte, zero_frame);
+  pteSetProt(pte, PROT_READ);
+  *pte |= PTE_VALID | PTE_ZERO;
+  STAT_INC(process_node, zero_maps);
+}
+
+/**
+ * Gives page `idx`, mapped to the zero frame, a zero-filled frame of its
+ * own and maps it read-write.  The fault can only be a write, as the page
+ * was readable.  The process's lock must be held.
+ *
+ * @param process_node The process.
+ * @param idx The page faulted on.
+ * @return 0, or -1 if no frame could be taken.
+ */
+static int unshareZeroFrame(struct Node *process_node, int idx) {
+  pte_t *pte = &process_node->data.page_table[idx];
+  int frame = takeFrame(process_node);
+  if (frame < 0) return -1;
+  mmu_zero_fill(frame);
+
+  pthread_mutex_lock(&frame_lock);
+  frameTableMap(frame, process_node, idx);
+  pthread_mutex_unlock(&frame_lock);
+
+  mmu_resident(process_node->data.pid, (void *) pageAddress(idx), frame, PROT_READ | PROT_WRITE);
+  pteSetProt(pte, PROT_READ | PROT_WRITE);
+  *pte &= ~PTE_ZERO;
+  *pte |= PTE_PRESENT | PTE_HAS_DATA | PTE_DIRTY;
+  STAT_INC(process_node, pageins);
+  return 0;
+}
+
+
+/****************************************************************************
+ * Page Deduplication
+ ***************************************************************************/
+
+/*
+ * With `dedup_enabled`, a background scanner hashes the contents of the
+ * pages in memory and merges pages with identical contents into a single
+ * frame mapped read-only into all of them.  A write to a shared page
+ * faults and gives the page a copy of its own: the MMU copies the shared
+ * frame into a new one with mmu_frame_copy, which adds an
+ * "mmu_frame_copy" line to the trace, and the page is marked dirty so its
+ * block is rewritten when it is evicted.  Shared frames are not owned by
+ * any process, so the replacement policy never evicts them; to keep
+ * enough frames evictable, at most half the frames can be shared.
+ *
+ * Candidates are found through a hash table, rebuilt each time the scanner
+ * wraps around the frames, that maps contents hashes to frames.  A frame
+ * can be added twice in a pass, as a shared frame and again after it was
+ * freed and reused, so the table has four slots per frame.  Entries
+ * may be stale and every match is confirmed by comparing the pages, with
+ * both owners locked so neither page can change.  A page mapped writable
+ * is only merged once its hash did not change for a whole pass, and is
+ * write-protected first.
  */
-struct least_frequently_pointer {
-  struct Node* initial_process; /**< Pointer to the initial process */
-  int initial_page; /**< Initial page number */
-};
+static int dedup_enabled = 0;               /**< Whether pager_init starts the scanner */
+static unsigned long dedup_batch = 64;      /**< Frames scanned per pass */
+static unsigned long dedup_interval = 1000; /**< Microseconds between passes */
+static int dedup_running = 0;               /**< Cleared to stop the scanner */
+static pthread_t dedup_thread;
 
 /**
- * @struct page_table_cell
- * @brief Represents a cell in the page table.
- * 
- * This struct contains information about a page in the page table, including its validity,
- * presence in memory, protection level, recent access status, data availability, page number,
- * and corresponding frame number.
- */
-struct page_table_cell {
-  short valid;                /**< Flag indicating if the page is valid */
-  short present;              /**< Flag indicating if the page is present in memory */
-  short prot;                 /**< Protection level of the page */
-  short recently_accessed;    /**< Flag indicating if the page was recently accessed */
-  short has_data;             /**< Flag indicating if the page has data */
-  __intptr_t page;            /**< Page number */
-  int frame;                  /**< Frame number */
+ * @struct sharer
+ * @brief A page mapped to a shared frame.
+ */
+struct sharer {
+  struct Node *owner;   /**< Process the page belongs to */
+  int32_t page;         /**< Index of the page in its page table */
 };
 
 /**
- * @struct process_data
- * @brief Represents the data associated with a process.
- * 
- * This struct contains information such as the process ID, the number of frames allocated,
- * the queue the process belongs to, and a pointer to the page table.
+ * @struct shared_frame
+ * @brief The pages mapped to a frame, when it is shared.
  */
-struct process_data {
-  pid_t pid; /**< The process ID */
-  size_t frames_allocated; /**< The number of frames allocated */
-  short queue; /**< The queue the process belongs to */
-  struct page_table_cell *page_table; /**< Pointer to the page table */
+struct shared_frame {
+  struct sharer *sharers;   /**< The pages, in no particular order */
+  int nsharers;             /**< Number of pages, 0 if the frame is not shared */
+  int capacity;             /**< Number of entries allocated in `sharers` */
 };
 
 /**
- * @struct Node
- * Represents a node in a linked list.
- * Contains a process_data struct and a pointer to the next node.
+ * @struct dedup_entry
+ * @brief A frame whose contents hashed to `hash` when it was scanned.
  */
-struct Node {
-  struct process_data data;
-  struct Node *next;
+struct dedup_entry {
+  uint64_t hash;
+  int frame;   /**< The frame, or -1 for an empty slot */
 };
 
+static struct shared_frame *shared_frames = NULL;   /**< Indexed by frame, protected by `frame_lock` */
+static int nshared = 0;                /**< Frames shared, protected by `frame_lock` */
+static unsigned long nsharing = 0;     /**< Pages mapped to shared frames, protected by `frame_lock` */
+static uint64_t *frame_hash = NULL;    /**< Hash of each frame when last scanned; scanner only */
+static struct dedup_entry *dedup_table = NULL;   /**< Open addressing; scanner only */
+static int dedup_table_size = 0;       /**< A power of two, at least four times the frames */
+static int dedup_hand = 0;             /**< Next frame the scanner looks at */
+
 /**
- * Creates a new node for a linked list with the given process ID.
- * The node contains a page table and other data related to the process.
+ * Hashes the contents of a frame, eight bytes at a time in four
+ * independent lanes so the multiplications overlap.  This is plain
+ * scalar code, not SIMD: baseline x86-64 has no 64-bit vector multiply,
+ * and a hash only has to pick candidates, since every match is confirmed
+ * with framesEqual.
  *
- * @param pid The process ID of the new node.
- * @return A pointer to the newly created node.
+ * @param frame The frame number.
+ * @return The hash.
  */
-struct Node* createNode(pid_t pid) {
-  // Allocate memory for the new node
-  struct Node* newNode = (struct Node*)malloc(sizeof(struct Node));
-  if (newNode == NULL) {
-    printf("Memory allocation failed\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // Initialize the page table for the process
-  struct page_table_cell *page_table = malloc(NUM_PAGES * sizeof(struct page_table_cell));
-  for (int i = 0; i < NUM_PAGES; i++) {
-    page_table[i].valid = 0;
-    page_table[i].present = 0;
-    page_table[i].recently_accessed = 0;
-    page_table[i].has_data = 0;
-    page_table[i].page = -1;
-    page_table[i].frame = -1;
+static uint64_t frameHash(int frame) {
+  const char *data = pmem + (size_t) frame * page_size;
+  uint64_t lanes[4] = {1, 2, 3, 4};
+  for (size_t i = 0; i + 32 <= page_size; i += 32) {
+    for (int l = 0; l < 4; l++) {
+      uint64_t word;
+      memcpy(&word, data + i + 8 * l, sizeof(word));
+      lanes[l] = (lanes[l] ^ word) * 0x9e3779b97f4a7c15ull;
+    }
   }
+  return lanes[0] ^ (lanes[1] >> 7) ^ (lanes[2] << 13) ^ (lanes[3] >> 29);
+}
 
-  // Set the data of the new node
-  newNode->data.page_table = page_table;
-  newNode->data.pid = pid;
-  newNode->data.frames_allocated = 0;
-  newNode->data.queue = 0;
-  newNode->next = NULL;
-
-  return newNode;
+/**
+ * Compares the contents of two frames.
+ *
+ * @return Whether they are identical.
+ */
+static int framesEqual(int a, int b) {
+  return memcmp(pmem + (size_t) a * page_size, pmem + (size_t) b * page_size, page_size) == 0;
 }
 
 /**
- * Inserts a new node with the given process ID at the end of the linked list.
+ * Adds a page to the pages mapped to a frame.  `frame_lock` must be held.
  *
- * @param head Pointer to the head of the linked list.
- * @param pid Process ID to be inserted.
+ * @return 0 on success, -1 if out of memory.
  */
-void insert(struct Node** head, pid_t pid) {
-  struct Node* newNode = createNode(pid);
+static int sharerAdd(int frame, struct Node *owner, int page) {
+  struct shared_frame *shared = &shared_frames[frame];
+  if (shared->nsharers == shared->capacity) {
+    int capacity = shared->capacity ? shared->capacity * 2 : 4;
+    struct sharer *sharers = realloc(shared->sharers, capacity * sizeof(struct sharer));
+    if (sharers == NULL) return -1;
+    shared->sharers = sharers;
+    shared->capacity = capacity;
+  }
+  shared->sharers[shared->nsharers].owner = owner;
+  shared->sharers[shared->nsharers].page = page;
+  shared->nsharers++;
+  nsharing++;
+  return 0;
+}
 
-  if(*head == NULL) {
-    *head = newNode;
-  } else {
-    struct Node* current = *head;
-    while (current->next != NULL) {
-      current = current->next;
+/**
+ * Removes a page from the pages mapped to a shared frame and frees the
+ * frame when no page is left.  `frame_lock` must be held.
+ */
+static void sharerRemove(int frame, struct Node *owner, int page) {
+  struct shared_frame *shared = &shared_frames[frame];
+  for (int i = 0; i < shared->nsharers; i++) {
+    if (shared->sharers[i].owner == owner && shared->sharers[i].page == page) {
+      shared->sharers[i] = shared->sharers[--shared->nsharers];
+      nsharing--;
+      break;
     }
-    current->next = newNode;
+  }
+  if (shared->nsharers == 0) {
+    nshared--;
+    allocatorPut(&frame_allocator, frame);
   }
 }
 
 /**
- * Removes a process node from a linked list based on the given process ID.
+ * Gives a page mapped to a shared frame a copy of its own and maps it
+ * read-write, or takes over the frame if no other page shares it.  Called
+ * on a write fault, with the process's lock held.  Without a frame for
+ * the copy the fault fails and the page stays shared.
  *
- * @param head Pointer to the head of the linked list.
- * @param pid The process ID to be removed.
- * @return Pointer to the removed node, or NULL if the node was not found.
+ * @param process_node The process.
+ * @param idx The page faulted on.
+ * @return 0, or -1 if no frame could be taken.
  */
-struct Node* removeProcess(struct Node** head, pid_t pid) {
-	struct Node* current = *head;
-	struct Node* previous = NULL;
+static int breakSharing(struct Node *process_node, int idx) {
+  pte_t *pte = &process_node->data.page_table[idx];
+  int shared = pteFrame(*pte);
+  int frame = shared;
+
+  pthread_mutex_lock(&frame_lock);
+  int last = shared_frames[shared].nsharers == 1;
+  if (last) {
+    shared_frames[shared].nsharers = 0;
+    nshared--;
+    nsharing--;
+    frameTableMap(shared, process_node, idx);
+  }
+  pthread_mutex_unlock(&frame_lock);
 
-	while (current != NULL) {
-		if (current->data.pid == pid) {
-			if (previous == NULL) {
-				*head = current->next;
-			} else {
-				previous->next = current->next;
-			}
-			free(current);
-			return current;
-		}
-		previous = current;
-		current = current->next;
-	}
+  if (!last) {
+    frame = takeFrame(process_node);
+    if (frame < 0) return -1;
+    mmu_frame_copy(shared, frame);
+    STAT_INC(process_node, pageins);
+
+    pthread_mutex_lock(&frame_lock);
+    frameTableMap(frame, process_node, idx);
+    pthread_mutex_unlock(&frame_lock);
+  }
 
-	return NULL;
+  if (last) {
+    mmu_chprot(process_node->data.pid, (void *) pageAddress(idx), PROT_READ | PROT_WRITE);
+  } else {
+    mmu_resident(process_node->data.pid, (void *) pageAddress(idx), frame, PROT_READ | PROT_WRITE);
+    // The process no longer maps the shared frame, which may now be freed
+    pthread_mutex_lock(&frame_lock);
+    sharerRemove(shared, process_node, idx);
+    pthread_mutex_unlock(&frame_lock);
+  }
+  pteSetProt(pte, PROT_READ | PROT_WRITE);
+  *pte &= ~PTE_SHARED;
+  *pte |= PTE_PRESENT | PTE_DIRTY;
+  STAT_INC(process_node, cow_breaks);
+  return 0;
 }
 
 /**
- * Searches for a node with a specific process ID (pid) in a linked list.
- * 
- * @param head The head of the linked list.
- * @param pid The process ID to search for.
- * @return A pointer to the node with the specified pid, or NULL if not found.
+ * Unmaps the pages of a process that is being destroyed from the frames
+ * they share.  The process's lock and `frame_lock` must be held.
+ *
+ * @param process_node The process.
  */
-struct Node* searchByPid(struct Node* head, pid_t pid) {
-  struct Node* current = head;
-  
-  while (current != NULL) {
-    if (current->data.pid == pid) {
-      return current;
-    }
-    current = current->next;
-  } 
+static void dropSharedPages(struct Node *process_node) {
+  for (size_t i = 0; i < process_node->data.npages; i++) {
+    pte_t pte = process_node->data.page_table[i];
+    if (pte & PTE_SHARED) sharerRemove(pteFrame(pte), process_node, i);
+  }
+}
 
-  return NULL;
+/**
+ * Tells whether a page can be merged: it occupies its frame, holds data
+ * that is not going to change, and is mapped.
+ */
+static int pageMergeable(pte_t pte) {
+  return (pte & PTE_PRESENT) && (pte & PTE_HAS_DATA) &&
+         !(pte & (PTE_UNMAPPED | PTE_READAHEAD)) && !(pteProt(pte) & PROT_WRITE);
 }
 
 /**
- * Retrieves the next node in a linked list.
- * If the current node has a next node, it returns the next node.
- * Otherwise, it returns the head of the linked list.
+ * Maps page `idx`, in frame `frame`, to the shared frame `shared` and
+ * frees its frame.  Called with `frame_lock` and the owner's lock held;
+ * `frame_lock` is dropped during the MMU call.
  *
- * @param process The current node in the linked list.
- * @param head The head of the linked list.
- * @return The next node in the linked list.
+ * @return 0 on success, -1 if out of memory.
  */
-struct Node* getNextNode(struct Node* process, struct Node* head) {
-  if (process->next != NULL) return process->next;
-  else return head;
+static int mergePage(int shared, int frame, struct Node *owner, int idx) {
+  pte_t *pte = &owner->data.page_table[idx];
+  if (sharerAdd(shared, owner, idx) < 0) return -1;
+  frameTableUnmap(frame);
+  pthread_mutex_unlock(&frame_lock);
+
+  mmu_resident(owner->data.pid, (void *) pageAddress(idx), shared, PROT_READ);
+  pteSetFrame(pte, shared);
+  pteSetProt(pte, PROT_READ);
+  *pte &= ~PTE_PRESENT;
+  *pte |= PTE_SHARED;
+  STAT_INC(owner, merges);
+
+  pthread_mutex_lock(&frame_lock);
+  allocatorPut(&frame_allocator, frame);
+  return 0;
 }
 
 /**
- * Searches for a page in the page table of a process with the given PID,
- * based on the virtual address.
+ * Turns a frame into a shared frame, mapped to the page that occupies it.
+ * The page's mapping does not change.  Called with `frame_lock` and the
+ * owner's lock held.
  *
- * @param head The head of the linked list containing the process nodes.
- * @param pid The process ID of the target process.
- * @param virtual_addr The virtual address to search for.
- * @return A pointer to the page table cell if found, NULL otherwise.
+ * @return 0 on success, -1 if out of memory.
  */
-struct page_table_cell* searchByPage(struct Node* head, pid_t pid, __intptr_t virtual_addr) {
-  struct Node* pid_proccess = searchByPid(head, pid);
-  
-  if(pid_proccess == NULL) return NULL;
-  
-  for (int i = 0; i < NUM_PAGES; i++) {
-    struct page_table_cell* page_cell = &pid_proccess->data.page_table[i];
-    short address_is_at_page_cell = page_cell->page <= virtual_addr && virtual_addr < page_cell->page + sysconf(_SC_PAGESIZE);
+static int shareFrame(int frame, struct Node *owner, int idx) {
+  if (sharerAdd(frame, owner, idx) < 0) return -1;
+  pte_t *pte = &owner->data.page_table[idx];
+  frameTableUnmap(frame);
+  *pte &= ~PTE_PRESENT;
+  *pte |= PTE_SHARED;
+  nshared++;
+  return 0;
+}
 
-    if (address_is_at_page_cell) {
-      return page_cell;
-    }
+/**
+ * Gives a shared frame that only one page is left mapped to back to that
+ * page, so it can be evicted again.  Called with `frame_lock` held.
+ */
+static void unshareLastPage(int frame) {
+  struct sharer *sharer = &shared_frames[frame].sharers[0];
+  struct Node *owner = sharer->owner;
+  if (pthread_mutex_trylock(&owner->data.lock) != 0) return;
+  pte_t *pte = &owner->data.page_table[sharer->page];
+  shared_frames[frame].nsharers = 0;
+  nshared--;
+  nsharing--;
+  frameTableMap(frame, owner, sharer->page);
+  *pte &= ~PTE_SHARED;
+  *pte |= PTE_PRESENT;
+  pthread_mutex_unlock(&owner->data.lock);
+}
 
-    if(page_cell->page == -1) break;
-  } 
+/**
+ * Looks for a frame with the same contents as `frame` among the frames
+ * scanned before with the same hash, and merges the two pages.  Called
+ * with `frame_lock` and the owner's lock held; `frame_lock` may be
+ * dropped during MMU calls.
+ *
+ * @return Whether the page was merged.
+ */
+static int dedupFrame(int frame, struct Node *owner, int idx, uint64_t hash) {
+  int mask = dedup_table_size - 1;
+  for (int slot = hash & mask; dedup_table[slot].frame >= 0; slot = (slot + 1) & mask) {
+    int other = dedup_table[slot].frame;
+    if (dedup_table[slot].hash != hash || other == frame) continue;
+
+    if (shared_frames[other].nsharers > 0) {
+      if (!framesEqual(frame, other)) continue;
+      return mergePage(other, frame, owner, idx) == 0;
+    }
 
-  return NULL;
+    if (nshared >= frame_table.size / 2) continue;
+    struct Node *other_owner = lockFrameOwner(other, owner);
+    if (other_owner == NULL) continue;
+    int other_idx = frame_table.page[other];
+    int shared = pageMergeable(other_owner->data.page_table[other_idx]) &&
+                 framesEqual(frame, other) && shareFrame(other, other_owner, other_idx) == 0;
+    unlockFrameOwner(other_owner, owner);
+    // Should the merge fail, the scanner gives the frame back to its page
+    if (shared) return mergePage(other, frame, owner, idx) == 0;
+  }
+  return 0;
 }
 
 /**
- * Searches for the least frequently used frame index in a linked list of processes.
- * Uses the known second chance algorithm to find the least frequently used frame.
- * 
- * @param head The head of the linked list of processes.
- * @param pointer A pointer to a struct that keeps track of the initial process and page index.
- * @return A pointer to the struct containing the updated initial process and page index.
+ * Empties the hash table, then adds the shared frames back.  Called by the
+ * scanner with `frame_lock` held when it wraps around.
  */
-struct least_frequently_pointer* searchLeastFrequentlyUsedFrameIdx(struct Node* head, struct least_frequently_pointer* pointer) {
-  struct Node* process = head;
-  if(pointer->initial_process != NULL) process = pointer->initial_process;
+static void dedupTableReset(void) {
+  for (int slot = 0; slot < dedup_table_size; slot++) dedup_table[slot].frame = -1;
+  int mask = dedup_table_size - 1;
+  for (int frame = 0; frame < frame_table.size; frame++) {
+    if (shared_frames[frame].nsharers == 0) continue;
+    int slot = frame_hash[frame] & mask;
+    while (dedup_table[slot].frame >= 0) slot = (slot + 1) & mask;
+    dedup_table[slot].hash = frame_hash[frame];
+    dedup_table[slot].frame = frame;
+  }
+}
 
-  size_t i = pointer->initial_page;
-  while (1) {
-    while(process->data.frames_allocated == 0) {
-      process = getNextNode(process, head);
+/**
+ * Scans a frame: merges its page with an identical one if there is one,
+ * and otherwise records it as a candidate.  Called with no lock held.
+ *
+ * @param frame The frame number.
+ */
+static void scanFrame(int frame) {
+  pthread_mutex_lock(&frame_lock);
+  if (shared_frames[frame].nsharers == 1) unshareLastPage(frame);
+  struct Node *owner = lockFrameOwner(frame, NULL);
+  if (owner == NULL) {
+    pthread_mutex_unlock(&frame_lock);
+    return;
+  }
+  int idx = frame_table.page[frame];
+  pte_t *pte = &owner->data.page_table[idx];
+  pthread_mutex_unlock(&frame_lock);
+
+  // The owner's lock keeps the page in its frame while it is hashed
+  uint64_t hash = frameHash(frame);
+  if ((*pte & PTE_PRESENT) && (*pte & PTE_HAS_DATA) && (pteProt(*pte) & PROT_WRITE)) {
+    if (hash != frame_hash[frame]) {
+      frame_hash[frame] = hash;
+      unlockFrameOwner(owner, NULL);
+      return;
     }
-    i = (i + 1) % process->data.frames_allocated;
-
-    if(i == pointer->initial_page) {
-      process = getNextNode(process, head);
-      if(process == pointer->initial_process) {
-        pointer->initial_page = (pointer->initial_page + 1) % process->data.frames_allocated;
-        return pointer;
-      };
+    // Unchanged for a whole pass: write-protect it and hash it again
+    mmu_chprot(owner->data.pid, (void *) pageAddress(idx), PROT_READ);
+    pteSetProt(pte, PROT_READ);
+    hash = frameHash(frame);
+  }
+  frame_hash[frame] = hash;
+  if (!pageMergeable(*pte)) {
+    unlockFrameOwner(owner, NULL);
+    return;
+  }
 
-      i = -1;
-      pointer->initial_page = -1;
-      continue;
-    }
+  pthread_mutex_lock(&frame_lock);
+  if (!dedupFrame(frame, owner, idx, hash)) {
+    int mask = dedup_table_size - 1;
+    int slot = hash & mask;
+    while (dedup_table[slot].frame >= 0) slot = (slot + 1) & mask;
+    dedup_table[slot].hash = hash;
+    dedup_table[slot].frame = frame;
+  }
+  pthread_mutex_unlock(&frame_lock);
+  unlockFrameOwner(owner, NULL);
+}
 
-    if(process->data.page_table[i].present == 1) {
-      if (process->data.page_table[i].recently_accessed == 0) {
-        pointer->initial_process = process;
-        pointer->initial_page = i;
-        return pointer;
+/**
+ * Body of the deduplication scanner thread.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *dedupMain(void *arg) {
+  while (__atomic_load_n(&dedup_running, __ATOMIC_RELAXED)) {
+    struct timespec delay = {dedup_interval / 1000000, (dedup_interval % 1000000) * 1000};
+    nanosleep(&delay, NULL);
+
+    for (unsigned long n = 0; n < dedup_batch; n++) {
+      if (dedup_hand == 0) {
+        pthread_mutex_lock(&frame_lock);
+        dedupTableReset();
+        pthread_mutex_unlock(&frame_lock);
       }
-
-      mmu_chprot(process->data.pid, (void *) process->data.page_table[i].page, PROT_NONE);
-      process->data.page_table[i].prot = PROT_NONE;
-      process->data.page_table[i].recently_accessed = 0;
+      scanFrame(dedup_hand);
+      dedup_hand = (dedup_hand + 1) % frame_table.size;
     }
-
-    if(pointer->initial_page == -1) pointer->initial_page = 0;
   }
+  return NULL;
 }
 
 /**
- * Prints the data of each node in a linked list.
- *
- * @param head The head of the linked list.
+ * Allocates the shared frame table for `nframes` frames, dropping any
+ * left from a previous pager_init.
  */
-void printList(struct Node* head) {
-  struct Node* current = head;
+static void dedupInit(int nframes) {
+  if (shared_frames != NULL) {
+    for (int frame = 0; frame < frame_table.size; frame++) free(shared_frames[frame].sharers);
+  }
+  free(shared_frames);
+  free(frame_hash);
+  free(dedup_table);
+  dedup_table_size = 1;
+  while (dedup_table_size < 4 * nframes) dedup_table_size *= 2;
+  shared_frames = calloc(nframes, sizeof(struct shared_frame));
+  frame_hash = calloc(nframes, sizeof(uint64_t));
+  dedup_table = calloc(dedup_table_size, sizeof(struct dedup_entry));
+  if (shared_frames == NULL || frame_hash == NULL || dedup_table == NULL) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  nshared = 0;
+  nsharing = 0;
+  dedup_hand = 0;
+}
 
-  while (current != NULL) {
-    printf("PID: %d\n", current->data.pid);
-    current = current->next;
+/**
+ * Starts the deduplication scanner if it is enabled.
+ */
+static void startDedup(void) {
+  if (!dedup_enabled) return;
+  dedup_running = 1;
+  if (pthread_create(&dedup_thread, NULL, dedupMain, NULL) != 0) {
+    dedup_running = 0;
+    logd(LOG_WARN, "%s: could not start the deduplication scanner\n", __func__);
   }
 }
 
+/**
+ * Stops the deduplication scanner if it runs.
+ */
+static void stopDedup(void) {
+  if (!dedup_running) return;
+  __atomic_store_n(&dedup_running, 0, __ATOMIC_RELAXED);
+  pthread_join(dedup_thread, NULL);
+}
+
 
 /****************************************************************************
  * Pager Implementation
  ***************************************************************************/
 
-/**
- * @struct frame
- * Represents a frame in the memory pager.
- * Each frame contains the process ID (pid) of the process currently occupying the frame.
- */
-
 /**
  * @file pager.c
  * @brief Implementation of a memory pager.
@@ -300,23 +2812,190 @@ void printList(struct Node* head) {
  * the allocation and deallocation of memory frames and blocks. It also
  * includes data structures and variables used for tracking the state of
  * the memory pager.
+ *
+ * The MMU calls the pager from one thread per client, so faults of
+ * different processes run in parallel.  Locks are always taken in this
+ * order: `processes.lock` (only around table lookups and updates), the
+ * faulting process's own lock, `frame_lock`, then other processes' locks,
+ * which are only try-locked; `block_lock` is a leaf.  A process's pager
+ * functions are never called concurrently by the MMU, so a node found in
+ * the table stays valid until its own pager_destroy.
+ */
+
+struct process_table processes = {NULL, 0, 0, NULL, NULL, PTHREAD_RWLOCK_INITIALIZER};   /**< Registry of the processes */
+
+/**
+ * Finds the node of a process in the process table.
+ *
+ * @param pid The process ID.
+ * @return The node, or NULL if the process is unknown.
+ */
+static struct Node *lookupProcess(pid_t pid) {
+  pthread_rwlock_rdlock(&processes.lock);
+  struct Node *process_node = searchByPid(&processes, pid);
+  pthread_rwlock_unlock(&processes.lock);
+  return process_node;
+}
+
+/**
+ * Parses a nonnegative integer option value.
+ *
+ * @param value The option value.
+ * @param result Set to the parsed value.
+ * @return 0 on success, -1 if `value` is not a nonnegative integer.
+ */
+static int parseCount(const char *value, unsigned long *result) {
+  char *end;
+  if (*value < '0' || *value > '9') return -1;
+  *result = strtoul(value, &end, 10);
+  return *end == '\0' ? 0 : -1;
+}
+
+/**
+ * Selects the replacement policy by name.
+ *
+ * @param value The policy name.
+ * @return 0 on success, -1 if no policy has that name.
+ */
+static int setPolicy(const char *value) {
+  for (int i = 0; policies[i] != NULL; i++) {
+    if (strcmp(policies[i]->name, value) == 0) {
+      policy = policies[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int setWsclockTau(const char *value) {
+  return parseCount(value, &wsclock_tau);
+}
+
+static int setCleaner(const char *value) {
+  unsigned long enabled;
+  if (parseCount(value, &enabled) < 0 || enabled > 1) return -1;
+  cleaner_enabled = enabled;
+  return 0;
+}
+
+static int setCleanerLookahead(const char *value) {
+  return parseCount(value, &cleaner_lookahead);
+}
+
+static int setCleanerBatch(const char *value) {
+  return parseCount(value, &cleaner_batch);
+}
+
+static int setCleanerInterval(const char *value) {
+  return parseCount(value, &cleaner_interval);
+}
+
+static int setReclaimLow(const char *value) {
+  return parseCount(value, &reclaim_low);
+}
+
+static int setReclaimHigh(const char *value) {
+  return parseCount(value, &reclaim_high);
+}
+
+static int setReadahead(const char *value) {
+  return parseCount(value, &readahead_max);
+}
+
+static int setReadaheadMap(const char *value) {
+  unsigned long enabled;
+  if (parseCount(value, &enabled) < 0 || enabled > 1) return -1;
+  readahead_map = enabled;
+  return 0;
+}
+
+static int setZeroFrame(const char *value) {
+  unsigned long enabled;
+  if (parseCount(value, &enabled) < 0 || enabled > 1) return -1;
+  zero_frame_enabled = enabled;
+  return 0;
+}
+
+static int setOvercommit(const char *value) {
+  return parseCount(value, &overcommit);
+}
+
+static int setSwapCluster(const char *value) {
+  return parseCount(value, &swap_cluster);
+}
+
+static int setQuotaMin(const char *value) {
+  return parseCount(value, &quota_min);
+}
+
+static int setQuotaMax(const char *value) {
+  return parseCount(value, &quota_max);
+}
+
+static int setWsWindow(const char *value) {
+  return parseCount(value, &ws_window);
+}
+
+static int setDedup(const char *value) {
+  unsigned long enabled;
+  if (parseCount(value, &enabled) < 0 || enabled > 1) return -1;
+  dedup_enabled = enabled;
+  return 0;
+}
+
+static int setDedupBatch(const char *value) {
+  return parseCount(value, &dedup_batch);
+}
+
+static int setDedupInterval(const char *value) {
+  return parseCount(value, &dedup_interval);
+}
+
+/**
+ * @struct pager_option
+ * @brief An option accepted by pager_setopt.
  */
+struct pager_option {
+  const char *name;                    /**< Option name */
+  int (*set)(const char *value);       /**< Parses and stores the value */
+};
 
-typedef struct frame {
-  pid_t pid;  /**< The process ID of the process occupying the frame. */
-} frame_t;
+static const struct pager_option options[] = {
+  {"policy", setPolicy},
+  {"wsclock_tau", setWsclockTau},
+  {"cleaner", setCleaner},
+  {"cleaner_lookahead", setCleanerLookahead},
+  {"cleaner_batch", setCleanerBatch},
+  {"cleaner_interval", setCleanerInterval},
+  {"reclaim_low", setReclaimLow},
+  {"reclaim_high", setReclaimHigh},
+  {"readahead", setReadahead},
+  {"readahead_map", setReadaheadMap},
+  {"zero_frame", setZeroFrame},
+  {"overcommit", setOvercommit},
+  {"swap_cluster", setSwapCluster},
+  {"quota_min", setQuotaMin},
+  {"quota_max", setQuotaMax},
+  {"ws_window", setWsWindow},
+  {"dedup", setDedup},
+  {"dedup_batch", setDedupBatch},
+  {"dedup_interval", setDedupInterval},
+  {NULL, NULL}
+};
 
-int *frames_vector;                 /**< Array of memory frames */
-int frames_vector_size;             /**< Size of the frames_vector array */
-int free_frames;                    /**< Number of free memory frames */
-int *blocks_vector;                 /**< Array of memory blocks */
-int blocks_vector_size;             /**< Size of the blocks_vector array */
-int free_blocks;                    /**< Number of free memory blocks */
-struct least_frequently_pointer default_least_frequently_pointer = {NULL, -1};   /**< Default least frequently used frame pointer */
-struct least_frequently_pointer* last_freed_frame_addr = &default_least_frequently_pointer;   /**< Address of the last freed frame */
-pid_t mutex_turn = -1;              /**< Mutex turn identifier */
-static pthread_mutex_t locker;      /**< Mutex locker */
-struct Node* head_process = NULL;   /**< Head of the process linked list */
+/**
+ * Sets a pager option.  Must be called before pager_init.
+ *
+ * @param name The option name.
+ * @param value The option value.
+ * @return 0 on success, -1 if the option is unknown or its value invalid.
+ */
+int pager_setopt(const char *name, const char *value) {
+  for (const struct pager_option *option = options; option->name != NULL; option++) {
+    if (strcmp(option->name, name) == 0) return option->set(value);
+  }
+  return -1;
+}
 
 /**
  * Initializes the pager with the specified number of frames and blocks.
@@ -325,26 +3004,46 @@ struct Node* head_process = NULL;   /**< Head of the process linked list */
  * @param nblocks The number of blocks.
  */
 void pager_init(int nframes, int nblocks) {
-  pthread_mutex_init(&locker, NULL);
-  pthread_mutex_trylock(&locker);
-  if (nframes <= 0 || nblocks <= 0) {
+  if (nframes <= 0 || nblocks <= 0 || nframes > PTE_FRAME_MASK + 1) {
     printf("Pager initialization failed\n");
 		exit(EXIT_FAILURE);
   }
 
-  frames_vector = malloc(nframes * sizeof(int));
-  blocks_vector = malloc(nblocks * sizeof(int));
-  free_frames = nframes;
-  free_blocks = nblocks;
-  frames_vector_size = nframes;
-  blocks_vector_size = nblocks;
-  for (int i = 0; i < nframes; i++) {
-    frames_vector[i] = -1;
-  }
-  for (int i = 0; i < nblocks; i++) {
-    blocks_vector[i] = -1;
-  }
-  pthread_mutex_unlock(&locker);
+  initGeometry();
+  stopCleaner();
+  stopReclaim();
+  stopDedup();
+
+  // The zero frame is the highest, so the others are taken in the same order
+  zero_frame = -1;
+  if (zero_frame_enabled && nframes > 1) zero_frame = nframes - 1;
+  allocatorFree(&frame_allocator);
+  allocatorInit(&frame_allocator, zero_frame < 0 ? nframes : nframes - 1);
+  dedupInit(nframes);
+  frameTableInit(nframes);
+  if (zero_frame >= 0) mmu_zero_fill(zero_frame);
+  if (policy->init) policy->init(nframes);
+  memset(&retired_stats, 0, sizeof(retired_stats));
+  vtime = 0;
+  quotas_relaxed = 0;
+  logd(LOG_INFO, "%s: %d frames, %d blocks, %s replacement\n", __func__,
+       nframes, nblocks, policy->name);
+  allocatorFree(&block_allocator);
+  allocatorInit(&block_allocator, nblocks);
+  committed_pages = 0;
+  blocks_short = 0;
+  startCleaner();
+  startReclaim();
+  startDedup();
+}
+
+/**
+ * Stops the pager's background threads.
+ */
+void pager_shutdown(void) {
+  stopCleaner();
+  stopReclaim();
+  stopDedup();
 }
 
 /**
@@ -353,135 +3052,162 @@ void pager_init(int nframes, int nblocks) {
  * @param pid The process ID.
  */
 void pager_create(pid_t pid) {
-  pthread_mutex_trylock(&locker);
-  insert(&head_process, pid);
-  pthread_mutex_unlock(&locker);
+  pthread_rwlock_wrlock(&processes.lock);
+  insert(&processes, pid);
+  // The new process is the newest; its working set starts empty now
+  pthread_mutex_lock(&frame_lock);
+  processes.tail->data.created = processes.tail->data.ws_fault = vtime;
+  pthread_mutex_unlock(&frame_lock);
+  pthread_rwlock_unlock(&processes.lock);
 }
 
 /**
  * Extends the memory for a given process.
+ * The new page gets its own disk block, the lowest-numbered free one,
+ * which holds the page's contents whenever it is swapped out; with
+ * overcommit it gets one only when it is first written back.
  *
  * @param pid The process ID.
  * @return A pointer to the allocated memory, or NULL if no free blocks are available.
  */
 void *pager_extend(pid_t pid) {
-  pthread_mutex_trylock(&locker);
-  
-  if (free_blocks == 0) {
-    pthread_mutex_unlock(&locker);
-    return NULL;
-  }
-
-  for (int i=0; i < blocks_vector_size; i++) {
-    if(blocks_vector[i] == -1) {
-      blocks_vector[i] = pid;
-      free_blocks--;
-      break;
-    }
-  }
+  return pager_extend_n(pid, 1);
+}
 
-  struct Node *process_node = searchByPid(head_process, pid);
+/**
+ * Extends the memory for a given process by `n` contiguous pages, taking
+ * the process's lock and the block lock once for the whole range.  Either
+ * every page is allocated or none is: blocks taken before the allocator
+ * runs dry are put back.
+ *
+ * @param pid The process ID.
+ * @param n The number of pages.
+ * @return A pointer to the first page, or NULL if `n` pages do not fit.
+ */
+void *pager_extend_n(pid_t pid, size_t n) {
+  struct Node *process_node = lookupProcess(pid);
   if (process_node == NULL) {
-    pthread_mutex_unlock(&locker);
     exit(EXIT_FAILURE);
   }
+  if (n == 0) return NULL;
 
-  for (int i=0; i < NUM_PAGES; i++) {
-    if (process_node->data.page_table[i].page == -1) {
-      __intptr_t virtual_address = UVM_BASEADDR + (intptr_t) (i * sysconf(_SC_PAGESIZE));
-      process_node->data.page_table[i].page = virtual_address;
-      pthread_mutex_unlock(&locker);
-      return (void*) virtual_address;
+  pthread_mutex_lock(&process_node->data.lock);
+  size_t first = process_node->data.npages;
+  if (n > num_pages - first) {
+    pthread_mutex_unlock(&process_node->data.lock);
+    return NULL;
+  }
+  // Pages are handed out in order, so the new ones follow the last
+  while (first + n > process_node->data.capacity) {
+    growPageTable(process_node);
+  }
+  int32_t *blocks = &process_node->data.blocks[first];
+
+  pthread_mutex_lock(&block_lock);
+  size_t got = 0;
+  if (overcommit) {
+    unsigned long limit = (unsigned long) block_allocator.size * overcommit / 100;
+    if (committed_pages + n <= limit) {
+      committed_pages += n;
+      for (; got < n; got++) blocks[got] = -1;
+    }
+  } else {
+    for (; got < n; got++) {
+      blocks[got] = allocatorGet(&block_allocator);
+      if (blocks[got] < 0) break;
     }
+    if (got < n) {
+      while (got > 0) blockPut(blocks[--got]);
+    }
+  }
+  pthread_mutex_unlock(&block_lock);
+  if (got < n) {
+    pthread_mutex_unlock(&process_node->data.lock);
+    return NULL;
   }
 
-  pthread_mutex_unlock(&locker);
-  return NULL;
+  memset(&process_node->data.page_table[first], 0, n * sizeof(pte_t));
+  process_node->data.npages = first + n;
+
+  pthread_mutex_unlock(&process_node->data.lock);
+  return (void*) pageAddress(first);
 }
 
 /**
  * @brief Destroys a pager for a given process ID.
  * 
  * This function releases the resources associated with the pager for the specified process ID.
- * It frees the frames and blocks occupied by the process, removes the process from the linked list,
- * and destroys the mutex lock if there are no more processes in the system.
+ * It removes the process from the process table, waits for any eviction in progress on its
+ * pages, and frees the frames and blocks occupied by the process.
  * 
  * @param pid The process ID of the pager to be destroyed.
  */
 void pager_destroy(pid_t pid) {
-  pthread_mutex_trylock(&locker);
-  struct Node *process_node = searchByPid(head_process, pid);
-  
-  if(process_node == NULL) {
-    pthread_mutex_unlock(&locker);
-    return;
-  };
-
-  for (int i = 0; i < frames_vector_size; i++) {  
-    if(frames_vector[i] == pid) {
-      frames_vector[i] = -1;
-      free_frames++;
+  pthread_rwlock_wrlock(&processes.lock);
+  struct Node *process_node = removeProcess(&processes, pid);
+  pthread_rwlock_unlock(&processes.lock);
+
+  if(process_node == NULL) return;
+
+  // Only the process's own pages can hold frames and blocks
+  pthread_mutex_lock(&process_node->data.lock);
+  pthread_mutex_lock(&frame_lock);
+  logWorkingSet(process_node, __func__);
+  for (size_t i = 0; i < process_node->data.npages; i++) {
+    pte_t pte = process_node->data.page_table[i];
+    if(pte & PTE_PRESENT) {
+      frameTableUnmap(pteFrame(pte));
+      allocatorPut(&frame_allocator, pteFrame(pte));
     }
   }
+  dropSharedPages(process_node);
+  statsAdd(&retired_stats, &process_node->data.stats);
+  pthread_mutex_unlock(&frame_lock);
 
-	for (int i = 0; i < blocks_vector_size; i++) {
-		if(blocks_vector[i] == pid) {
-			blocks_vector[i] = -1;
-			free_blocks++;
-		}
-	}
-
-	removeProcess(&head_process, pid);
-  pthread_mutex_unlock(&locker);
-  if(head_process == NULL) {
-    free(frames_vector);
-    free(blocks_vector);
-    pthread_mutex_destroy(&locker);
+  pthread_mutex_lock(&block_lock);
+  for (size_t i = 0; i < process_node->data.npages; i++) {
+    if (process_node->data.blocks[i] >= 0) blockPut(process_node->data.blocks[i]);
   }
+  if (overcommit) committed_pages -= process_node->data.npages;
+  pthread_mutex_unlock(&block_lock);
+  pthread_mutex_unlock(&process_node->data.lock);
+
+  freeNode(process_node);
 }
 
 /**
- * Handles swapping of pages between memory and disk.
+ * Makes a page resident: takes a frame (evicting another page if memory is
+ * full), fills it from the page's disk block or with zeroes, and maps it
+ * read-only so the first write faults again and marks it dirty.  The
+ * process's lock must be held.
  * 
  * @param process_node Pointer to the process node in the page table.
  * @param cell_idx Index of the page table cell to be swapped.
+ * @return 0, or -1 if no frame could be taken.
  */
-void _handleSwap(struct Node *process_node, int cell_idx, int has_empty_frame) {
-  struct page_table_cell *page_cell = &process_node->data.page_table[cell_idx];
-  
-  int new_frame = -1;
-  if(!has_empty_frame) {
-    last_freed_frame_addr = searchLeastFrequentlyUsedFrameIdx(head_process, last_freed_frame_addr);
-    struct page_table_cell *last_freed_cell = &last_freed_frame_addr->initial_process->data.page_table[last_freed_frame_addr->initial_page];
-    mmu_nonresident(last_freed_frame_addr->initial_process->data.pid, (void *) last_freed_cell->page);
-    if(last_freed_cell->has_data) {
-      mmu_disk_write(last_freed_cell->frame, last_freed_cell->frame);
-    }
+int _handleSwap(struct Node *process_node, int cell_idx) {
+  pte_t *pte = &process_node->data.page_table[cell_idx];
 
-    last_freed_cell->present = 0;
-    new_frame = last_freed_cell->frame;
-  } else {
-    for (int i=0; i < frames_vector_size; i++) {
-      if (frames_vector[i] == -1) {
-        frames_vector[i] = process_node->data.pid;
-        free_frames--;
-        new_frame = i;
-        break;
-      }
-    }
-  }
+  int new_frame = takeFrame(process_node);
+  if (new_frame < 0) return -1;
 
-  
-  if(page_cell->has_data) {
-    mmu_disk_read(page_cell->frame, new_frame);
+  if(*pte & PTE_HAS_DATA) {
+    mmu_disk_read(process_node->data.blocks[cell_idx], new_frame);
   } else {
     mmu_zero_fill(new_frame);
   }
 
-  page_cell->frame = new_frame;
-  mmu_resident(process_node->data.pid, (void *) page_cell->page, page_cell->frame, PROT_READ);
-  page_cell->prot = PROT_READ;
-  page_cell->recently_accessed = 1;
+  pthread_mutex_lock(&frame_lock);
+  frameTableMap(new_frame, process_node, cell_idx);
+  pthread_mutex_unlock(&frame_lock);
+
+  mmu_resident(process_node->data.pid, (void *) pageAddress(cell_idx), new_frame, PROT_READ);
+  pteSetProt(pte, PROT_READ);
+  *pte |= PTE_VALID | PTE_PRESENT;
+  STAT_INC(process_node, pageins);
+
+  if (readahead_max > 0 && (*pte & PTE_HAS_DATA)) readAhead(process_node, cell_idx);
+  return 0;
 }
 
 /**
@@ -489,86 +3215,92 @@ void _handleSwap(struct Node *process_node, int cell_idx, int has_empty_frame) {
  *
  * @param pid The process ID.
  * @param addr The virtual address that caused the page fault.
+ * @return 0, or -1 with errno set to ENOMEM if the fault cannot be serviced.
  */
-void pager_fault(pid_t pid, void *addr) {
-  // Attempt to acquire the locker mutex
-  pthread_mutex_trylock(&locker);
-
-  // Search for the process node in the linked list
-  struct Node *process_node = searchByPid(head_process, pid);
-
-  // Iterate through the page table of the process
-  for (int i = 0; i < NUM_PAGES; i++) {
-    struct page_table_cell *page_cell = &process_node->data.page_table[i];
-    __intptr_t virtual_addr = (intptr_t) addr;
-   
-    // Check if the virtual address falls within the page cell range
-    short address_is_at_page_cell = page_cell->page <= virtual_addr && virtual_addr < page_cell->page + sysconf(_SC_PAGESIZE);
-    
-    if(address_is_at_page_cell) {
-      // Handle the case when the page is not valid
-      if(page_cell->valid == 0) {
-        if(free_frames > 0) {
-          // Find a free frame in the frames vector
-          for (int i=0; i < frames_vector_size; i++) {
-            if (frames_vector[i] == -1) {
-              frames_vector[i] = pid;
-              free_frames--;
-              page_cell->frame = i;
-              break;
-            }
-          }
-
-          // Zero-fill the frame and make it resident
-          mmu_zero_fill(page_cell->frame);
-          mmu_resident(pid, (void *) page_cell->page, page_cell->frame, PROT_READ);
-          page_cell->prot = PROT_READ;
-          page_cell->recently_accessed = 1;
-        } else {
-          // Handle the case when there are no free frames available
-          _handleSwap(process_node, i, 0);
-        }
-        
-        page_cell->valid = 1;
-        page_cell->present = 1;
-        process_node->data.frames_allocated++;
-        break;
-      } 
-      // Handle the case when the page is already present
-      else if(page_cell->present == 1) {
-        if(page_cell->prot == PROT_NONE) {
-          // Change the protection of the page to read-only
-          mmu_chprot(pid, (void *) page_cell->page, PROT_READ);
-          page_cell->prot = PROT_READ;
-        } else if(page_cell->prot == PROT_READ) {
-          // Change the protection of the page to read-write
-          mmu_chprot(pid, (void *) page_cell->page, PROT_READ | PROT_WRITE);
-          page_cell->prot = PROT_READ | PROT_WRITE;
-          page_cell->has_data = 1;
-        }
-        page_cell->recently_accessed = 1;
-      } 
-      // Handle the case when the page is not present
-      else if (page_cell->present == 0) {
-        _handleSwap(process_node, i, (free_frames > 0));
-        page_cell->present = 1;
-        break;
-      } 
+int pager_fault(pid_t pid, void *addr) {
+  // Search for the process node in the process table
+  struct Node *process_node = lookupProcess(pid);
+  if (process_node == NULL) return 0;
+
+  pthread_mutex_lock(&process_node->data.lock);
+  STAT_INC(process_node, faults);
+  int rc = 0;
+
+  // Find the faulting page directly from the address
+  long i = pageIndex((intptr_t) addr);
+  if (i < 0 || (size_t) i >= process_node->data.npages) {
+    pthread_mutex_unlock(&process_node->data.lock);
+    return 0;
+  }
+  pte_t *pte = &process_node->data.page_table[i];
+  void *page = (void *) pageAddress(i);
+
+  // A page shared while revoked is made readable; a readable one was written
+  if(*pte & PTE_SHARED) {
+    if(pteProt(*pte) == PROT_NONE) {
+      mmu_chprot(pid, page, PROT_READ);
+      pteSetProt(pte, PROT_READ);
+    } else {
+      rc = breakSharing(process_node, i);
     }
-
-    // Break the loop if the page cell is empty
-    if (page_cell->page == -1) break;
   }
+  // Reads of a page never written share the zero frame until it is written
+  else if(zero_frame >= 0 && !(*pte & (PTE_PRESENT | PTE_HAS_DATA))) {
+    if(*pte & PTE_ZERO) rc = unshareZeroFrame(process_node, i);
+    else mapZeroFrame(process_node, i);
+  }
+  // Handle the case when the page is not valid
+  else if(!(*pte & PTE_VALID)) {
+    // Zero-fill a frame and make it resident
+    rc = _handleSwap(process_node, i);
+  } 
+  // Handle the case when the page is already present
+  else if(*pte & PTE_PRESENT) {
+    if((*pte & PTE_READAHEAD) && readAheadHit(process_node, i)) {
+      // The page was read ahead and is now mapped read-only
+    } else if(pteProt(*pte) == PROT_NONE) {
+      // Change the protection of the page to read-only
+      mmu_chprot(pid, page, PROT_READ);
+      pteSetProt(pte, PROT_READ);
+    } else if(pteProt(*pte) == PROT_READ) {
+      // Change the protection of the page to read-write
+      mmu_chprot(pid, page, PROT_READ | PROT_WRITE);
+      pteSetProt(pte, PROT_READ | PROT_WRITE);
+      *pte |= PTE_HAS_DATA | PTE_DIRTY;
+      pageReleaseBlock(process_node, i);
+    }
+    frameAccessed(pteFrame(*pte));
+  } 
+  // Handle the case when the page is not present
+  else {
+    rc = _handleSwap(process_node, i);
+  } 
 
-  // Release the locker mutex
-  pthread_mutex_unlock(&locker);
+  int failed = rc < 0;
+  if (failed) process_node->data.failed_faults++;
+  else process_node->data.failed_faults = 0;
+  int give_up = process_node->data.failed_faults >= SWAP_FAILURE_RETRIES;
+  pthread_mutex_unlock(&process_node->data.lock);
+
+  // Memory and swap stayed exhausted for every retry: the process cannot go on
+  if (give_up) {
+    errno = ENOMEM;
+    return -1;
+  }
+  // Out of swap: give other processes time to free memory before the retry
+  if (failed) {
+    struct timespec backoff = {0, SWAP_FAILURE_BACKOFF_NS};
+    nanosleep(&backoff, NULL);
+  }
+  return 0;
 }
 
 /**
  * @brief Retrieves the contents of a memory region specified by the given process ID and address.
  * 
  * This function retrieves the contents of a memory region specified by the process ID and address.
- * It locks a mutex to ensure thread safety and returns the status of the syslog operation.
+ * It holds the process's lock, so the page cannot be evicted while it is printed, and returns the
+ * status of the syslog operation.
  * If the address is NULL, the function returns 0 without performing any operation.
  * If the memory region is present in the page table, it calculates the physical address and prints the contents.
  * The function returns 0 if the syslog operation is successful, otherwise -1.
@@ -579,25 +3311,86 @@ void pager_fault(pid_t pid, void *addr) {
  * @return int The status of the syslog operation. 0 if successful, -1 otherwise.
  */
 int pager_syslog(pid_t pid, void *addr, size_t len) {
-  pthread_mutex_trylock(&locker);
   int syslog_status = 0;
 
   if(addr == NULL) return syslog_status;
- 
 
-  struct page_table_cell *page_table_cell = searchByPage(head_process, pid, (intptr_t) addr);
-  if(page_table_cell != NULL && page_table_cell->present) {
-    __intptr_t shift = (intptr_t) addr - page_table_cell->page;
-    long physical_address = (page_table_cell->frame * sysconf(_SC_PAGESIZE)) + shift;
+  struct Node *process_node = lookupProcess(pid);
+  if(process_node == NULL) return -1;
+
+  pthread_mutex_lock(&process_node->data.lock);
+  long idx = searchByPage(process_node, (intptr_t) addr);
+  if(idx >= 0 && (process_node->data.page_table[idx] & (PTE_PRESENT | PTE_ZERO | PTE_SHARED))) {
+    __intptr_t shift = (intptr_t) addr - pageAddress(idx);
+    long physical_address = (pteFrame(process_node->data.page_table[idx]) * page_size) + shift;
 
+    // Keep the line in one piece when several processes syslog at once
+    flockfile(stdout);
     for(long i = physical_address; i < physical_address + len; i++) {
       printf("%02x", (unsigned)pmem[i]);
     }
     printf("\n");
+    funlockfile(stdout);
 
     syslog_status = 0;
   } else syslog_status = -1;
   
-  pthread_mutex_unlock(&locker);
+  pthread_mutex_unlock(&process_node->data.lock);
   return syslog_status;
-}
\ No newline at end of file
+}
+
+/**
+ * Logs the pager's counters, summed over destroyed and live processes.
+ */
+void pager_stats(void) {
+  pthread_rwlock_rdlock(&processes.lock);
+  pthread_mutex_lock(&frame_lock);
+  struct pager_stats total = retired_stats;
+  int frames_shared = nshared;
+  unsigned long pages_sharing = nsharing;
+  pthread_mutex_lock(&block_lock);
+  unsigned long pages_committed = committed_pages;
+  int blocks_used = block_allocator.size - block_allocator.nfree;
+  pthread_mutex_unlock(&block_lock);
+  // Live processes may still be counting; at shutdown they are idle
+  for (struct Node *node = processes.head; node != NULL; node = node->next) {
+    statsAdd(&total, &node->data.stats);
+    logWorkingSet(node, __func__);
+  }
+  pthread_mutex_unlock(&frame_lock);
+  pthread_rwlock_unlock(&processes.lock);
+
+  logd(LOG_INFO, "%s: policy %s\n", __func__, policy->name);
+  logd(LOG_INFO, "%s: faults %lu pageins %lu revocations %lu\n",
+       __func__, total.faults, total.pageins, total.revocations);
+  logd(LOG_INFO, "%s: evictions %lu clean victims %lu sync writebacks %lu (clean with data %lu) cleaned %lu\n",
+       __func__, total.evictions, total.evictions - total.writebacks, total.writebacks,
+       total.clean_evictions, total.cleaned);
+  logd(LOG_INFO, "%s: direct reclaim %lu background reclaim %lu\n", __func__,
+       total.evictions - total.background_evictions, total.background_evictions);
+  if (swap_cluster > 1) {
+    logd(LOG_INFO, "%s: swap clusters of up to %lu pages, %lu neighbours evicted with a victim\n",
+         __func__, swap_cluster, total.clustered);
+  }
+  if (QUOTAS_ENABLED()) {
+    logd(LOG_INFO, "%s: quotas min %lu max %lu frames, pages stolen by other processes %lu\n",
+         __func__, quota_min, quota_max, total.stolen);
+  }
+  if (overcommit) {
+    logd(LOG_INFO, "%s: overcommit %lu pages on %d of %d blocks, %lu faults failed for lack of swap\n",
+         __func__, pages_committed, blocks_used, block_allocator.size, total.swap_failures);
+  }
+  if (total.merges > 0) {
+    logd(LOG_INFO, "%s: dedup %d frames shared by %lu pages (%lu saved), merges %lu cow breaks %lu\n",
+         __func__, frames_shared, pages_sharing, pages_sharing - frames_shared,
+         total.merges, total.cow_breaks);
+  }
+  if (total.zero_maps > 0) {
+    logd(LOG_INFO, "%s: zero frame maps %lu\n", __func__, total.zero_maps);
+  }
+  if (total.readaheads > 0) {
+    logd(LOG_INFO, "%s: readahead %lu pages, hits %.1f%% waste %.1f%%\n", __func__,
+         total.readaheads, 100.0 * total.readahead_hits / total.readaheads,
+         100.0 * total.readahead_waste / total.readaheads);
+  }
+}
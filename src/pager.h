@@ -13,6 +13,66 @@
  * backing store, respectively. */
 void pager_init(int nframes, int nblocks);
 
+/* `pager_setopt` sets an optional pager feature before `pager_init`
+ * is called.  The MMU passes each NAME=VALUE argument it does not
+ * handle itself.  Every option defaults to the behavior described in
+ * this file.  Returns 0 on success, or -1 if `name` is unknown or
+ * `value` is invalid.  Options:
+ *
+ *   policy=clock|wsclock|clockpro|arc   page replacement policy
+ *   wsclock_tau=N                       WSClock working set window, in
+ *                                       frames taken (default NFRAMES/2)
+ *   cleaner=0|1                         write back dirty pages about to
+ *                                       be evicted in a background thread
+ *   cleaner_lookahead=N                 frames the cleaner examines per
+ *                                       pass (default NFRAMES/4)
+ *   cleaner_batch=N                     pages written per pass (default 8)
+ *   cleaner_interval=N                  microseconds between passes
+ *                                       (default 1000)
+ *   reclaim_low=N, reclaim_high=N       free frame watermarks: when fewer
+ *                                       than reclaim_low frames are free,
+ *                                       a background thread evicts pages
+ *                                       until reclaim_high are (default 0,
+ *                                       no background reclaim)
+ *   readahead=N                         read up to N pages of a strided
+ *                                       fault stream ahead into free
+ *                                       frames (default 0, no readahead)
+ *   readahead_map=0|1                   map pages read ahead right away
+ *   zero_frame=0|1                      reserve a frame that reads of
+ *                                       never-written pages share
+ *   overcommit=PERCENT                  let extended pages total PERCENT
+ *                                       of NBLOCKS and give a page its
+ *                                       block when first written back
+ *                                       (default 0, a block per page)
+ *   swap_cluster=N                      evict up to N cold neighbouring
+ *                                       pages with a victim and write
+ *                                       them to consecutive blocks in one
+ *                                       operation (default 0, one page)
+ *   quota_max=N                         a process holding N frames
+ *                                       replaces its own pages (default
+ *                                       0, no limit)
+ *   quota_min=N                         other processes' faults leave a
+ *                                       process up to N frames of its
+ *                                       working set (default 0)
+ *   ws_window=N                         faults less than N frames taken
+ *                                       apart grow a working set (default
+ *                                       NFRAMES)
+ *   dedup=0|1                           merge pages with identical
+ *                                       contents in a background thread
+ *   dedup_batch=N                       frames scanned per pass
+ *                                       (default 64)
+ *   dedup_interval=N                    microseconds between passes
+ *                                       (default 1000) */
+int pager_setopt(const char *name, const char *value);
+
+/* `pager_shutdown` stops the pager's background threads; the MMU calls
+ * it before tearing down its clients. */
+void pager_shutdown(void);
+
+/* `pager_stats` logs the pager's counters; the MMU calls it at
+ * shutdown. */
+void pager_stats(void);
+
 /* `pager_create` should initialize any resources the pager needs to
  * manage memory for a new process `pid`. */
 void pager_create(pid_t pid);
@@ -26,9 +86,18 @@ void pager_create(pid_t pid);
  * use as backing storage. */
 void *pager_extend(pid_t pid);
 
+/* `pager_extend_n` allocates `n` contiguous pages to process `pid`
+ * and returns a pointer to the first one.  It is all-or-nothing: it
+ * returns NULL and allocates nothing if the `n` pages do not all get
+ * backing storage. */
+void *pager_extend_n(pid_t pid, size_t n);
+
 /* `pager_fault` is called when process `pid` receives
  * a segmentation fault at address `addr`.  `pager_fault` is only
- * called for addresses previously returned with `pager_extend`.  If
+ * called for addresses previously returned with `pager_extend`.  It
+ * returns 0, after which the process retries the access, or -1 with
+ * errno set to ENOMEM if the fault cannot be serviced because memory
+ * and disk blocks stay exhausted, after which the process exits.  If
  * free memory frames exist, `pager_fault` should use the
  * lowest-numbered frame to service the page fault.  If no free
  * memory frames exist, `pager_fault` should use the second-chance
@@ -38,7 +107,7 @@ void *pager_extend(pid_t pid);
  * memory management infrastructure does not maintain page access
  * and writing information, your pager must track this information
  * to implement the second-chance algorithm. */
-void pager_fault(pid_t pid, void *addr);
+int pager_fault(pid_t pid, void *addr);
 
 /* `pager_syslog prints a message made of `len` bytes following
  * `addr` in the address space of process `pid`.  `pager_syslog`
@@ -52,7 +121,7 @@ int pager_syslog(pid_t pid, void *addr, size_t len);
 /* `pager_destroy` is called when the process is already dead.  It
  * should free all resources process `pid` allocated (memory frames
  * and disk blocks).  `pager_destroy` should not call any of the MMU
- * functions. */
+ * functions but `mmu_disk_discard`. */
 void pager_destroy(pid_t pid);
 
 #endif
@@ -0,0 +1,23 @@
+/* UNIVERSIDADE FEDERAL DE MINAS GERAIS     *
+ * DEPARTAMENTO DE CIENCIA DA COMPUTACAO    *
+ * Copyright (c) Italo Fernando Scota Cunha */
+
+#ifndef __PIDHASH_HEADER__
+#define __PIDHASH_HEADER__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* `pid_hash` maps `pid` to a bucket of a table with `nbuckets`
+ * buckets, a power of two.  It is Fibonacci hashing: the product of
+ * `pid` and 2^32 divided by the golden ratio keeps its top
+ * log2(nbuckets) bits, which spreads sequential pids evenly. */
+static inline size_t pid_hash(pid_t pid, size_t nbuckets)
+{
+	unsigned bits = (unsigned)__builtin_ctzll(nbuckets);
+	uint64_t h = (uint32_t)((uint32_t)pid * 2654435769u);
+	return (size_t)(h >> (32 - bits));
+}
+
+#endif
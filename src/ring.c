@@ -0,0 +1,164 @@
+/* UNIVERSIDADE FEDERAL DE MINAS GERAIS     *
+ * DEPARTAMENTO DE CIENCIA DA COMPUTACAO    *
+ * Copyright (c) Italo Fernando Scota Cunha */
+
+#define _GNU_SOURCE
+#include "ring.h"
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_SPIN_MIN 64
+#define RING_SPIN_MAX (1 << 14)
+#define RING_YIELD_MIN 2
+#define RING_YIELD_MAX 16
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ring_relax() __builtin_ia32_pause()
+#else
+#define ring_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static int ring_ncpus = 0;
+
+struct ring_shm * ring_shm_create(int *fd)/*{{{*/
+{
+	*fd = memfd_create("mmu.ring", MFD_CLOEXEC);
+	if(*fd == -1) return NULL;
+	struct ring_shm *shm = NULL;
+	if(ftruncate(*fd, sizeof(*shm)) == 0) shm = ring_shm_map(*fd);
+	if(!shm) {
+		close(*fd);
+		*fd = -1;
+	}
+	return shm;
+}/*}}}*/
+
+struct ring_shm * ring_shm_map(int fd)/*{{{*/
+{
+	void *p = mmap(NULL, sizeof(struct ring_shm), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : p;
+}/*}}}*/
+
+void ring_shm_unmap(struct ring_shm *shm)/*{{{*/
+{
+	munmap(shm, sizeof(*shm));
+}/*}}}*/
+
+size_t ring_used(struct ring *r)/*{{{*/
+{
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	return tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}/*}}}*/
+
+uint32_t ring_tail(struct ring *r)/*{{{*/
+{
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}/*}}}*/
+
+static void ring_copy_out(const struct ring *r, uint32_t pos, void *buf, size_t len)/*{{{*/
+{
+	size_t off = pos & (RING_SIZE - 1);
+	size_t n = len < RING_SIZE - off ? len : RING_SIZE - off;
+	memcpy(buf, r->data + off, n);
+	memcpy((char *)buf + n, r->data, len - n);
+}/*}}}*/
+
+int ring_peek(struct ring *r, void *buf, size_t len)/*{{{*/
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if(ring_tail(r) - head < len) return 0;
+	ring_copy_out(r, head, buf, len);
+	return 1;
+}/*}}}*/
+
+void ring_read(struct ring *r, void *buf, size_t len)/*{{{*/
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	assert(ring_tail(r) - head >= len);
+	ring_copy_out(r, head, buf, len);
+	__atomic_store_n(&r->head, head + (uint32_t)len, __ATOMIC_RELEASE);
+}/*}}}*/
+
+int ring_peer_gone(int sock)/*{{{*/
+{
+	struct pollfd pfd = {sock, POLLRDHUP, 0};
+	if(poll(&pfd, 1, 0) <= 0) return 0;
+	return (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}/*}}}*/
+
+int ring_write(struct ring *r, const void *buf, size_t len, int sock)/*{{{*/
+{
+	assert(len <= RING_SIZE);
+	uint32_t tail = r->tail;
+	while(RING_SIZE - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) < len) {
+		/* a consumer that went away never makes room */
+		if(ring_peer_gone(sock)) return -1;
+		sched_yield();
+	}
+	size_t off = tail & (RING_SIZE - 1);
+	size_t n = len < RING_SIZE - off ? len : RING_SIZE - off;
+	memcpy(r->data + off, buf, n);
+	memcpy(r->data, (const char *)buf + n, len - n);
+	/* Pairs with the fetch_or in ring_arm: either the consumer sees
+	 * the new tail or we see its bit. */
+	__atomic_store_n(&r->tail, tail + (uint32_t)len, __ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) return 0;
+	uint32_t bits = __atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+	if(bits & RING_WAIT_SOCK) {
+		char b = 0;
+		send(sock, &b, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+	if(bits & RING_WAIT_FUTEX)
+		syscall(SYS_futex, &r->tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	return 0;
+}/*}}}*/
+
+int ring_spin(struct ring *r, size_t len)/*{{{*/
+{
+	/* With a single CPU the producer cannot run while we spin, so we
+	 * yield to it a few times instead. */
+	if(!ring_ncpus) ring_ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t min = ring_ncpus > 1 ? RING_SPIN_MIN : RING_YIELD_MIN;
+	uint32_t max = ring_ncpus > 1 ? RING_SPIN_MAX : RING_YIELD_MAX;
+	uint32_t budget = __atomic_load_n(&r->spin, __ATOMIC_RELAXED);
+	if(budget < min) budget = min;
+	if(budget > max) budget = max;
+	for(uint32_t i = 0; i < budget; ++i) {
+		if(ring_used(r) >= len) {
+			if(budget < max) budget *= 2;
+			__atomic_store_n(&r->spin, budget, __ATOMIC_RELAXED);
+			return 1;
+		}
+		if(ring_ncpus > 1) ring_relax();
+		else sched_yield();
+	}
+	__atomic_store_n(&r->spin, budget / 2, __ATOMIC_RELAXED);
+	return ring_used(r) >= len;
+}/*}}}*/
+
+int ring_arm(struct ring *r, uint32_t bit)/*{{{*/
+{
+	__atomic_fetch_or(&r->waiting, bit, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) ==
+			__atomic_load_n(&r->head, __ATOMIC_RELAXED);
+}/*}}}*/
+
+void ring_futex_wait(struct ring *r, uint32_t tail, int timeout_ms)/*{{{*/
+{
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+	syscall(SYS_futex, &r->tail, FUTEX_WAIT, tail, &ts, NULL, 0);
+}/*}}}*/
@@ -0,0 +1,89 @@
+/* UNIVERSIDADE FEDERAL DE MINAS GERAIS     *
+ * DEPARTAMENTO DE CIENCIA DA COMPUTACAO    *
+ * Copyright (c) Italo Fernando Scota Cunha */
+
+/* Shared-memory message rings
+ *
+ * A `ring_shm` is a pair of single-producer, single-consumer byte
+ * rings in a memfd shared by the MMU and one client.  The `req` ring
+ * carries the messages the client would send on its socket, the `rep`
+ * ring those the MMU would send; messages keep the layout and order
+ * they have on the socket.  Each message is written whole, so a
+ * reader that sees its type can read the rest without waiting.
+ * Callers serialize producers and consumers of a ring themselves.
+ *
+ * A consumer that finds a ring empty spins for a while (`ring_spin`)
+ * and then sleeps.  Before sleeping it sets a bit in `waiting` with
+ * `ring_arm`, which tells the producer how to wake it: by sending a
+ * byte on the socket (RING_WAIT_SOCK), which MMU threads can poll and
+ * epoll along with the socket closing, or with a futex wake on `tail`
+ * (RING_WAIT_FUTEX).  A producer only makes a syscall when a consumer
+ * set one of these bits. */
+
+#ifndef __RING_HEADER__
+#define __RING_HEADER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_SIZE (1 << 16)
+#define RING_WAIT_SOCK 1
+#define RING_WAIT_FUTEX 2
+
+struct ring {
+	uint32_t head;		/* bytes consumed */
+	uint32_t spin;		/* consumer spin budget */
+	char pad0[56];
+	uint32_t tail;		/* bytes produced */
+	uint32_t waiting;	/* RING_WAIT_* bits of sleeping consumers */
+	char pad1[56];
+	char data[RING_SIZE];
+};
+
+struct ring_shm {
+	struct ring req;	/* client to MMU */
+	struct ring rep;	/* MMU to client */
+};
+
+/* `ring_shm_create` creates a memfd holding a zeroed `ring_shm`, maps
+ * it and stores the descriptor in `fd`; `ring_shm_map` maps the one
+ * in `fd` received from the other side.  Both return NULL on failure.
+ * `ring_shm_unmap` undoes either. */
+struct ring_shm * ring_shm_create(int *fd);
+struct ring_shm * ring_shm_map(int fd);
+void ring_shm_unmap(struct ring_shm *shm);
+
+/* `ring_peek` copies the next `len` bytes of `r` into `buf` without
+ * consuming them and returns 1, or returns 0 if fewer are there.
+ * `ring_read` consumes `len` bytes, which must be there. */
+int ring_peek(struct ring *r, void *buf, size_t len);
+void ring_read(struct ring *r, void *buf, size_t len);
+
+/* `ring_write` appends a message of `len` bytes to `r`, waiting for
+ * room if needed, and wakes a consumer that armed the ring.  `sock`
+ * is where RING_WAIT_SOCK consumers are woken.  Returns 0, or -1 if
+ * the ring is full and the other side closed `sock`. */
+int ring_write(struct ring *r, const void *buf, size_t len, int sock);
+
+/* `ring_spin` busy-waits until `len` bytes are in `r` and returns 1,
+ * or returns 0 once the spin budget is spent.  The budget doubles
+ * whenever spinning pays off and halves when it does not. */
+int ring_spin(struct ring *r, size_t len);
+
+/* `ring_arm` sets `bit` in `waiting` and returns 1 if `r` is still
+ * empty, so the consumer may sleep; if data arrived meanwhile it
+ * returns 0.  `ring_futex_wait` sleeps until `tail` moves past
+ * `tail` or `timeout_ms` elapses. */
+int ring_arm(struct ring *r, uint32_t bit);
+void ring_futex_wait(struct ring *r, uint32_t tail, int timeout_ms);
+
+/* `ring_peer_gone` returns 1 if the other side closed `sock`, even
+ * with wakeup bytes still unread. */
+int ring_peer_gone(int sock);
+
+/* `ring_used` returns how many bytes `r` holds, and `ring_tail` the
+ * current producer position. */
+size_t ring_used(struct ring *r);
+uint32_t ring_tail(struct ring *r);
+
+#endif
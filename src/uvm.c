@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +26,7 @@
 
 #include "mmu.h"
 #include "mmuproto.h"
+#include "ring.h"
 
 /****************************************************************************
  * structure definitions and static variables
@@ -38,6 +40,7 @@ struct uvm_data {/*{{{*/
 	pthread_cond_t cond;
 	char *pmem_fn;
 	int pmem_fd;
+	struct ring_shm *shm;	/* NULL if we talk over the socket */
 	intptr_t result;
 };/*}}}*/
 
@@ -52,15 +55,22 @@ static void uvm_segv_action(int signum, siginfo_t *si, void *context);
 
 /* Protocol message handlers assume assume `uvm->mutex` is locked. */
 static void uvm_proto_extend_rep(void);
+static void uvm_proto_extend_n_rep(void);
 static void uvm_proto_syslog_rep(void);
 static void uvm_proto_segv_rep(void);
 static void uvm_proto_remap_rep(void);
 static void uvm_proto_chprot_rep(void);
+static void uvm_proto_remap_n_rep(void);
+static void uvm_proto_chprot_n_rep(void);
 
 /* Helper functions */
 static void uvm_connect_socket(int sock, const struct sockaddr_un * addr);
+static ssize_t uvm_peek(uint32_t *type);
+static ssize_t uvm_recv(void *buf, size_t len);
+static ssize_t uvm_send(const void *buf, size_t len);
 
 #define NUM_CONNECTION_TRIES 3
+#define UVM_RING_POLL_MS 100
 
 #define prexit() do { loge(LOG_FATAL, __FILE__, __LINE__); \
 			char buf[80]; sprintf(buf, "%s:%d: ", __FILE__, __LINE__); \
@@ -96,14 +106,34 @@ void uvm_create(void)/*{{{*/
 	struct mmu_proto_create_req req;
 	req.type = MMU_PROTO_CREATE_REQ;
 	req.pid = (uint32_t)getpid();
+	req.flags = MMU_PROTO_CREATE_RINGS;
 	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req))
 		prexit();
 
 	logd(LOG_DEBUG, "  waiting CREATE_REP\n");
 	struct mmu_proto_create_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep)) prexit();
+	struct iovec iov = {&rep, sizeof(rep)};
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	if(recvmsg(uvm->sock, &mh, MSG_WAITALL) != sizeof(rep)) prexit();
 	assert(rep.type == MMU_PROTO_CREATE_REP);
 
+	uvm->shm = NULL;
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	if(cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+		int fd;
+		memcpy(&fd, CMSG_DATA(cm), sizeof(fd));
+		if(rep.flags & MMU_PROTO_CREATE_RINGS) uvm->shm = ring_shm_map(fd);
+		if(!uvm->shm) prexit();
+		close(fd);
+		logd(LOG_DEBUG, "  using shared-memory rings\n");
+	}
+
 	uvm->pmem_fn = strndup(rep.pmem_fn, MMU_PROTO_PATH_MAX);
 	logd(LOG_DEBUG, "  mapping pmem_fn [%s]\n", uvm->pmem_fn);
 	uvm->pmem_fd = open(uvm->pmem_fn, O_RDWR);
@@ -133,7 +163,7 @@ void * uvm_extend(void) {/*{{{*/
 	pthread_mutex_lock(&uvm->mutex);
 	struct mmu_proto_extend_req req;
 	req.type = MMU_PROTO_EXTEND_REQ;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req))
+	if(uvm_send(&req, sizeof(req)) != sizeof(req))
 		prexit();
 	pthread_cond_wait(&uvm->cond, &uvm->mutex);
 	if(uvm->result) uvm->npages++;
@@ -141,6 +171,20 @@ void * uvm_extend(void) {/*{{{*/
 	return (void *)uvm->result;
 }/*}}}*/
 
+void * uvm_extend_n(size_t n) {/*{{{*/
+	pthread_mutex_lock(&uvm->mutex);
+	struct mmu_proto_extend_n_req req;
+	req.type = MMU_PROTO_EXTEND_N_REQ;
+	req.count = (uint32_t)n;
+	if(uvm_send(&req, sizeof(req)) != sizeof(req))
+		prexit();
+	pthread_cond_wait(&uvm->cond, &uvm->mutex);
+	if(uvm->result) uvm->npages += n;
+	else errno = ENOSPC;
+	pthread_mutex_unlock(&uvm->mutex);
+	return (void *)uvm->result;
+}/*}}}*/
+
 int uvm_syslog(void *addr, size_t len)/*{{{*/
 {
 	pthread_mutex_lock(&uvm->mutex);
@@ -148,7 +192,7 @@ int uvm_syslog(void *addr, size_t len)/*{{{*/
 	req.type = MMU_PROTO_SYSLOG_REQ;
 	req.addr = (intptr_t)addr;
 	req.len = len;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req))
+	if(uvm_send(&req, sizeof(req)) != sizeof(req))
 		prexit();
 	pthread_cond_wait(&uvm->cond, &uvm->mutex);
 	if(uvm->result != 0) errno = EINVAL;
@@ -169,7 +213,7 @@ void * uvm_thread(void *data) {/*{{{*/
 	while(uvm->running) {
 		logd(LOG_DEBUG, "uvm_thread waiting message\n");
 		uint32_t type;
-		ssize_t c = recv(uvm->sock, &type, sizeof(type), MSG_PEEK);
+		ssize_t c = uvm_peek(&type);
 		if(!uvm->running) break;
 		if(c != sizeof(type)) prexit();
 		pthread_mutex_lock(&uvm->mutex);
@@ -177,6 +221,9 @@ void * uvm_thread(void *data) {/*{{{*/
 			case MMU_PROTO_EXTEND_REP:
 				uvm_proto_extend_rep();
 				break;
+			case MMU_PROTO_EXTEND_N_REP:
+				uvm_proto_extend_n_rep();
+				break;
 			case MMU_PROTO_SYSLOG_REP:
 				uvm_proto_syslog_rep();
 				break;
@@ -189,6 +236,12 @@ void * uvm_thread(void *data) {/*{{{*/
 			case MMU_PROTO_CHPROT_REP:
 				uvm_proto_chprot_rep();
 				break;
+			case MMU_PROTO_REMAP_N_REP:
+				uvm_proto_remap_n_rep();
+				break;
+			case MMU_PROTO_CHPROT_N_REP:
+				uvm_proto_chprot_n_rep();
+				break;
 			case MMU_PROTO_EXIT_REP:
 				uvm->running = 0;
 				break;
@@ -208,10 +261,11 @@ void uvm_exit(int status, void *arg)/*{{{*/
 	struct mmu_proto_exit_req req;
 	req.type = MMU_PROTO_EXIT_REQ;
 	/* socket may have been closed by the MMU, ignore return value: */
-	send(uvm->sock, &req, sizeof(req), 0);
+	uvm_send(&req, sizeof(req));
 	pthread_mutex_unlock(&(uvm->mutex));
 	pthread_join(uvm->thread, NULL);
 	close(uvm->sock);
+	if(uvm->shm) ring_shm_unmap(uvm->shm);
 
 	pthread_mutex_destroy(&uvm->mutex);
 	pthread_cond_destroy(&uvm->cond);
@@ -247,11 +301,26 @@ void uvm_segv_action(int signum, siginfo_t *si, void *context)/*{{{*/
 	req.type = MMU_PROTO_SEGV_REQ;
 	req.addr = (intptr_t)si->si_addr;
 	req.code = si->si_code;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req)) prexit();
+	if(uvm_send(&req, sizeof(req)) != sizeof(req)) prexit();
 
 	logd(LOG_DEBUG, "%s waiting service at condition variable\n", __func__);
 	pthread_cond_wait(&uvm->cond, &uvm->mutex);
+	int failed = uvm->result != 0;
+	if(failed) {
+		/* The MMU could not page the address in.  We leave without
+		 * on_exit teardown, which is not safe in a signal handler, so
+		 * we tell the MMU we are exiting ourselves. */
+		struct mmu_proto_exit_req exit_req;
+		exit_req.type = MMU_PROTO_EXIT_REQ;
+		uvm_send(&exit_req, sizeof(exit_req));
+	}
 	pthread_mutex_unlock(&uvm->mutex);
+	if(failed) {
+		static const char msg[] = "(internal) out of memory.\n"
+				"page fault could not be serviced.\n";
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+		_exit(EXIT_FAILURE);
+	}
 	logd(LOG_DEBUG, "%s returning\n", __func__);
 }/*}}}*/
 
@@ -262,18 +331,29 @@ void uvm_proto_extend_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing EXTEND_REP\n");
 	struct mmu_proto_extend_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep)) != sizeof(rep))
 		prexit();
 	assert(rep.type == MMU_PROTO_EXTEND_REP);
 	uvm->result = (intptr_t)rep.vaddr;
 	pthread_cond_signal(&uvm->cond);
 }/*}}}*/
 
+void uvm_proto_extend_n_rep(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "processing EXTEND_N_REP\n");
+	struct mmu_proto_extend_n_rep rep;
+	if(uvm_recv(&rep, sizeof(rep)) != sizeof(rep))
+		prexit();
+	assert(rep.type == MMU_PROTO_EXTEND_N_REP);
+	uvm->result = (intptr_t)rep.vaddr;
+	pthread_cond_signal(&uvm->cond);
+}/*}}}*/
+
 void uvm_proto_syslog_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing SYSLOG_REP\n");
 	struct mmu_proto_syslog_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep)) != sizeof(rep))
 		prexit();
 	assert(rep.type == MMU_PROTO_SYSLOG_REP);
 	uvm->result = (intptr_t)rep.retcode;
@@ -284,9 +364,10 @@ void uvm_proto_segv_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing SEGV_REP\n");
 	struct mmu_proto_segv_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep)) != sizeof(rep))
 		prexit();
 	assert(rep.type == MMU_PROTO_SEGV_REP);
+	uvm->result = (intptr_t)rep.retcode;
 	pthread_cond_signal(&uvm->cond);
 }/*}}}*/
 
@@ -294,7 +375,7 @@ void uvm_proto_remap_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing REMAP_REP\n");
 	struct mmu_proto_remap_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep)) != sizeof(rep))
 		prexit();
 	assert(rep.type == MMU_PROTO_REMAP_REP);
 	assert(rep.prot != PROT_NONE);
@@ -316,14 +397,14 @@ void uvm_proto_remap_rep(void)/*{{{*/
 
 	struct mmu_proto_remap_req req;
 	req.type = MMU_PROTO_REMAP_REQ;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req)) prexit();
+	if(uvm_send(&req, sizeof(req)) != sizeof(req)) prexit();
 }/*}}}*/
 
 void uvm_proto_chprot_rep(void)/*{{{*/
 {
 	logd(LOG_DEBUG, "processing CHPROT_REP\n");
 	struct mmu_proto_chprot_rep rep;
-	if(recv(uvm->sock, &rep, sizeof(rep), 0) != sizeof(rep))
+	if(uvm_recv(&rep, sizeof(rep)) != sizeof(rep))
 		prexit();
 	assert(rep.type == MMU_PROTO_CHPROT_REP);
 
@@ -342,12 +423,124 @@ void uvm_proto_chprot_rep(void)/*{{{*/
 
 	struct mmu_proto_chprot_req req;
 	req.type = MMU_PROTO_CHPROT_REQ;
-	if(send(uvm->sock, &req, sizeof(req), 0) != sizeof(req)) prexit();
+	if(uvm_send(&req, sizeof(req)) != sizeof(req)) prexit();
+}/*}}}*/
+
+void uvm_proto_remap_n_rep(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "processing REMAP_N_REP\n");
+	struct mmu_proto_remap_n_rep rep;
+	size_t hdr = offsetof(struct mmu_proto_remap_n_rep, pages);
+	if(uvm_recv(&rep, hdr) != (ssize_t)hdr)
+		prexit();
+	assert(rep.type == MMU_PROTO_REMAP_N_REP);
+	assert(rep.count >= 1 && rep.count <= MMU_PROTO_VEC_MAX);
+	size_t len = rep.count * sizeof(rep.pages[0]);
+	if(uvm_recv(rep.pages, len) != (ssize_t)len)
+		prexit();
+
+	/* Pages that are adjacent both in memory and in the file, with
+	 * the same protection, are remapped together. */
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	for(uint32_t i = 0, j; i < rep.count; i = j) {
+		const struct mmu_proto_remap_entry *e = &rep.pages[i];
+		assert(e->prot != PROT_NONE);
+		for(j = i + 1; j < rep.count; ++j) {
+			const struct mmu_proto_remap_entry *f = &rep.pages[j];
+			if(f->prot != e->prot) break;
+			if(f->vaddr != e->vaddr + (j - i) * pagesz) break;
+			if(f->offset != e->offset + (j - i) * pagesz) break;
+		}
+		void *addr = (void *)(intptr_t)e->vaddr;
+		size_t size = (j - i) * pagesz;
+		logd(LOG_DEBUG, "remapping %p at offset %llu prot %d, %u pages\n",
+				addr, (unsigned long long)e->offset, (int)e->prot,
+				j - i);
+		munmap(addr, size);
+		void *r = mmap(addr, size, (int)e->prot, MAP_SHARED,
+				uvm->pmem_fd, (off_t)e->offset);
+		if(r != addr)
+			prexit();
+		if(mprotect(addr, size, (int)e->prot) == -1)
+			prexit();
+	}
+
+	struct mmu_proto_remap_req req;
+	req.type = MMU_PROTO_REMAP_REQ;
+	if(uvm_send(&req, sizeof(req)) != sizeof(req)) prexit();
+}/*}}}*/
+
+void uvm_proto_chprot_n_rep(void)/*{{{*/
+{
+	logd(LOG_DEBUG, "processing CHPROT_N_REP\n");
+	struct mmu_proto_chprot_n_rep rep;
+	size_t hdr = offsetof(struct mmu_proto_chprot_n_rep, pages);
+	if(uvm_recv(&rep, hdr) != (ssize_t)hdr)
+		prexit();
+	assert(rep.type == MMU_PROTO_CHPROT_N_REP);
+	assert(rep.count >= 1 && rep.count <= MMU_PROTO_VEC_MAX);
+	size_t len = rep.count * sizeof(rep.pages[0]);
+	if(uvm_recv(rep.pages, len) != (ssize_t)len)
+		prexit();
+
+	/* Adjacent pages getting the same protection take one mprotect. */
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	for(uint32_t i = 0, j; i < rep.count; i = j) {
+		const struct mmu_proto_chprot_entry *e = &rep.pages[i];
+		for(j = i + 1; j < rep.count; ++j) {
+			const struct mmu_proto_chprot_entry *f = &rep.pages[j];
+			if(f->prot != e->prot) break;
+			if(f->vaddr != e->vaddr + (j - i) * pagesz) break;
+		}
+		void *addr = (void *)(uintptr_t)e->vaddr;
+		logd(LOG_DEBUG, "mprotect %p prot %d, %u pages\n", addr,
+				(int)e->prot, j - i);
+		if(mprotect(addr, (j - i) * pagesz, (int)e->prot) == -1)
+			prexit();
+	}
+
+	struct mmu_proto_chprot_req req;
+	req.type = MMU_PROTO_CHPROT_REQ;
+	if(uvm_send(&req, sizeof(req)) != sizeof(req)) prexit();
 }/*}}}*/
 
 /****************************************************************************
- * external functions
+ * helper functions
  ***************************************************************************/
+/* These read and write messages on the rings if the MMU gave us some in
+ * CREATE and on the socket if not, and return what recv and send would.
+ * The MMU does not write to the socket of a client using rings, so a
+ * readable socket means it is gone. */
+ssize_t uvm_peek(uint32_t *type)/*{{{*/
+{
+	if(!uvm->shm) return recv(uvm->sock, type, sizeof(*type), MSG_PEEK);
+	struct ring *r = &uvm->shm->rep;
+	for(;;) {
+		if(ring_peek(r, type, sizeof(*type))) return sizeof(*type);
+		if(ring_spin(r, sizeof(*type))) continue;
+		uint32_t tail = ring_tail(r);
+		if(!ring_arm(r, RING_WAIT_FUTEX)) continue;
+		ring_futex_wait(r, tail, UVM_RING_POLL_MS);
+		if(!ring_used(r) && ring_peer_gone(uvm->sock)) return 0;
+	}
+}/*}}}*/
+
+ssize_t uvm_recv(void *buf, size_t len)/*{{{*/
+{
+	if(!uvm->shm) return recv(uvm->sock, buf, len, MSG_WAITALL);
+	/* messages are written whole, so the peeked one is all there */
+	if(ring_used(&uvm->shm->rep) < len) return -1;
+	ring_read(&uvm->shm->rep, buf, len);
+	return len;
+}/*}}}*/
+
+ssize_t uvm_send(const void *buf, size_t len)/*{{{*/
+{
+	if(!uvm->shm) return send(uvm->sock, buf, len, 0);
+	if(ring_write(&uvm->shm->req, buf, len, uvm->sock)) return -1;
+	return len;
+}/*}}}*/
+
 void uvm_connect_socket(int sock, const struct sockaddr_un * addr) {
 	int try = 0;
 	do {
@@ -22,6 +22,12 @@ void uvm_create(void);
  * system page size is given by `sysconf(_SC_PAGESIZE)`. */
 void * uvm_extend(void);
 
+/* `uvm_extend_n` allocates `n` contiguous pages in a single request
+ * and returns the address of the first one.  It is all-or-nothing:
+ * if the swap cannot back all `n` pages, none is allocated and it
+ * returns NULL and sets `errno` to ENOSPC. */
+void * uvm_extend_n(size_t n);
+
 /* `uvm_syslog` requests the memory infrastructure to write the
  * string at `addr` with `len` bytes.  Memory at `addr` must be
  * managed by the memory infrastructure (i.e., allocated with